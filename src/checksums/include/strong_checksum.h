@@ -24,6 +24,18 @@ public:
 
   static StrongChecksum Compute(std::istream &input);
 
+  /**
+   * Computes the root of a two level hash tree.
+   * The leaves are the strong checksums of the consecutive blocks of the data
+   * (the last one zero padded), so they can be computed independently and in
+   * parallel. The data size is mixed into the root, which disambiguates data
+   * that differs only in trailing zeros.
+   */
+  static StrongChecksum ComputeTree(
+      const StrongChecksum *leaves,
+      std::streamsize count,
+      std::streamsize data_size);
+
   bool operator==(const StrongChecksum &other) const;
 
   [[nodiscard]] std::string ToString() const;
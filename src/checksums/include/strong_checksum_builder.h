@@ -1,6 +1,7 @@
 #ifndef KSYNC_STRONG_CHECKSUM_BUILDER_H
 #define KSYNC_STRONG_CHECKSUM_BUILDER_H
 
+#include <cstdint>
 #include <memory>
 
 #include <kysync/checksums/strong_checksum.h>
@@ -15,6 +16,12 @@ class StrongChecksumBuilder final {
 public:
   StrongChecksumBuilder();
 
+  /**
+   * Seeds the digest, so that e.g. the root of a hash tree (see
+   * `StrongChecksum::ComputeTree`) can be built from its leaves in parts.
+   */
+  explicit StrongChecksumBuilder(uint64_t seed);
+
   void Update(const void* buffer, std::streamsize size);
 
   StrongChecksum Digest();
@@ -55,6 +55,26 @@ uint32_t WeakChecksum(
     uint32_t running_checksum,
     const WeakChecksumCallback &callback);
 
+/**
+ * computes a running window checksum like the above, but stores the checksum
+ * of each window in `checksums` instead of calling back for it
+ *
+ * - `checksums[i]` is the checksum of the window that ends with `buffer[i]`,
+ *   i.e. at offset `i + 1 - size`
+ * - `checksums` must have room for `size` checksums
+ *
+ * @param buffer
+ * @param size
+ * @param running_checksum
+ * @param checksums
+ * @return
+ */
+uint32_t WeakChecksum(
+    const void *buffer,
+    std::streamsize size,
+    uint32_t running_checksum,
+    uint32_t *checksums);
+
 }  // namespace kysync
 
 #endif  // KSYNC_WEAK_CHECKSUM_H
@@ -37,6 +37,18 @@ StrongChecksum StrongChecksum::Compute(std::istream &input) {
   return {digest.high64, digest.low64};
 }
 
+StrongChecksum StrongChecksum::ComputeTree(
+    const StrongChecksum *leaves,
+    std::streamsize count,
+    std::streamsize data_size) {
+  auto digest = XXH3_128bits_withSeed(
+      leaves,
+      count * sizeof(StrongChecksum),
+      data_size);
+
+  return {digest.high64, digest.low64};
+}
+
 bool StrongChecksum::operator==(const StrongChecksum &other) const {
   return hi_ == other.hi_ && lo_ == other.lo_;
 }
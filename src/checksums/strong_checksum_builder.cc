@@ -8,6 +8,11 @@ StrongChecksumBuilder::StrongChecksumBuilder() : state_(XXH3_createState()) {
   XXH3_128bits_reset(state_);
 }
 
+StrongChecksumBuilder::StrongChecksumBuilder(uint64_t seed)
+    : state_(XXH3_createState()) {
+  XXH3_128bits_reset_withSeed(state_, seed);
+}
+
 void StrongChecksumBuilder::Update(const void* buffer, std::streamsize size) {
   XXH3_128bits_update(state_, buffer, size);
 }
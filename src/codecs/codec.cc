@@ -0,0 +1,88 @@
+#include <glog/logging.h>
+#include <kysync/codecs/codec.h>
+
+#include <stdexcept>
+
+#include "lz4_codec.h"
+#include "none_codec.h"
+#include "zstd_codec.h"
+
+namespace kysync {
+
+bool Codec::SupportsFrames() const { return false; }
+
+void Codec::BeginFrame(std::streamsize /*frame_size*/) {
+  CHECK(false) << "frames are not supported";
+}
+
+std::streamsize Codec::CompressFrameBlock(
+    void * /*output*/,
+    std::streamsize /*capacity*/,
+    const void * /*input*/,
+    std::streamsize /*size*/,
+    bool /*end_of_frame*/) {
+  CHECK(false) << "frames are not supported";
+  return 0;
+}
+
+void Codec::DecompressFrame(
+    void * /*output*/,
+    std::streamsize /*size*/,
+    const void * /*input*/,
+    std::streamsize /*compressed_size*/) {
+  CHECK(false) << "frames are not supported";
+}
+
+bool Codec::SupportsDictionary() const { return false; }
+
+std::vector<char> Codec::TrainDictionary(
+    const std::vector<char> & /*samples*/,
+    const std::vector<size_t> & /*sample_sizes*/,
+    std::streamsize /*capacity*/) const {
+  CHECK(false) << "dictionaries are not supported";
+  return {};
+}
+
+std::shared_ptr<const CodecDictionary> Codec::DigestDictionary(
+    const std::vector<char> & /*dictionary*/) const {
+  CHECK(false) << "dictionaries are not supported";
+  return {};
+}
+
+void Codec::LoadDictionary(
+    std::shared_ptr<const CodecDictionary> /*dictionary*/) {
+  CHECK(false) << "dictionaries are not supported";
+}
+
+std::unique_ptr<Codec> Codec::Create(CodecType type) {
+  switch (type) {
+    case CodecType::kZstd:
+      return std::make_unique<ZstdCodec>();
+    case CodecType::kLz4:
+      return std::make_unique<Lz4Codec>();
+    case CodecType::kNone:
+      return std::make_unique<NoneCodec>();
+  }
+
+  LOG(ERROR) << "unknown codec " << static_cast<uint32_t>(type);
+  throw std::invalid_argument("codec");
+}
+
+CodecType Codec::ParseType(const std::string &name) {
+  if (name == "zstd") {
+    return CodecType::kZstd;
+  }
+
+  if (name == "lz4") {
+    return CodecType::kLz4;
+  }
+
+  if (name == "none") {
+    return CodecType::kNone;
+  }
+
+  LOG(ERROR) << "unknown codec " << name;
+  throw std::invalid_argument(name);
+}
+
+}  // namespace kysync
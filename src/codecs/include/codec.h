@@ -0,0 +1,110 @@
+#ifndef KSYNC_SRC_CODECS_INCLUDE_KYSYNC_CODECS_CODEC_H
+#define KSYNC_SRC_CODECS_INCLUDE_KYSYNC_CODECS_CODEC_H
+
+#include <cstdint>
+#include <ios>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace kysync {
+
+/**
+ * The codecs the blocks can be compressed with. The values are recorded in the
+ * metadata, so they must never change.
+ */
+enum class CodecType : uint32_t {
+  kZstd = 0,
+  kLz4 = 1,
+  kNone = 2,
+};
+
+/**
+ * A dictionary as digested by a codec. It is immutable, so the codecs of every
+ * worker can share it rather than each digesting it again.
+ */
+class CodecDictionary {
+public:
+  virtual ~CodecDictionary() = default;
+};
+
+/**
+ * Compresses and decompresses blocks on their own, and optionally frames of
+ * several blocks and with a dictionary.
+ *
+ * Instances keep the state of the underlying library between calls, so each
+ * worker should use its own.
+ */
+class Codec {
+public:
+  virtual ~Codec() = default;
+
+  [[nodiscard]] virtual std::streamsize GetMaxCompressedSize(
+      std::streamsize size) const = 0;
+
+  virtual std::streamsize Compress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) = 0;
+
+  virtual std::streamsize Decompress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) = 0;
+
+  /**
+   * A frame compresses several consecutive blocks so that they share their
+   * history. Each block ends on a boundary of the compressed stream, so the
+   * frame can be decompressed up to any of its blocks.
+   */
+  [[nodiscard]] virtual bool SupportsFrames() const;
+
+  virtual void BeginFrame(std::streamsize frame_size);
+
+  virtual std::streamsize CompressFrameBlock(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size,
+      bool end_of_frame);
+
+  /**
+   * Decompresses the first `size` bytes of a frame from the compressed blocks
+   * that hold them.
+   */
+  virtual void DecompressFrame(
+      void *output,
+      std::streamsize size,
+      const void *input,
+      std::streamsize compressed_size);
+
+  [[nodiscard]] virtual bool SupportsDictionary() const;
+
+  /**
+   * Returns an empty dictionary if the samples are not enough to train one.
+   */
+  [[nodiscard]] virtual std::vector<char> TrainDictionary(
+      const std::vector<char> &samples,
+      const std::vector<size_t> &sample_sizes,
+      std::streamsize capacity) const;
+
+  /**
+   * Digests the dictionary once, for any number of codecs of the same type to
+   * load, from any thread.
+   */
+  [[nodiscard]] virtual std::shared_ptr<const CodecDictionary>
+  DigestDictionary(const std::vector<char> &dictionary) const;
+
+  virtual void LoadDictionary(
+      std::shared_ptr<const CodecDictionary> dictionary);
+
+  static std::unique_ptr<Codec> Create(CodecType type);
+
+  static CodecType ParseType(const std::string &name);
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_CODECS_INCLUDE_KYSYNC_CODECS_CODEC_H
@@ -0,0 +1,44 @@
+#include "lz4_codec.h"
+
+#include <glog/logging.h>
+#include <lz4.h>
+
+namespace kysync {
+
+Lz4Codec::Lz4Codec() : state_(LZ4_sizeofState()) {}
+
+std::streamsize Lz4Codec::GetMaxCompressedSize(std::streamsize size) const {
+  return LZ4_compressBound(static_cast<int>(size));
+}
+
+std::streamsize Lz4Codec::Compress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  std::streamsize compressed_size = LZ4_compress_fast_extState(
+      state_.data(),
+      static_cast<const char *>(input),
+      static_cast<char *>(output),
+      static_cast<int>(size),
+      static_cast<int>(capacity),
+      kAcceleration);
+  CHECK_GT(compressed_size, 0) << "lz4 compression failed";
+  return compressed_size;
+}
+
+std::streamsize Lz4Codec::Decompress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  std::streamsize decompressed_size = LZ4_decompress_safe(
+      static_cast<const char *>(input),
+      static_cast<char *>(output),
+      static_cast<int>(size),
+      static_cast<int>(capacity));
+  CHECK_GE(decompressed_size, 0) << "lz4 decompression failed";
+  return decompressed_size;
+}
+
+}  // namespace kysync
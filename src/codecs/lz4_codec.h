@@ -0,0 +1,38 @@
+#ifndef KSYNC_SRC_CODECS_LZ4_CODEC_H
+#define KSYNC_SRC_CODECS_LZ4_CODEC_H
+
+#include <kysync/codecs/codec.h>
+
+namespace kysync {
+
+/**
+ * Compresses considerably worse than zstd, but decompresses several times
+ * faster, which pays off when the network is faster than decompression.
+ */
+class Lz4Codec final : public Codec {
+  static constexpr int kAcceleration = 1;
+
+  std::vector<char> state_;
+
+public:
+  Lz4Codec();
+
+  [[nodiscard]] std::streamsize GetMaxCompressedSize(
+      std::streamsize size) const override;
+
+  std::streamsize Compress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+
+  std::streamsize Decompress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_CODECS_LZ4_CODEC_H
@@ -0,0 +1,33 @@
+#include "none_codec.h"
+
+#include <glog/logging.h>
+
+#include <cstring>
+
+namespace kysync {
+
+std::streamsize NoneCodec::GetMaxCompressedSize(std::streamsize size) const {
+  return size;
+}
+
+std::streamsize NoneCodec::Compress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  CHECK_LE(size, capacity);
+  memcpy(output, input, size);
+  return size;
+}
+
+std::streamsize NoneCodec::Decompress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  CHECK_LE(size, capacity);
+  memcpy(output, input, size);
+  return size;
+}
+
+}  // namespace kysync
@@ -0,0 +1,31 @@
+#ifndef KSYNC_SRC_CODECS_NONE_CODEC_H
+#define KSYNC_SRC_CODECS_NONE_CODEC_H
+
+#include <kysync/codecs/codec.h>
+
+namespace kysync {
+
+/**
+ * Stores the blocks as they are, for links where even lz4 is the bottleneck.
+ */
+class NoneCodec final : public Codec {
+public:
+  [[nodiscard]] std::streamsize GetMaxCompressedSize(
+      std::streamsize size) const override;
+
+  std::streamsize Compress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+
+  std::streamsize Decompress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_CODECS_NONE_CODEC_H
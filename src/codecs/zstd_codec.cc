@@ -0,0 +1,229 @@
+#include "zstd_codec.h"
+
+#include <glog/logging.h>
+#include <zdict.h>
+
+namespace kysync {
+
+ZstdCodec::ZstdCodec()
+    : compression_context_(ZSTD_createCCtx(), &ZSTD_freeCCtx),
+      decompression_context_(ZSTD_createDCtx(), &ZSTD_freeDCtx) {
+  CHECK(compression_context_) << "unable to create compression context";
+  CHECK(decompression_context_) << "unable to create decompression context";
+
+  // the parameters stick to the context, so they are applied only once
+  auto result = ZSTD_CCtx_setParameter(
+      compression_context_.get(),
+      ZSTD_c_compressionLevel,
+      kCompressionLevel);
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+}
+
+std::streamsize ZstdCodec::GetMaxCompressedSize(std::streamsize size) const {
+  return static_cast<std::streamsize>(ZSTD_compressBound(size));
+}
+
+std::streamsize ZstdCodec::Compress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  ReferenceCompressionDictionary();
+
+  std::streamsize compressed_size =
+      ZSTD_compress2(  // NOLINT(cppcoreguidelines-narrowing-conversions)
+          compression_context_.get(),
+          output,
+          capacity,
+          input,
+          size);
+  CHECK(!ZSTD_isError(compressed_size)) << ZSTD_getErrorName(compressed_size);
+  return compressed_size;
+}
+
+std::streamsize ZstdCodec::Decompress(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size) {
+  ReferenceDecompressionDictionary();
+
+  auto expected_size_after_decompression =
+      ZSTD_getFrameContentSize(input, size);
+  CHECK(expected_size_after_decompression != ZSTD_CONTENTSIZE_ERROR)
+      << " Not compressed by zstd!";
+  CHECK(expected_size_after_decompression != ZSTD_CONTENTSIZE_UNKNOWN)
+      << "Original size unknown when decompressing.";
+  CHECK(
+      static_cast<std::streamsize>(expected_size_after_decompression) <=
+      capacity)
+      << "Expected decompressed size is greater than block size.";
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  std::streamsize decompressed_size = ZSTD_decompressDCtx(
+      decompression_context_.get(),
+      output,
+      capacity,
+      input,
+      size);
+  CHECK(!ZSTD_isError(decompressed_size))
+      << ZSTD_getErrorName(decompressed_size);
+  return decompressed_size;
+}
+
+bool ZstdCodec::SupportsFrames() const { return true; }
+
+void ZstdCodec::BeginFrame(std::streamsize frame_size) {
+  ReferenceCompressionDictionary();
+
+  auto result =
+      ZSTD_CCtx_reset(compression_context_.get(), ZSTD_reset_session_only);
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+
+  // records the content size in the frame header, just like ZSTD_compress2
+  result = ZSTD_CCtx_setPledgedSrcSize(compression_context_.get(), frame_size);
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+}
+
+std::streamsize ZstdCodec::CompressFrameBlock(
+    void *output,
+    std::streamsize capacity,
+    const void *input,
+    std::streamsize size,
+    bool end_of_frame) {
+  // flushing makes the block end on a boundary of the compressed stream, so
+  // its compressed size is well defined and the frame can be decoded up to it
+  auto in_buffer = ZSTD_inBuffer{input, static_cast<size_t>(size), 0};
+  auto out_buffer = ZSTD_outBuffer{output, static_cast<size_t>(capacity), 0};
+
+  auto remaining = ZSTD_compressStream2(
+      compression_context_.get(),
+      &out_buffer,
+      &in_buffer,
+      end_of_frame ? ZSTD_e_end : ZSTD_e_flush);
+  CHECK(!ZSTD_isError(remaining)) << ZSTD_getErrorName(remaining);
+  CHECK_EQ(remaining, 0) << "compressed buffer is too small";
+
+  return static_cast<std::streamsize>(out_buffer.pos);
+}
+
+void ZstdCodec::DecompressFrame(
+    void *output,
+    std::streamsize size,
+    const void *input,
+    std::streamsize compressed_size) {
+  ReferenceDecompressionDictionary();
+
+  auto result =
+      ZSTD_DCtx_reset(decompression_context_.get(), ZSTD_reset_session_only);
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+
+  auto in_buffer =
+      ZSTD_inBuffer{input, static_cast<size_t>(compressed_size), 0};
+  auto out_buffer = ZSTD_outBuffer{output, static_cast<size_t>(size), 0};
+
+  // the frame may be cut at any block boundary, which the compressor flushed,
+  // so the blocks before the cut decode without the rest of the frame
+  while (out_buffer.pos < out_buffer.size) {
+    auto input_pos = in_buffer.pos;
+    auto output_pos = out_buffer.pos;
+    result = ZSTD_decompressStream(
+        decompression_context_.get(),
+        &out_buffer,
+        &in_buffer);
+    CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+    CHECK(in_buffer.pos != input_pos || out_buffer.pos != output_pos)
+        << "frame is shorter than expected";
+  }
+}
+
+bool ZstdCodec::SupportsDictionary() const { return true; }
+
+std::vector<char> ZstdCodec::TrainDictionary(
+    const std::vector<char> &samples,
+    const std::vector<size_t> &sample_sizes,
+    std::streamsize capacity) const {
+  auto dictionary = std::vector<char>(capacity);
+  auto dictionary_size = ZDICT_trainFromBuffer(
+      dictionary.data(),
+      dictionary.size(),
+      samples.data(),
+      sample_sizes.data(),
+      static_cast<unsigned>(sample_sizes.size()));
+
+  if (ZDICT_isError(dictionary_size)) {
+    // e.g. the input is too small to train on, which is not worth failing for
+    LOG(WARNING) << "unable to train a dictionary: "
+                 << ZDICT_getErrorName(dictionary_size);
+    return {};
+  }
+
+  dictionary.resize(dictionary_size);
+  return dictionary;
+}
+
+std::shared_ptr<const CodecDictionary> ZstdCodec::DigestDictionary(
+    const std::vector<char> &dictionary) const {
+  return std::make_shared<ZstdDictionary>(dictionary, kCompressionLevel);
+}
+
+void ZstdCodec::LoadDictionary(
+    std::shared_ptr<const CodecDictionary> dictionary) {
+  dictionary_ = std::dynamic_pointer_cast<const ZstdDictionary>(dictionary);
+  CHECK(dictionary_) << "not a zstd dictionary";
+  compression_dictionary_referenced_ = false;
+  decompression_dictionary_referenced_ = false;
+}
+
+void ZstdCodec::ReferenceCompressionDictionary() {
+  if (!dictionary_ || compression_dictionary_referenced_) {
+    return;
+  }
+
+  // the reference sticks to the context, just like the parameters
+  auto result = ZSTD_CCtx_refCDict(
+      compression_context_.get(),
+      dictionary_->GetCompressionDictionary());
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+  compression_dictionary_referenced_ = true;
+}
+
+void ZstdCodec::ReferenceDecompressionDictionary() {
+  if (!dictionary_ || decompression_dictionary_referenced_) {
+    return;
+  }
+
+  auto result = ZSTD_DCtx_refDDict(
+      decompression_context_.get(),
+      dictionary_->GetDecompressionDictionary());
+  CHECK(!ZSTD_isError(result)) << ZSTD_getErrorName(result);
+  decompression_dictionary_referenced_ = true;
+}
+
+ZstdDictionary::ZstdDictionary(
+    std::vector<char> dictionary,
+    int compression_level)
+    : dictionary_(std::move(dictionary)),
+      compression_level_(compression_level) {}
+
+const ZSTD_CDict *ZstdDictionary::GetCompressionDictionary() const {
+  std::call_once(compression_dictionary_once_, [this]() {
+    compression_dictionary_.reset(ZSTD_createCDict(
+        dictionary_.data(),
+        dictionary_.size(),
+        compression_level_));
+    CHECK(compression_dictionary_)
+        << "unable to create compression dictionary";
+  });
+  return compression_dictionary_.get();
+}
+
+const ZSTD_DDict *ZstdDictionary::GetDecompressionDictionary() const {
+  std::call_once(decompression_dictionary_once_, [this]() {
+    decompression_dictionary_.reset(
+        ZSTD_createDDict(dictionary_.data(), dictionary_.size()));
+    CHECK(decompression_dictionary_) << "unable to load dictionary";
+  });
+  return decompression_dictionary_.get();
+}
+
+}  // namespace kysync
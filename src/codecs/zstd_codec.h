@@ -0,0 +1,101 @@
+#ifndef KSYNC_SRC_CODECS_ZSTD_CODEC_H
+#define KSYNC_SRC_CODECS_ZSTD_CODEC_H
+
+#include <kysync/codecs/codec.h>
+#include <zstd.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace kysync {
+
+/**
+ * The zstd dictionaries for compression and for decompression, each digested
+ * on first use, as a dictionary is typically used for only one of them.
+ */
+class ZstdDictionary final : public CodecDictionary {
+  std::vector<char> dictionary_;
+  int compression_level_;
+
+  mutable std::once_flag compression_dictionary_once_;
+  mutable std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)>
+      compression_dictionary_{nullptr, &ZSTD_freeCDict};
+  mutable std::once_flag decompression_dictionary_once_;
+  mutable std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)>
+      decompression_dictionary_{nullptr, &ZSTD_freeDDict};
+
+public:
+  ZstdDictionary(std::vector<char> dictionary, int compression_level);
+
+  [[nodiscard]] const ZSTD_CDict *GetCompressionDictionary() const;
+  [[nodiscard]] const ZSTD_DDict *GetDecompressionDictionary() const;
+};
+
+class ZstdCodec final : public Codec {
+  static constexpr int kCompressionLevel = 1;
+
+  std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> compression_context_;
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> decompression_context_;
+
+  // shared with the codecs of the other workers, and referenced by each
+  // context on first use
+  std::shared_ptr<const ZstdDictionary> dictionary_;
+  bool compression_dictionary_referenced_{};
+  bool decompression_dictionary_referenced_{};
+
+  void ReferenceCompressionDictionary();
+  void ReferenceDecompressionDictionary();
+
+public:
+  ZstdCodec();
+
+  [[nodiscard]] std::streamsize GetMaxCompressedSize(
+      std::streamsize size) const override;
+
+  std::streamsize Compress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+
+  std::streamsize Decompress(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size) override;
+
+  [[nodiscard]] bool SupportsFrames() const override;
+
+  void BeginFrame(std::streamsize frame_size) override;
+
+  std::streamsize CompressFrameBlock(
+      void *output,
+      std::streamsize capacity,
+      const void *input,
+      std::streamsize size,
+      bool end_of_frame) override;
+
+  void DecompressFrame(
+      void *output,
+      std::streamsize size,
+      const void *input,
+      std::streamsize compressed_size) override;
+
+  [[nodiscard]] bool SupportsDictionary() const override;
+
+  [[nodiscard]] std::vector<char> TrainDictionary(
+      const std::vector<char> &samples,
+      const std::vector<size_t> &sample_sizes,
+      std::streamsize capacity) const override;
+
+  [[nodiscard]] std::shared_ptr<const CodecDictionary> DigestDictionary(
+      const std::vector<char> &dictionary) const override;
+
+  void LoadDictionary(
+      std::shared_ptr<const CodecDictionary> dictionary) override;
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_CODECS_ZSTD_CODEC_H
@@ -0,0 +1,573 @@
+#include <glog/logging.h>
+#include <ky/metrics/metrics.h>
+#include <ky/min.h>
+#include <ky/parallelize.h>
+#include <ky/timer.h>
+#include <kysync/checksums/strong_checksum.h>
+#include <kysync/checksums/weak_checksum.h>
+#include <kysync/codecs/codec.h>
+#include <kysync/commands/advise_command.h>
+#include <kysync/readers/reader.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <utility>
+
+#include "compressed_columns.h"
+#include "pb/header_adapter.h"
+#include "seed_scanner.h"
+#include "weak_checksum_index.h"
+
+namespace kysync {
+
+namespace fs = std::filesystem;
+
+// NOLINTNEXTLINE(fuchsia-multiple-inheritance,fuchsia-virtual-inheritance)
+class AdviseCommandImpl final : public AdviseCommand {
+  fs::path input_file_path_;
+  std::vector<fs::path> seed_file_paths_;
+  std::vector<std::streamsize> block_sizes_;
+  std::streamsize max_samples_;
+  std::streamsize seed_stride_;
+  int threads_;
+  PrepareOptions options_;
+
+  std::vector<Advice> advice_;
+
+  struct Sample {
+    std::streamsize size{};
+    uint32_t weak_checksum{};
+    StrongChecksum strong_checksum;
+    std::streamsize compressed_size{};
+    BlockEncoding encoding{};
+    intmax_t strong_checksum_ns{};
+    intmax_t decompression_ns{};
+  };
+
+  // the samples are runs of this many neighbouring blocks, one run every
+  // `sample_stride_` blocks of the input
+  std::streamsize sample_stride_{};
+  std::streamsize sample_run_blocks_{};
+  std::vector<Sample> samples_;
+
+  // the seeds are scanned for the samples like sync scans them for the blocks
+  // of the input, and with the same index
+  std::vector<char> weak_checksum_index_buffer_;
+  WeakChecksumIndex weak_checksum_index_;
+
+  /**
+   * The samples that the seed is scanned for.
+   */
+  class SeedSamples final : public SeedScanner::Target {
+    AdviseCommandImpl &parent_;
+
+  public:
+    explicit SeedSamples(AdviseCommandImpl &parent) : parent_(parent) {}
+
+    [[nodiscard]] std::streamoff GetSeedOffset(
+        std::streamsize block) const override {
+      return parent_.seed_offsets_[block];
+    }
+
+    // the samples of a run follow one another, as do the runs with a stride
+    // of as many blocks
+    [[nodiscard]] bool FollowsPrevious(std::streamsize block) const override {
+      return block > 0 && block < std::ssize(parent_.samples_) &&
+             (block % parent_.sample_run_blocks_ != 0 ||
+              parent_.sample_stride_ == parent_.sample_run_blocks_);
+    }
+
+    [[nodiscard]] bool MatchesStrongChecksum(
+        std::streamsize block,
+        const StrongChecksum &strong_checksum) const override {
+      return memcmp(
+                 &parent_.samples_[block].strong_checksum,
+                 &strong_checksum,
+                 parent_.options_.strong_checksum_size) == 0;
+    }
+
+    void Accept(std::streamsize block, std::streamoff seed_offset) override {
+      parent_.seed_offsets_[block] = seed_offset;
+    }
+  };
+
+  // the seeds are scanned in windows of at least this size
+  static constexpr std::streamsize kSeedWindowSize = 1024 * 1024;
+  static constexpr std::streamsize kSeedWindowBlocks = 16;
+
+  // where each sample was found in the seed, -1 if it was not
+  std::vector<std::atomic<std::streamoff>> seed_offsets_;
+  std::atomic<intmax_t> scan_ns_{};
+
+  ky::metrics::Metric sampled_bytes_{};
+  ky::metrics::Metric scanned_bytes_{};
+  ky::metrics::Metric weak_checksum_matches_{};
+  ky::metrics::Metric strong_checksum_matches_{};
+
+  [[nodiscard]] std::streamsize GetMetadataSize(
+      std::streamsize data_size,
+      std::streamsize block_size) const;
+
+  void SampleInputChunk(
+      std::streamsize data_size,
+      std::streamsize block_size,
+      std::streamoff start_index,
+      std::streamoff end_index);
+  void SampleInput(
+      std::streamsize data_size,
+      std::streamsize block_size,
+      std::streamsize stride,
+      std::streamsize run_blocks);
+
+  void ScanSeedChunk(
+      const fs::path &seed_file_path,
+      std::streamsize block_size,
+      std::streamsize window_size,
+      std::streamoff start_index,
+      std::streamoff end_index);
+  void ScanSeed(const fs::path &seed_file_path, std::streamsize block_size);
+
+  [[nodiscard]] Advice Predict(
+      const fs::path &seed_file_path,
+      std::streamsize data_size,
+      std::streamsize block_size) const;
+
+public:
+  AdviseCommandImpl(
+      fs::path input_file_path,
+      std::vector<fs::path> seed_file_paths,
+      std::vector<std::streamsize> block_sizes,
+      std::streamsize max_samples,
+      std::streamsize seed_stride,
+      int threads,
+      PrepareOptions options);
+
+  [[nodiscard]] const std::vector<Advice> &GetAdvice() const override;
+
+  int Run() override;
+
+  void Accept(ky::metrics::MetricVisitor &visitor) override;
+};
+
+AdviseCommand::AdviseCommand() : Command("advise") {}
+
+AdviseCommand::~AdviseCommand() = default;
+
+std::unique_ptr<AdviseCommand> AdviseCommand::Create(
+    std::filesystem::path input_file_path,
+    std::vector<std::filesystem::path> seed_file_paths,
+    std::vector<std::streamsize> block_sizes,
+    std::streamsize max_samples,
+    std::streamsize seed_stride,
+    int threads,
+    const PrepareOptions &options) {
+  CHECK(!block_sizes.empty()) << "at least one block size is required";
+  CHECK_GE(max_samples, 1) << "invalid number of samples";
+  CHECK_GE(seed_stride, 1) << "invalid seed stride";
+  CHECK(
+      !options.deduplicate && !options.zero_blocks &&
+      options.blocks_per_frame == 1)
+      << "deduplication, blocks of zeros and frames cannot be advised on";
+  CHECK(
+      options.strong_checksum_size > 0 &&
+      options.strong_checksum_size <= static_cast<int>(sizeof(StrongChecksum)))
+      << "invalid strong checksum size";
+  return std::make_unique<AdviseCommandImpl>(
+      std::move(input_file_path),
+      std::move(seed_file_paths),
+      std::move(block_sizes),
+      max_samples,
+      seed_stride,
+      threads,
+      options);
+}
+
+AdviseCommandImpl::AdviseCommandImpl(
+    fs::path input_file_path,
+    std::vector<fs::path> seed_file_paths,
+    std::vector<std::streamsize> block_sizes,
+    std::streamsize max_samples,
+    std::streamsize seed_stride,
+    int threads,
+    PrepareOptions options)
+    : input_file_path_(std::move(input_file_path)),
+      seed_file_paths_(std::move(seed_file_paths)),
+      block_sizes_(std::move(block_sizes)),
+      max_samples_(max_samples),
+      seed_stride_(seed_stride),
+      threads_(threads),
+      options_(std::move(options)) {}
+
+const std::vector<Advice> &AdviseCommandImpl::GetAdvice() const {
+  return advice_;
+}
+
+std::streamsize AdviseCommandImpl::GetMetadataSize(
+    std::streamsize data_size,
+    std::streamsize block_size) const {
+  // the block arrays are laid out like prepare does (without duplicates, and
+  // with a dictionary as large as it may be), after a header with a hash of
+  // the same length
+  auto block_count = (data_size + block_size - 1) / block_size;
+  auto header = MetadataHeader{
+      .version = HeaderAdapter::kVersion,
+      .data_size = data_size,
+      .block_size = block_size,
+      .hash = StrongChecksum().ToString(),
+      .dictionary_size = options_.dictionary_size,
+      .blocks_per_frame = options_.blocks_per_frame,
+      .codec = options_.codec,
+      .compressed_columns = options_.compress_metadata,
+      .strong_checksum_size = options_.strong_checksum_size};
+  using Section = MetadataSection;
+  auto &weak_checksums = header.GetSection(Section::kWeakChecksums);
+  auto &strong_checksums = header.GetSection(Section::kStrongChecksums);
+  auto &compressed_offsets = header.GetSection(Section::kCompressedOffsets);
+  auto &block_encodings = header.GetSection(Section::kBlockEncodings);
+  weak_checksums.size =
+      block_count * static_cast<std::streamsize>(sizeof(uint32_t));
+  strong_checksums.size = block_count * options_.strong_checksum_size;
+  compressed_offsets.size =
+      (block_count + 1) * static_cast<std::streamsize>(sizeof(int64_t));
+  block_encodings.size =
+      block_count * static_cast<std::streamsize>(sizeof(BlockEncoding));
+  header.GetSection(Section::kDictionary).size = options_.dictionary_size;
+  header.GetSection(Section::kWeakChecksumIndex).size =
+      WeakChecksumIndex::GetSize(block_count, block_count);
+
+  // the compressed columns are those of the samples, each of which stands for
+  // the same number of blocks
+  if (options_.compress_metadata && !samples_.empty()) {
+    auto sample_count = std::ssize(samples_);
+    auto sample_weak_checksums = std::vector<uint32_t>(sample_count);
+    auto sample_strong_checksums =
+        std::vector<char>(sample_count * options_.strong_checksum_size);
+    auto sample_compressed_offsets = std::vector<int64_t>(sample_count + 1);
+    auto sample_block_encodings = std::vector<BlockEncoding>(sample_count);
+    for (std::streamsize i = 0; i < sample_count; i++) {
+      const auto &sample = samples_[i];
+      sample_weak_checksums[i] = sample.weak_checksum;
+      memcpy(
+          sample_strong_checksums.data() + i * options_.strong_checksum_size,
+          &sample.strong_checksum,
+          options_.strong_checksum_size);
+      sample_compressed_offsets[i + 1] =
+          sample_compressed_offsets[i] + sample.compressed_size;
+      sample_block_encodings[i] = sample.encoding;
+    }
+
+    auto scale = static_cast<double>(block_count) /
+                 static_cast<double>(sample_count);
+    auto estimate = [scale](const std::vector<char> &compressed) {
+      return std::llround(scale * static_cast<double>(std::ssize(compressed)));
+    };
+    weak_checksums.size =
+        estimate(CompressedColumns::Compress(sample_weak_checksums, threads_));
+    strong_checksums.size = estimate(CompressedColumns::Compress(
+        sample_strong_checksums.data(),
+        sample_count,
+        options_.strong_checksum_size,
+        threads_));
+    compressed_offsets.size = estimate(CompressedColumns::CompressOffsets(
+        sample_compressed_offsets,
+        threads_));
+    block_encodings.size =
+        estimate(CompressedColumns::Compress(sample_block_encodings, threads_));
+  }
+
+  return HeaderAdapter::LayoutSections(header);
+}
+
+void AdviseCommandImpl::SampleInputChunk(
+    std::streamsize data_size,
+    std::streamsize block_size,
+    std::streamoff start_index,
+    std::streamoff end_index) {
+  auto input = std::ifstream(input_file_path_, std::ios::binary);
+  CHECK(input) << "error reading from " << input_file_path_;
+
+  auto codec = Codec::Create(options_.codec);
+  auto buffer = std::vector<char>(block_size);
+  auto compressed_buffer =
+      std::vector<char>(codec->GetMaxCompressedSize(block_size));
+  auto decompressed_buffer = std::vector<char>(block_size);
+
+  for (auto index = start_index; index < end_index; index++) {
+    auto &sample = samples_[index];
+
+    auto block = index / sample_run_blocks_ * sample_stride_ +
+                 index % sample_run_blocks_;
+    auto offset = block * block_size;
+    sample.size = ky::Min(block_size, data_size - offset);
+    memset(buffer.data() + sample.size, 0, block_size - sample.size);
+
+    input.seekg(offset);
+    input.read(buffer.data(), sample.size);
+    CHECK(input) << "error reading from " << input_file_path_;
+
+    // the checksums cover the zero padding, just like in prepare
+    sample.weak_checksum = WeakChecksum(buffer.data(), block_size);
+
+    auto beg = ky::timer::Now();
+    sample.strong_checksum = StrongChecksum::Compute(buffer.data(), block_size);
+    auto end = ky::timer::Now();
+    sample.strong_checksum_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count();
+
+    auto compressed_size = codec->Compress(
+        compressed_buffer.data(),
+        std::ssize(compressed_buffer),
+        buffer.data(),
+        sample.size);
+
+    // blocks that do not compress are stored raw and cost nothing to decode
+    if (IsStoredRaw(sample.size, compressed_size)) {
+      sample.compressed_size = sample.size;
+      sample.encoding = BlockEncoding::kRaw;
+    } else {
+      sample.compressed_size = compressed_size;
+
+      beg = ky::timer::Now();
+      codec->Decompress(
+          decompressed_buffer.data(),
+          block_size,
+          compressed_buffer.data(),
+          compressed_size);
+      end = ky::timer::Now();
+      sample.decompression_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg)
+              .count();
+    }
+
+    sampled_bytes_ += sample.size;
+    AdvanceProgress(sample.size);
+  }
+}
+
+void AdviseCommandImpl::SampleInput(
+    std::streamsize data_size,
+    std::streamsize block_size,
+    std::streamsize stride,
+    std::streamsize run_blocks) {
+  auto block_count = (data_size + block_size - 1) / block_size;
+  auto run_count = (block_count + stride - 1) / stride;
+  auto sample_count =
+      run_count == 0
+          ? 0
+          : (run_count - 1) * run_blocks +
+                ky::Min(run_blocks, block_count - (run_count - 1) * stride);
+  sample_stride_ = stride;
+  sample_run_blocks_ = run_blocks;
+
+  StartNextPhase(sample_count * block_size);
+  LOG(INFO) << "sampling " << sample_count << " blocks of " << block_size
+            << " bytes...";
+
+  samples_ = std::vector<Sample>(sample_count);
+
+  // the samples are evenly strided whole blocks, so they stand for the
+  // blocks that prepare would produce
+  ky::parallelize::Parallelize(
+      sample_count,
+      1,
+      0,
+      threads_,
+      [this, data_size, block_size](auto /*id*/, auto beg, auto end) {
+        SampleInputChunk(data_size, block_size, beg, end);
+      });
+
+  auto weak_checksums = std::vector<uint32_t>(sample_count);
+  auto block_encodings = std::vector<BlockEncoding>(sample_count);
+  for (std::streamsize index = 0; index < sample_count; index++) {
+    weak_checksums[index] = samples_[index].weak_checksum;
+    block_encodings[index] = samples_[index].encoding;
+  }
+  weak_checksum_index_buffer_ =
+      WeakChecksumIndex::Build(weak_checksums, block_encodings, 0, threads_);
+  weak_checksum_index_ = WeakChecksumIndex(
+      weak_checksum_index_buffer_,
+      sample_count,
+      threads_);
+}
+
+void AdviseCommandImpl::ScanSeedChunk(
+    const fs::path &seed_file_path,
+    std::streamsize block_size,
+    std::streamsize window_size,
+    std::streamoff start_index,
+    std::streamoff end_index) {
+  auto seed_reader = Reader::Create("file://" + seed_file_path.string());
+  auto seed_size = seed_reader->GetSize();
+  auto seed_samples = SeedSamples(*this);
+  auto seed_scanner = SeedScanner(
+      *seed_reader,
+      block_size,
+      options_.strong_checksum_size,
+      weak_checksum_index_,
+      seed_samples);
+
+  for (auto index = start_index; index < end_index; index++) {
+    auto window_offset = index * seed_stride_ * window_size;
+
+    auto beg = ky::timer::Now();
+    auto counts = seed_scanner.Scan(
+        window_offset,
+        ky::Min(window_offset + window_size + block_size, seed_size),
+        [this](auto size) {
+          scanned_bytes_ += size;
+          AdvanceProgress(size);
+        });
+    auto end = ky::timer::Now();
+    scan_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg)
+                    .count();
+
+    weak_checksum_matches_ += counts.weak_checksum_matches;
+    strong_checksum_matches_ += counts.strong_checksum_matches;
+  }
+}
+
+void AdviseCommandImpl::ScanSeed(
+    const fs::path &seed_file_path,
+    std::streamsize block_size) {
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  std::streamsize seed_size = fs::file_size(seed_file_path);
+
+  // the windows are whole blocks, and each one is scanned up to a block past
+  // its end, so that the matches starting in it are found
+  auto window_size = block_size * std::max<std::streamsize>(
+                                      kSeedWindowSize / block_size,
+                                      kSeedWindowBlocks);
+  auto window_count = (seed_size + window_size - 1) / window_size;
+  auto scanned_window_count = (window_count + seed_stride_ - 1) / seed_stride_;
+
+  StartNextPhase(ky::Min(seed_size, scanned_window_count * window_size));
+  LOG(INFO) << "scanning " << scanned_window_count << " of " << window_count
+            << " windows of " << seed_file_path << "...";
+
+  seed_offsets_ = std::vector<std::atomic<std::streamoff>>(samples_.size());
+  for (auto &seed_offset : seed_offsets_) {
+    seed_offset = -1;
+  }
+  scan_ns_ = 0;
+
+  ky::parallelize::Parallelize(
+      scanned_window_count,
+      1,
+      0,
+      threads_,
+      [this, &seed_file_path, block_size, window_size](
+          auto /*id*/,
+          auto beg,
+          auto end) {
+        ScanSeedChunk(seed_file_path, block_size, window_size, beg, end);
+      });
+}
+
+Advice AdviseCommandImpl::Predict(
+    const fs::path &seed_file_path,
+    std::streamsize data_size,
+    std::streamsize block_size) const {
+  // totals over all the samples and over the ones found in the seed
+  Sample total;
+  Sample found;
+  auto add = [](Sample &sum, const Sample &sample) {
+    sum.size += sample.size;
+    sum.compressed_size += sample.compressed_size;
+    sum.strong_checksum_ns += sample.strong_checksum_ns;
+    sum.decompression_ns += sample.decompression_ns;
+  };
+  for (std::size_t index = 0; index < samples_.size(); index++) {
+    add(total, samples_[index]);
+    if (seed_offsets_[index] >= 0) {
+      add(found, samples_[index]);
+    }
+  }
+
+  // only one in `seed_stride_` windows of the seed was scanned, so each
+  // sample found stands for as many samples that would be found by sync
+  auto seed_scale = static_cast<double>(seed_stride_);
+  auto reused = [&](auto Sample::*field) {
+    return std::min(
+        seed_scale * static_cast<double>(found.*field),
+        static_cast<double>(total.*field));
+  };
+  auto missing = [&](auto Sample::*field) {
+    return static_cast<double>(total.*field) - reused(field);
+  };
+
+  // each sample stands for the same number of blocks of the input
+  auto block_count = (data_size + block_size - 1) / block_size;
+  auto scale = samples_.empty() ? 0.0
+                                : static_cast<double>(block_count) /
+                                      static_cast<double>(samples_.size());
+
+  auto reused_size = reused(&Sample::size);
+  auto downloaded_size = missing(&Sample::compressed_size);
+
+  // found blocks are checksummed once more when they are found in the seed,
+  // missing ones are decompressed, and all of them are verified at the end
+  auto block_ns = static_cast<double>(total.strong_checksum_ns) +
+                  reused(&Sample::strong_checksum_ns) +
+                  missing(&Sample::decompression_ns);
+
+  // sync scans the whole seed
+  auto cpu_ns = seed_scale * static_cast<double>(scan_ns_) + scale * block_ns;
+
+  return {
+      .block_size = block_size,
+      .seed_file_path = seed_file_path,
+      .metadata_size = GetMetadataSize(data_size, block_size),
+      .downloaded_size = std::llround(scale * downloaded_size),
+      .reused_size = std::llround(scale * reused_size),
+      .cpu_ms = std::llround(cpu_ns / 1e6)};
+}
+
+int AdviseCommandImpl::Run() {
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  std::streamsize data_size = fs::file_size(input_file_path_);
+
+  advice_.clear();
+
+  for (auto block_size : block_sizes_) {
+    auto block_count = (data_size + block_size - 1) / block_size;
+    // when the strong checksums are short, sync only reuses a block along
+    // with a neighbour, so the blocks are sampled in pairs of neighbours then
+    auto run_blocks = options_.strong_checksum_size <
+                              SeedScanner::kMinSingleMatchStrongChecksumSize
+                          ? 2
+                          : 1;
+    auto run_count = std::max<std::streamsize>(max_samples_ / run_blocks, 1);
+    auto stride = std::max<std::streamsize>(
+        (block_count + run_count - 1) / run_count,
+        run_blocks);
+
+    SampleInput(data_size, block_size, stride, run_blocks);
+
+    for (const auto &seed_file_path : seed_file_paths_) {
+      ScanSeed(seed_file_path, block_size);
+
+      const auto &advice =
+          advice_.emplace_back(Predict(seed_file_path, data_size, block_size));
+      LOG(INFO) << "block_size=" << advice.block_size                //
+                << " seed=" << advice.seed_file_path                 //
+                << " metadata_size=" << advice.metadata_size         //
+                << " downloaded_size=" << advice.downloaded_size     //
+                << " reused_size=" << advice.reused_size             //
+                << " cpu_ms=" << advice.cpu_ms;
+    }
+  }
+
+  StartNextPhase(0);
+  return 0;
+}
+
+void AdviseCommandImpl::Accept(ky::metrics::MetricVisitor &visitor) {
+  VISIT_METRICS(sampled_bytes_);
+  VISIT_METRICS(scanned_bytes_);
+  VISIT_METRICS(weak_checksum_matches_);
+  VISIT_METRICS(strong_checksum_matches_);
+}
+
+}  // namespace kysync
@@ -0,0 +1,319 @@
+#include "compressed_columns.h"
+
+#include <glog/logging.h>
+#include <ky/min.h>
+#include <ky/parallelize.h>
+#include <kysync/codecs/codec.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace kysync {
+
+namespace {
+
+// fills the raw bytes of the chunk of elements [begin, end)
+using EncodeChunk = std::function<void(
+    std::streamoff /*begin*/,
+    std::streamoff /*end*/,
+    std::vector<char> & /*raw*/)>;
+
+// restores the chunk of elements [begin, end) from its raw bytes
+using DecodeChunk = std::function<void(
+    std::streamoff /*begin*/,
+    std::streamoff /*end*/,
+    const char * /*raw*/,
+    std::streamsize /*raw_size*/)>;
+
+// a varint takes at most 10 bytes for 64 bits
+constexpr std::streamsize kMaxVarintSize = 10;
+
+std::streamsize GetChunkCount(std::streamsize count) {
+  return (count + CompressedColumns::kChunkSize - 1) /
+         CompressedColumns::kChunkSize;
+}
+
+std::vector<char> CompressChunks(
+    std::streamsize count,
+    const EncodeChunk &encode,
+    int threads) {
+  auto chunk_count = GetChunkCount(count);
+  auto compressed_chunks = std::vector<std::vector<char>>(chunk_count);
+
+  ky::parallelize::Parallelize(
+      chunk_count,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        auto codec = Codec::Create(CodecType::kZstd);
+        auto raw = std::vector<char>();
+        for (auto chunk = beg; chunk < end; chunk++) {
+          raw.clear();
+          encode(
+              chunk * CompressedColumns::kChunkSize,
+              ky::Min(count, (chunk + 1) * CompressedColumns::kChunkSize),
+              raw);
+
+          auto &compressed_chunk = compressed_chunks[chunk];
+          compressed_chunk.resize(codec->GetMaxCompressedSize(std::ssize(raw)));
+          compressed_chunk.resize(codec->Compress(
+              compressed_chunk.data(),
+              std::ssize(compressed_chunk),
+              raw.data(),
+              std::ssize(raw)));
+        }
+      });
+
+  auto table = std::vector<int64_t>{chunk_count};
+  int64_t chunk_end = 0;
+  for (const auto &compressed_chunk : compressed_chunks) {
+    chunk_end += std::ssize(compressed_chunk);
+    table.push_back(chunk_end);
+  }
+
+  auto table_size = std::ssize(table) * static_cast<int64_t>(sizeof(int64_t));
+  auto result = std::vector<char>(table_size + chunk_end);
+  memcpy(result.data(), table.data(), table_size);
+  auto *output = result.data() + table_size;
+  for (const auto &compressed_chunk : compressed_chunks) {
+    memcpy(output, compressed_chunk.data(), compressed_chunk.size());
+    output += compressed_chunk.size();
+  }
+  return result;
+}
+
+// the compressed column, all of which is in memory
+CompressedColumns::ReadRange ReadSpan(std::span<const char> compressed) {
+  return [compressed](auto offset, auto size) {
+    CHECK(offset >= 0 && size >= 0 && offset + size <= std::ssize(compressed))
+        << "truncated metadata column";
+    return compressed.subspan(offset, size);
+  };
+}
+
+// decodes the chunks that hold the elements [begin, end) of the column
+void DecompressChunks(
+    const CompressedColumns::ReadRange &read,
+    std::streamsize count,
+    std::streamoff range_begin,
+    std::streamoff range_end,
+    std::streamsize max_raw_chunk_size,
+    const DecodeChunk &decode,
+    int threads) {
+  static constexpr auto kEntrySize =
+      static_cast<std::streamsize>(sizeof(int64_t));
+  auto chunk_count = GetChunkCount(count);
+
+  // the entries of the table are copied, as the column may not be aligned
+  // for them
+  int64_t table_chunk_count = 0;
+  memcpy(&table_chunk_count, read(0, kEntrySize).data(), kEntrySize);
+  CHECK_EQ(table_chunk_count, chunk_count) << "invalid metadata column";
+
+  CHECK(range_begin >= 0 && range_begin <= range_end && range_end <= count);
+  if (range_begin == range_end) {
+    return;
+  }
+
+  // the table entries [first_chunk, last_chunk] bound the chunks that are
+  // needed, the end of the chunk before each of them and of the last one
+  auto first_chunk = range_begin / CompressedColumns::kChunkSize;
+  auto last_chunk = GetChunkCount(range_end);
+  auto table = std::vector<int64_t>(last_chunk - first_chunk + 1);
+  auto table_range =
+      read(first_chunk * kEntrySize, std::ssize(table) * kEntrySize);
+  memcpy(table.data(), table_range.data(), table_range.size());
+  if (first_chunk == 0) {
+    table[0] = 0;
+  }
+  CHECK(table.front() >= 0 && std::is_sorted(table.begin(), table.end()))
+      << "invalid metadata column";
+
+  auto table_size = (1 + chunk_count) * kEntrySize;
+  auto chunks = read(table_size + table.front(), table.back() - table.front());
+
+  ky::parallelize::Parallelize(
+      last_chunk - first_chunk,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        auto codec = Codec::Create(CodecType::kZstd);
+        auto raw = std::vector<char>(max_raw_chunk_size);
+        for (auto i = beg; i < end; i++) {
+          auto chunk = first_chunk + i;
+          auto raw_size = codec->Decompress(
+              raw.data(),
+              max_raw_chunk_size,
+              chunks.data() + table[i] - table.front(),
+              table[i + 1] - table[i]);
+          decode(
+              chunk * CompressedColumns::kChunkSize,
+              ky::Min(count, (chunk + 1) * CompressedColumns::kChunkSize),
+              raw.data(),
+              raw_size);
+        }
+      });
+}
+
+void WriteVarint(uint64_t value, std::vector<char> &output) {
+  static constexpr int kBits = 7;
+  static constexpr uint64_t kMask = (1U << kBits) - 1;
+  while (value > kMask) {
+    output.push_back(static_cast<char>((value & kMask) | (kMask + 1)));
+    value >>= kBits;
+  }
+  output.push_back(static_cast<char>(value));
+}
+
+uint64_t ReadVarint(const char *&input, const char *end) {
+  static constexpr int kBits = 7;
+  static constexpr uint64_t kMask = (1U << kBits) - 1;
+  uint64_t value = 0;
+  for (int shift = 0;; shift += kBits) {
+    CHECK(input < end && shift < 64) << "invalid metadata column";
+    auto byte = static_cast<uint8_t>(*input++);
+    value |= (byte & kMask) << shift;
+    if ((byte & (kMask + 1)) == 0) {
+      return value;
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<char> CompressedColumns::Compress(
+    const void *data,
+    std::streamsize count,
+    std::streamsize element_size,
+    int threads) {
+  const auto *bytes = static_cast<const char *>(data);
+  return CompressChunks(
+      count,
+      [bytes, element_size](auto begin, auto end, auto &raw) {
+        raw.assign(bytes + begin * element_size, bytes + end * element_size);
+      },
+      threads);
+}
+
+void CompressedColumns::Decompress(
+    std::span<const char> compressed,
+    void *data,
+    std::streamsize count,
+    std::streamsize element_size,
+    int threads) {
+  DecompressRange(
+      ReadSpan(compressed),
+      data,
+      0,
+      count,
+      count,
+      element_size,
+      threads);
+}
+
+void CompressedColumns::DecompressRange(
+    const ReadRange &read,
+    void *data,
+    std::streamoff begin,
+    std::streamoff end,
+    std::streamsize count,
+    std::streamsize element_size,
+    int threads) {
+  auto *bytes = static_cast<char *>(data);
+  DecompressChunks(
+      read,
+      count,
+      begin,
+      end,
+      kChunkSize * element_size,
+      [bytes, begin, end, element_size](
+          auto chunk_begin,
+          auto chunk_end,
+          auto *raw,
+          auto raw_size) {
+        CHECK_EQ(raw_size, (chunk_end - chunk_begin) * element_size)
+            << "invalid metadata column";
+        auto copy_begin = std::max(begin, chunk_begin);
+        auto copy_end = std::min(end, chunk_end);
+        memcpy(
+            bytes + (copy_begin - begin) * element_size,
+            raw + (copy_begin - chunk_begin) * element_size,
+            (copy_end - copy_begin) * element_size);
+      },
+      threads);
+}
+
+std::vector<char> CompressedColumns::CompressOffsets(
+    const std::vector<int64_t> &offsets,
+    int threads) {
+  return CompressChunks(
+      std::ssize(offsets),
+      [&offsets](auto begin, auto end, auto &raw) {
+        WriteVarint(offsets[begin], raw);
+        for (auto i = begin + 1; i < end; i++) {
+          CHECK_GE(offsets[i], offsets[i - 1]);
+          WriteVarint(offsets[i] - offsets[i - 1], raw);
+        }
+      },
+      threads);
+}
+
+void CompressedColumns::DecompressOffsets(
+    std::span<const char> compressed,
+    std::vector<int64_t> &offsets,
+    std::streamsize count,
+    int threads) {
+  DecompressOffsetsRange(
+      ReadSpan(compressed),
+      offsets,
+      0,
+      count,
+      count,
+      threads);
+}
+
+void CompressedColumns::DecompressOffsetsRange(
+    const ReadRange &read,
+    std::vector<int64_t> &offsets,
+    std::streamoff begin,
+    std::streamoff end,
+    std::streamsize count,
+    int threads) {
+  offsets.resize(end - begin);
+  DecompressChunks(
+      read,
+      count,
+      begin,
+      end,
+      kChunkSize * kMaxVarintSize,
+      [&offsets, begin, end](
+          auto chunk_begin,
+          auto chunk_end,
+          auto *raw,
+          auto raw_size) {
+        // the offsets of a chunk can only be decoded in order
+        const auto *input = raw;
+        const auto *input_end = raw + raw_size;
+        int64_t offset = 0;
+        for (auto i = chunk_begin; i < chunk_end; i++) {
+          auto delta = static_cast<int64_t>(ReadVarint(input, input_end));
+          offset = i == chunk_begin ? delta : offset + delta;
+          if (i >= begin && i < end) {
+            offsets[i - begin] = offset;
+          }
+        }
+        CHECK(input == input_end) << "invalid metadata column";
+      },
+      threads);
+}
+
+}  // namespace kysync
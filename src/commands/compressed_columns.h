@@ -0,0 +1,114 @@
+#ifndef KSYNC_SRC_COMMANDS_COMPRESSED_COLUMNS_H
+#define KSYNC_SRC_COMMANDS_COMPRESSED_COLUMNS_H
+
+#include <cstdint>
+#include <functional>
+#include <ios>
+#include <span>
+#include <vector>
+
+namespace kysync {
+
+/**
+ * Compresses the columns of the metadata in chunks of a fixed number of
+ * elements, each with zstd on its own, so that the chunks can be compressed
+ * and decompressed in parallel.
+ *
+ * A compressed column is the number of chunks, the end offset of each
+ * compressed chunk (relative to the first one) and the compressed chunks.
+ */
+class CompressedColumns {
+public:
+  static constexpr std::streamsize kChunkSize = 64 * 1024;
+
+  /**
+   * Reads `size` bytes at `offset` of a compressed column, which have to stay
+   * valid until the next read.
+   */
+  using ReadRange = std::function<std::span<const char>(
+      std::streamoff /*offset*/,
+      std::streamsize /*size*/)>;
+
+  /**
+   * The elements of the column are compressed as they are.
+   */
+  static std::vector<char> Compress(
+      const void *data,
+      std::streamsize count,
+      std::streamsize element_size,
+      int threads);
+
+  static void Decompress(
+      std::span<const char> compressed,
+      void *data,
+      std::streamsize count,
+      std::streamsize element_size,
+      int threads);
+
+  /**
+   * Decompresses the elements [begin, end) of a column of `count` elements
+   * into `data`, reading and decompressing only the chunks that hold them.
+   */
+  static void DecompressRange(
+      const ReadRange &read,
+      void *data,
+      std::streamoff begin,
+      std::streamoff end,
+      std::streamsize count,
+      std::streamsize element_size,
+      int threads);
+
+  template <typename T>
+  static std::vector<char> Compress(const std::vector<T> &column, int threads) {
+    return Compress(
+        column.data(),
+        std::ssize(column),
+        static_cast<std::streamsize>(sizeof(T)),
+        threads);
+  }
+
+  template <typename T>
+  static void Decompress(
+      std::span<const char> compressed,
+      std::vector<T> &column,
+      std::streamsize count,
+      int threads) {
+    column.resize(count);
+    Decompress(
+        compressed,
+        column.data(),
+        count,
+        static_cast<std::streamsize>(sizeof(T)),
+        threads);
+  }
+
+  /**
+   * The offsets only grow, so each chunk keeps its first offset and the
+   * differences between the following ones, all as varints, which compress
+   * much better than the offsets themselves.
+   */
+  static std::vector<char> CompressOffsets(
+      const std::vector<int64_t> &offsets,
+      int threads);
+
+  static void DecompressOffsets(
+      std::span<const char> compressed,
+      std::vector<int64_t> &offsets,
+      std::streamsize count,
+      int threads);
+
+  /**
+   * Decompresses the offsets [begin, end) of a column of `count` offsets.
+   */
+  static void DecompressOffsetsRange(
+      const ReadRange &read,
+      std::vector<int64_t> &offsets,
+      std::streamoff begin,
+      std::streamoff end,
+      std::streamsize count,
+      int threads);
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_COMMANDS_COMPRESSED_COLUMNS_H
@@ -0,0 +1,66 @@
+#ifndef KSYNC_SRC_KYSYNC_COMMANDS_INCLUDE_KYSYNC_COMMANDS_ADVISE_COMMAND_H
+#define KSYNC_SRC_KYSYNC_COMMANDS_INCLUDE_KYSYNC_COMMANDS_ADVISE_COMMAND_H
+
+#include <kysync/commands/command.h>
+#include <kysync/commands/prepare_command.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace kysync {
+
+/**
+ * The predicted cost of syncing the input from one seed with one block size.
+ */
+struct Advice {
+  std::streamsize block_size;
+  std::filesystem::path seed_file_path;
+  // size of the metadata prepare produces (estimated from the samples when its
+  // columns are compressed), all of which sync downloads
+  std::streamsize metadata_size;
+  // compressed size of the blocks that are missing from the seed
+  std::streamsize downloaded_size;
+  // size of the blocks that are reconstructed from the seed
+  std::streamsize reused_size;
+  // client cpu time spent on analyzing the seed, decompressing the missing
+  // blocks and verifying the target
+  intmax_t cpu_ms;
+};
+
+/**
+ * Predicts the cost of syncing the input from representative seeds (e.g.
+ * previous versions of the input) for several candidate block sizes, without
+ * preparing the input. At most `max_samples` evenly strided blocks of the
+ * input are sampled (in pairs of neighbours when the strong checksums are
+ * short), and one in `seed_stride` windows of each seed is scanned for them
+ * the way sync scans it. With enough samples and a stride of 1 the predicted
+ * sizes are exact.
+ *
+ * The prediction is for a prepare with `options`. Deduplication, blocks of
+ * zeros and frames are not predicted, and a dictionary is only accounted for
+ * in the size of the metadata (the blocks are compressed without it).
+ */
+class AdviseCommand : public Command {
+protected:
+  AdviseCommand();
+
+public:
+  virtual ~AdviseCommand();
+
+  [[nodiscard]] virtual const std::vector<Advice> &GetAdvice() const = 0;
+
+  static std::unique_ptr<AdviseCommand> Create(
+      std::filesystem::path input_file_path,
+      std::vector<std::filesystem::path> seed_file_paths,
+      std::vector<std::streamsize> block_sizes,
+      std::streamsize max_samples,
+      std::streamsize seed_stride,
+      int threads,
+      const PrepareOptions &options = {});
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_KYSYNC_COMMANDS_INCLUDE_KYSYNC_COMMANDS_ADVISE_COMMAND_H
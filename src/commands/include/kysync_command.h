@@ -6,15 +6,15 @@
 #include <kysync/checksums/strong_checksum.h>
 #include <kysync/commands/command.h>
 
-#include <vector>
+#include <span>
 
 namespace kysync {
 
 class KySyncCommand : public Command {
   friend class KySyncTest;
 
-  virtual const std::vector<uint32_t> &GetWeakChecksums() const = 0;
-  virtual const std::vector<StrongChecksum> &GetStrongChecksums() const = 0;
+  virtual std::span<const uint32_t> GetWeakChecksums() const = 0;
+  virtual std::span<const StrongChecksum> GetStrongChecksums() const = 0;
 
 public:
   KySyncCommand(std::string name);
@@ -1,13 +1,75 @@
 #ifndef KSYNC_SRC_KYSYNC_COMMANDS_INCLUDE_KYSYNC_COMMANDS_PREPARE_COMMAND_H
 #define KSYNC_SRC_KYSYNC_COMMANDS_INCLUDE_KYSYNC_COMMANDS_PREPARE_COMMAND_H
 
+#include <kysync/codecs/codec.h>
 #include <kysync/commands/kysync_command.h>
 
 #include <filesystem>
+#include <istream>
 #include <memory>
+#include <vector>
 
 namespace kysync {
 
+/**
+ * Optional features of the prepared data. All of them are off by default.
+ */
+struct PrepareOptions {
+  // capacity of the zstd dictionary trained from sampled blocks of the input
+  // and used to compress every block, 0 compresses the blocks without one
+  std::streamsize dictionary_size = 0;
+
+  // number of consecutive blocks compressed into one zstd frame, so that they
+  // share their history, while the compressor is flushed after every block,
+  // so that the frame can still be decoded up to any block boundary
+  int blocks_per_frame = 1;
+
+  CodecType codec = CodecType::kZstd;
+
+  // store each distinct block once in the compressed output and refer to it
+  // from its later copies, only supported with one block per frame
+  bool deduplicate = false;
+
+  // flag the blocks that are all zeros in the metadata instead of storing
+  // them, so that sync leaves holes in its output for them, only supported
+  // with one block per frame
+  bool zero_blocks = false;
+
+  // metadata and compressed data prepared earlier from a previous version of
+  // the input, the compressed blocks of which are reused for the blocks that
+  // did not change instead of compressing them again (empty for none)
+  std::filesystem::path previous_metadata_path{};
+  std::filesystem::path previous_compressed_path{};
+
+  // keep the results of each completed part of the input in a sidecar next to
+  // the (first) metadata output, so that rerunning an interrupted prepare with
+  // the same arguments resumes where it stopped (or where its compressed output
+  // was last left intact), the sidecar is removed once the metadata is written
+  // (not supported for a stream input)
+  bool checkpoint = false;
+
+  // store the weak and strong checksums, the compressed offsets and the block
+  // encodings compressed, which makes the metadata cheaper to download at the
+  // cost of decompressing it before sync can look the blocks up
+  bool compress_metadata = false;
+
+  // number of bytes of each strong checksum stored in the metadata, from 4 up
+  // to all 16 of them, where fewer bytes make the metadata smaller and sync
+  // only reuses the blocks of the seed that match next to each other when
+  // fewer than 8 are stored, while the hash of the whole data still catches
+  // any block that matches by chance
+  int strong_checksum_size = 16;
+};
+
+/**
+ * The metadata and compressed data prepared for one block size.
+ */
+struct PrepareVariant {
+  std::streamsize block_size;
+  std::filesystem::path output_ksync_file_path;
+  std::filesystem::path output_compressed_file_path;
+};
+
 class PrepareCommand : public KySyncCommand {
 protected:
   PrepareCommand();
@@ -15,12 +77,38 @@ protected:
 public:
   virtual ~PrepareCommand();
 
+  /**
+   * The input is a file, or any uri `Reader` supports (e.g. http:// or
+   * memory://).
+   */
   static std::unique_ptr<PrepareCommand> Create(
       std::filesystem::path input_file_path,
       std::filesystem::path output_ksync_file_path,
       std::filesystem::path output_compressed_file_path,
       std::streamsize block_size,
-      int threads);
+      int threads,
+      const PrepareOptions &options = {});
+
+  /**
+   * Prepares the input for several block sizes at once, reading it only once.
+   */
+  static std::unique_ptr<PrepareCommand> Create(
+      std::filesystem::path input_file_path,
+      std::vector<PrepareVariant> variants,
+      int threads,
+      const PrepareOptions &options = {});
+
+  /**
+   * Prepares the input read sequentially from a stream that cannot be seeked
+   * (e.g. stdin), the size of which is only known when it ends. The stream
+   * must outlive the command. A dictionary is trained from the beginning of
+   * the input only.
+   */
+  static std::unique_ptr<PrepareCommand> Create(
+      std::istream &input,
+      std::vector<PrepareVariant> variants,
+      int threads,
+      const PrepareOptions &options = {});
 };
 
 }  // namespace kysync
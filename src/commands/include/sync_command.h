@@ -22,6 +22,12 @@ protected:
 public:
   virtual ~SyncCommand() = default;
 
+  /**
+   * If `window_blocks` is not 0, the target is synced in windows of that many
+   * blocks, one after the other, so that the memory sync takes is bounded by
+   * the size of a window. The whole seed is scanned once for each window then,
+   * so the scan takes as many times longer as there are windows.
+   */
   static std::unique_ptr<SyncCommand> Create(
       std::string data_uri,
       std::string metadata_uri,
@@ -29,7 +35,8 @@ public:
       std::filesystem::path output_path,
       bool compression_disabled,
       int num_blocks_in_batch,
-      int threads);
+      int threads,
+      std::streamsize window_blocks = 0);
 };
 
 }  // namespace kysync
@@ -7,40 +7,108 @@
 
 namespace kysync {
 
+namespace {
+
+Header ToProto(const MetadataHeader &header) {
+  auto pb_header = Header();
+  pb_header.set_version(header.version);
+  pb_header.set_size(header.data_size);
+  pb_header.set_block_size(header.block_size);
+  pb_header.set_hash(header.hash);
+  pb_header.set_dictionary_size(header.dictionary_size);
+  pb_header.set_blocks_per_frame(header.blocks_per_frame);
+  pb_header.set_codec(static_cast<uint32_t>(header.codec));
+  pb_header.set_compressed_columns(header.compressed_columns);
+  pb_header.set_strong_checksum_size(header.strong_checksum_size);
+  for (const auto &section : header.sections) {
+    pb_header.add_section_offsets(section.offset);
+    pb_header.add_section_sizes(section.size);
+  }
+  return pb_header;
+}
+
+}  // namespace
+
+std::streamsize HeaderAdapter::GetHeaderSize(const MetadataHeader &header) {
+  auto size = ToProto(header).ByteSizeLong();
+  return static_cast<std::streamsize>(
+      size + google::protobuf::io::CodedOutputStream::VarintSize64(size));
+}
+
+std::streamsize HeaderAdapter::LayoutSections(MetadataHeader &header) {
+  auto layout = [&header](std::streamoff offset, std::streamsize alignment) {
+    for (auto &section : header.sections) {
+      section.offset = (offset + alignment - 1) / alignment * alignment;
+      offset = section.offset + section.size;
+    }
+    return offset;
+  };
+
+  // small metadata is packed right after the header, as the padding to whole
+  // pages would dwarf it (and be downloaded along with it), but the header
+  // holds the offsets, so they are laid out again until it fits before them
+  std::streamoff begin = 0;
+  auto size = layout(begin, kColumnAlignment);
+  while (GetHeaderSize(header) > begin) {
+    begin = GetHeaderSize(header);
+    size = layout(begin, kColumnAlignment);
+  }
+
+  if (size >= kPageAlignedMinSize) {
+    size = layout(kPageAlignment, kPageAlignment);
+  }
+  return size;
+}
+
 std::streamsize HeaderAdapter::WriteHeader(
     std::ostream &output,
-    int version,
-    std::streamsize data_size,
-    std::streamsize block_size,
-    std::string hash) {
-  auto header = Header();
-  header.set_version(version);
-  header.set_size(data_size);
-  header.set_block_size(block_size);
-  header.set_hash(hash);
-
-  google::protobuf::util::SerializeDelimitedToOstream(header, &output);
-
-  return header.ByteSizeLong();
+    const MetadataHeader &header) {
+  auto pb_header = ToProto(header);
+  // the size that prefixes the header takes at most 2 bytes here
+  CHECK_LE(pb_header.ByteSizeLong() + 2, kMaxHeaderSize)
+      << "the header does not fit in its space";
+
+  google::protobuf::util::SerializeDelimitedToOstream(pb_header, &output);
+
+  return pb_header.ByteSizeLong();
 }
 
 std::streamsize HeaderAdapter::ReadHeader(
     const std::vector<uint8_t> &buffer,
-    int &version,
-    std::streamsize &data_size,
-    std::streamsize &block_size,
-    std::string &hash) {
-  auto header = Header();
+    MetadataHeader &header) {
+  auto pb_header = Header();
   auto cs =
       google::protobuf::io::CodedInputStream(buffer.data(), buffer.size());
-  google::protobuf::util::ParseDelimitedFromCodedStream(&header, &cs, nullptr);
+  google::protobuf::util::ParseDelimitedFromCodedStream(
+      &pb_header,
+      &cs,
+      nullptr);
 
-  LOG(INFO) << header.DebugString();
+  LOG(INFO) << pb_header.DebugString();
 
-  version = header.version();
-  data_size = header.size();
-  block_size = header.block_size();
-  hash = header.hash();
+  header.version = static_cast<int>(pb_header.version());
+  header.data_size = static_cast<std::streamsize>(pb_header.size());
+  header.block_size = static_cast<std::streamsize>(pb_header.block_size());
+  header.hash = pb_header.hash();
+  header.dictionary_size =
+      static_cast<std::streamsize>(pb_header.dictionary_size());
+  header.blocks_per_frame =
+      static_cast<std::streamsize>(pb_header.blocks_per_frame());
+  header.codec = static_cast<CodecType>(pb_header.codec());
+  header.compressed_columns = pb_header.compressed_columns();
+  header.strong_checksum_size =
+      static_cast<std::streamsize>(pb_header.strong_checksum_size());
+  // metadata of older versions has no section table, and is rejected by
+  // the version check of the callers
+  if (pb_header.section_offsets_size() == kMetadataSectionCount &&
+      pb_header.section_sizes_size() == kMetadataSectionCount)
+  {
+    for (int i = 0; i < kMetadataSectionCount; i++) {
+      header.sections[i] = {
+          .offset = static_cast<std::streamoff>(pb_header.section_offsets(i)),
+          .size = static_cast<std::streamsize>(pb_header.section_sizes(i))};
+    }
+  }
 
   return cs.CurrentPosition();
 }
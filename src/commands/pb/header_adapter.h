@@ -1,11 +1,107 @@
 #ifndef KSYNC_SRC_COMMANDS_PB_HEADER_ADAPTER_H
 #define KSYNC_SRC_COMMANDS_PB_HEADER_ADAPTER_H
 
+#include <kysync/codecs/codec.h>
+
+#include <array>
+#include <cstdint>
 #include <ostream>
+#include <string>
 #include <vector>
 
 namespace kysync {
 
+/**
+ * How a block is stored in the compressed data, one per block in the metadata.
+ */
+enum class BlockEncoding : uint8_t {
+  kCompressed = 0,
+  // the block did not compress meaningfully, so it is stored as is
+  kRaw = 1,
+  // the block has the same content as an earlier block (its canonical block)
+  // and takes no space in the compressed data
+  kDuplicate = 2,
+  // the block is all zeros and takes no space in the compressed data
+  kZero = 3,
+};
+
+/**
+ * Whether a block of `size` bytes that compresses to `compressed_size` bytes is
+ * stored raw, i.e. compression does not shrink it by at least 1/32, so that
+ * sync does not pay for decompressing it.
+ */
+inline bool IsStoredRaw(std::streamsize size, std::streamsize compressed_size) {
+  static constexpr std::streamsize kMinCompressionGainDivisor = 32;
+  return compressed_size > size - size / kMinCompressionGainDivisor;
+}
+
+/**
+ * The columns of the metadata, in the order they are stored after the header.
+ */
+enum class MetadataSection : uint8_t {
+  // uint32_t per block
+  kWeakChecksums = 0,
+  // the first `strong_checksum_size` bytes of the StrongChecksum per block
+  kStrongChecksums = 1,
+  // int64_t per block and one more, the offset of each block in the compressed
+  // data followed by the size of the compressed data
+  kCompressedOffsets = 2,
+  // BlockEncoding per block
+  kBlockEncodings = 3,
+  // int64_t per duplicate block, its index
+  kDuplicateBlocks = 4,
+  // int64_t per duplicate block, the index of its canonical block
+  kCanonicalBlocks = 5,
+  // the zstd dictionary (empty if none)
+  kDictionary = 6,
+  // the WeakChecksumIndex of the blocks
+  kWeakChecksumIndex = 7,
+};
+
+static constexpr int kMetadataSectionCount = 8;
+
+/**
+ * Where a column of the metadata is, relative to the start of the metadata.
+ */
+struct MetadataSectionInfo {
+  std::streamoff offset{};
+  std::streamsize size{};
+};
+
+/**
+ * The fields of the metadata header, i.e. everything but the block arrays.
+ */
+struct MetadataHeader {
+  int version{};
+  std::streamsize data_size{};
+  std::streamsize block_size{};
+  std::string hash{};
+  // size of the zstd dictionary stored after the block arrays (0 if none)
+  std::streamsize dictionary_size{};
+  // number of consecutive blocks that share a zstd frame
+  std::streamsize blocks_per_frame{1};
+  CodecType codec{CodecType::kZstd};
+  // the weak checksums, strong checksums, compressed offsets and block
+  // encodings are stored as `CompressedColumns` rather than as they are
+  bool compressed_columns{};
+  // number of bytes kept of each strong checksum, up to all 16 of them
+  std::streamsize strong_checksum_size{16};
+  std::array<MetadataSectionInfo, kMetadataSectionCount> sections{};
+
+  [[nodiscard]] const MetadataSectionInfo &GetSection(
+      MetadataSection section) const {
+    return sections[static_cast<int>(section)];
+  }
+
+  MetadataSectionInfo &GetSection(MetadataSection section) {
+    return sections[static_cast<int>(section)];
+  }
+
+  [[nodiscard]] bool IsCompressed(MetadataSection section) const {
+    return compressed_columns && section <= MetadataSection::kBlockEncodings;
+  }
+};
+
 /***
  * NOTE: clang-tidy 13 + MSVC does not like protobuf.
  * See the error below and note it is an error not warning.
@@ -33,19 +129,52 @@ Kits\10\include\10.0.19041.0\ucrt\stddef.h:47:32: note: expanded from macro
 
 class HeaderAdapter {
 public:
+  /**
+   * The version of the metadata produced by prepare and accepted by sync.
+   * - 3: the hash is the root of a tree over the strong checksums of the blocks
+   * - 4: the block encodings follow the compressed sizes
+   * - 5: the canonical blocks of the duplicates follow the block encodings
+   * - 6: blocks of zeros are flagged by their encoding
+   * - 7: the columns start at aligned offsets listed in the header, the
+   *   compressed sizes are replaced by offsets and the duplicate blocks are
+   *   listed, so that the metadata can be used in place (e.g. memory mapped)
+   * - 8: some of the columns may be compressed
+   * - 9: the strong checksums may be truncated
+   * - 10: the index of the weak checksums follows the dictionary
+   * - 11: the entries of the index of the weak checksums are packed in a word
+   */
+  static constexpr int kVersion = 11;
+
+  // the header is never larger than this
+  static constexpr std::streamsize kMaxHeaderSize = 1024;
+
+  // the columns of metadata at least this large start at multiples of a page,
+  // the first one after the header, so that they map a page at a time
+  static constexpr std::streamsize kPageAlignedMinSize = 1024 * 1024;
+  static constexpr std::streamsize kPageAlignment = 4096;
+
+  // the columns of smaller metadata are packed after the header, each aligned
+  // for its elements
+  static constexpr std::streamsize kColumnAlignment = sizeof(int64_t);
+
+  /**
+   * The size of the header as written, including the size that prefixes it.
+   */
+  static std::streamsize GetHeaderSize(const MetadataHeader &header);
+
+  /**
+   * Places the sections of the header one after the other, at aligned
+   * offsets, given their sizes. Returns the size of the whole metadata.
+   */
+  static std::streamsize LayoutSections(MetadataHeader &header);
+
   static std::streamsize WriteHeader(
       std::ostream &output,
-      int version,
-      std::streamsize data_size,
-      std::streamsize block_size,
-      std::string hash);
+      const MetadataHeader &header);
 
   static std::streamsize ReadHeader(
       const std::vector<uint8_t> &buffer,
-      int &version,
-      std::streamsize &data_size,
-      std::streamsize &block_size,
-      std::string &hash);
+      MetadataHeader &header);
 };
 
 }  // namespace kysync
@@ -4,17 +4,31 @@
 #include <ky/min.h>
 #include <ky/observability/observable.h>
 #include <ky/parallelize.h>
+#include <kysync/checksums/strong_checksum.h>
 #include <kysync/checksums/strong_checksum_builder.h>
 #include <kysync/checksums/weak_checksum.h>
+#include <kysync/codecs/codec.h>
 #include <kysync/commands/prepare_command.h>
+#include <kysync/readers/reader.h>
 #include <kysync/streams.h>
-#include <zstd.h>
 
+#include <algorithm>
+#include <array>
 #include <cinttypes>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 
+#include "compressed_columns.h"
 #include "pb/header_adapter.h"
+#include "weak_checksum_index.h"
 
 namespace kysync {
 
@@ -25,62 +39,257 @@ class KySyncTest;
 // NOLINTNEXTLINE(fuchsia-multiple-inheritance,fuchsia-virtual-inheritance)
 class PrepareCommandImpl final : public PrepareCommand {
   friend class KySyncTest;
-  friend class ChunkPreparer;
 
-  fs::path input_file_path_;
-  fs::path output_ksync_file_path_;
-
-  ky::FileStreamProvider output_compressed_file_stream_provider_;
+  class Variant;
+  class ChunkPreparer;
 
-  std::streamsize block_size_;
-  std::streamsize max_compressed_block_size_;
+  std::string input_uri_;
 
-  std::vector<uint32_t> weak_checksums_;
-  std::vector<StrongChecksum> strong_checksums_;
-  std::vector<std::streamsize> compressed_sizes_;
+  // read sequentially instead of the input uri when set
+  std::istream *input_stream_;
 
-  int compression_level_ = 1;
   int threads_;
+  PrepareOptions options_;
 
-  ky::metrics::Metric compressed_bytes_{};
+  // one per block size, all of them prepared from a single read of the input
+  std::vector<std::unique_ptr<Variant>> variants_;
+
+  // zstd suggests training on about 100 times the dictionary capacity
+  static constexpr std::streamsize kDictionarySamplesFactor = 100;
+
+  // fewer bytes of the strong checksums would match by chance too often
+  static constexpr int kMinStrongChecksumSize = 4;
+
+  // Each round bounds the input and the compressed data held in memory before
+  // the latter is written to its final position in the compressed outputs.
+  // The chunk of each worker shrinks when there are many of them, so that the
+  // round stays within its budget whatever the number of threads.
+  static constexpr std::streamsize kMaxChunkSize = 16 * 1024 * 1024;
+  static constexpr std::streamsize kMaxRoundSize = 64 * 1024 * 1024;
+
+  // a stream is read into the round this much at a time
+  static constexpr std::streamsize kStreamReadSize = 4 * 1024 * 1024;
+
+  // chunks are aligned to the frames of every variant
+  std::streamsize chunk_alignment_{};
+  std::streamsize round_size_{};
+
+  // one per worker, so that the chunks of a round are read concurrently
+  std::vector<std::unique_ptr<Reader>> readers_;
+  std::streamsize data_size_{};
+
+  // the input is read a whole round at a time, the next round being read
+  // while the current one is prepared, and the workers prepare their chunks
+  // in place
+  std::array<std::vector<char>, 2> round_buffers_;
 
-  [[nodiscard]] const std::vector<uint32_t> &GetWeakChecksums() const override;
-  [[nodiscard]] const std::vector<StrongChecksum> &GetStrongChecksums()
+  // one per worker, the compressed blocks of its chunk, which is prepared for
+  // one variant after the other so that they all reuse the same buffer
+  std::vector<std::vector<char>> compressed_buffers_;
+
+  ky::metrics::Metric compressed_bytes_{};
+  ky::metrics::Metric raw_bytes_{};
+  ky::metrics::Metric deduplicated_bytes_{};
+  ky::metrics::Metric reused_bytes_{};
+  ky::metrics::Metric resumed_bytes_{};
+  ky::metrics::Metric zero_bytes_{};
+
+  static constexpr int64_t kCheckpointVersion = 3;
+
+  // the checkpoint records the size and modification time of the input and a
+  // checksum of this many of its first bytes, so that it is not resumed for a
+  // different input
+  static constexpr std::streamsize kCheckpointFingerprintSize = 1024 * 1024;
+  std::vector<int64_t> input_fingerprint_;
+
+  // the checksum of the metadata of the previous version, if any
+  StrongChecksum previous_metadata_checksum_{};
+
+  // the results of each round are appended to this sidecar once the round is
+  // written to the compressed outputs, so that an interrupted prepare resumes
+  // after the last completed round
+  fs::path checkpoint_path_;
+
+  static std::span<const char> GetColumn(
+      const std::vector<uint8_t> &metadata,
+      const MetadataHeader &header,
+      MetadataSection section);
+
+  template <typename T>
+  void ReadColumn(
+      const std::vector<uint8_t> &metadata,
+      const MetadataHeader &header,
+      MetadataSection section,
+      std::vector<T> &column,
+      std::streamsize count) const;
+
+  static bool IsZero(const char *data, std::streamsize size);
+
+  void LoadPreviousVersion();
+
+  template <typename T>
+  static void WriteCheckpointColumn(
+      std::ostream &output,
+      const std::vector<T> &column,
+      std::streamoff begin,
+      std::streamoff end);
+
+  void ComputeInputFingerprint();
+  [[nodiscard]] std::vector<int64_t> GetCheckpointHeader() const;
+  std::streamoff LoadCheckpoint();
+  void WriteCheckpointHeader() const;
+  void WriteCheckpoint(
+      std::streamoff round_offset,
+      std::streamsize round_size) const;
+  std::streamsize
+  ReadRound(std::vector<char> &buffer, std::streamoff round_offset);
+  void PrepareRound(
+      std::streamoff round_offset,
+      std::streamsize round_size,
+      const char *round_data);
+  std::streamsize PrepareInput();
+
+  [[nodiscard]] std::span<const uint32_t> GetWeakChecksums() const override;
+  [[nodiscard]] std::span<const StrongChecksum> GetStrongChecksums()
       const override;
 
 public:
   PrepareCommandImpl(
       fs::path input_file_path,
-      fs::path output_ksync_file_path,
-      fs::path output_compressed_file_path,
-      std::streamsize block_size,
-      int threads);
+      std::istream *input_stream,
+      std::vector<PrepareVariant> variants,
+      int threads,
+      PrepareOptions options);
+
+  ~PrepareCommandImpl() override;
 
   int Run() override;
 
   void Accept(ky::metrics::MetricVisitor &visitor) override;
+};
+
+/**
+ * The metadata and compressed data of one block size.
+ */
+class PrepareCommandImpl::Variant final {
+  friend class PrepareCommandImpl;
+  friend class PrepareCommandImpl::ChunkPreparer;
+
+  PrepareCommandImpl &prepare_command_;
+
+  fs::path output_ksync_file_path_;
+
+  ky::FileStreamProvider output_compressed_file_stream_provider_;
 
-  class ChunkPreparer final {
-    PrepareCommandImpl &prepare_command_;
+  std::streamsize block_size_;
+  std::streamsize max_compressed_block_size_{};
+  std::streamsize frame_size_;
 
-    std::ifstream input_;
-    std::fstream output_;
+  std::vector<uint32_t> weak_checksums_;
+  std::vector<StrongChecksum> strong_checksums_;
+  std::vector<std::streamsize> compressed_sizes_;
+  std::vector<BlockEncoding> block_encodings_;
 
-    std::streamoff start_offset_;
-    std::streamoff finish_offset_;
+  // the canonical block of each duplicate block, in block order
+  std::vector<int64_t> canonical_blocks_;
 
-    std::vector<char> buffer_;
-    std::vector<char> compressed_buffer_;
+  // the checksums of a block of zeros, computed once
+  uint32_t zero_weak_checksum_{};
+  StrongChecksum zero_strong_checksum_;
 
-    void Prepare();
-    void CompressBuffer(int block_index, std::streamsize size);
+  // weak checksum -> index of the first block seen with that content
+  std::unordered_multimap<uint32_t, std::streamsize> unique_blocks_;
 
-  public:
-    ChunkPreparer(
-        PrepareCommandImpl &prepare_command,
-        std::streamoff start_offset,
-        std::streamoff finish_offset);
+  struct PreviousBlock {
+    StrongChecksum strong_checksum;
+    std::streamsize size;
+    std::streamoff compressed_offset;
+    std::streamsize compressed_size;
+    BlockEncoding encoding;
   };
+
+  // weak checksum -> the blocks of the previous version that can be reused
+  std::unordered_multimap<uint32_t, PreviousBlock> previous_blocks_;
+
+  // one per worker, reused across all the blocks it compresses, so that the
+  // state of the codec is allocated and set up only once
+  std::vector<std::unique_ptr<Codec>> codecs_;
+
+  std::vector<char> dictionary_;
+
+  std::streamoff compressed_offset_{};
+
+  // the checksum of the compressed output of the last round, which the
+  // checkpoint records so that a resume can tell the output was not changed
+  StrongChecksum round_checksum_{};
+
+  void LoadPreviousBlocks(
+      const MetadataHeader &header,
+      const std::vector<uint8_t> &metadata);
+  [[nodiscard]] const PreviousBlock *FindPreviousBlock(
+      std::streamsize block_index,
+      std::streamsize size) const;
+  void TrainDictionary(std::streamsize data_size, const char *data);
+  void LoadDictionary();
+  std::streamsize FindCanonicalBlock(std::streamsize block_index);
+  void Allocate(std::streamsize data_size);
+  void WriteMetadata(std::streamsize data_size);
+  [[nodiscard]] bool IsOutputIntact(
+      std::streamoff begin,
+      std::streamoff end,
+      const StrongChecksum &checksum) const;
+
+public:
+  Variant(PrepareCommandImpl &prepare_command, PrepareVariant variant);
+};
+
+class PrepareCommandImpl::ChunkPreparer final {
+  Variant &variant_;
+  Codec &codec_;
+
+  std::ifstream previous_compressed_input_;
+
+  // the input of the chunk, shared by the preparers of all the variants
+  const char *data_;
+
+  std::streamoff start_offset_;
+  std::streamoff finish_offset_;
+
+  std::vector<char> buffer_;
+  std::vector<char> &compressed_buffer_;
+  std::streamsize compressed_size_{};
+
+  void Prepare();
+  void CompressBuffer(
+      std::streamsize block_index,
+      const char *block,
+      std::streamoff offset,
+      std::streamsize size);
+  std::streamsize
+  CompressBlock(
+      std::streamsize block_index,
+      const char *block,
+      std::streamsize size);
+  std::streamsize CompressFrameBlock(
+      const char *block,
+      std::streamoff offset,
+      std::streamsize size);
+
+public:
+  ChunkPreparer(
+      Variant &variant,
+      Codec &codec,
+      std::vector<char> &compressed_buffer,
+      const char *data,
+      std::streamoff start_offset,
+      std::streamoff finish_offset);
+
+  [[nodiscard]] std::streamsize GetCompressedSize() const;
+  [[nodiscard]] std::span<const char> GetCompressedData() const;
+
+  void Deduplicate();
+
+  void Write(std::streamoff compressed_offset) const;
 };
 
 PrepareCommand::~PrepareCommand() = default;
@@ -90,181 +299,1294 @@ std::unique_ptr<PrepareCommand> PrepareCommand::Create(
     std::filesystem::path output_ksync_file_path,
     std::filesystem::path output_compressed_file_path,
     std::streamsize block_size,
-    int threads) {
+    int threads,
+    const PrepareOptions &options) {
+  return Create(
+      std::move(input_file_path),
+      {{.block_size = block_size,
+        .output_ksync_file_path = std::move(output_ksync_file_path),
+        .output_compressed_file_path = std::move(output_compressed_file_path)}},
+      threads,
+      options);
+}
+
+std::unique_ptr<PrepareCommand> PrepareCommand::Create(
+    std::filesystem::path input_file_path,
+    std::vector<PrepareVariant> variants,
+    int threads,
+    const PrepareOptions &options) {
   return std::make_unique<PrepareCommandImpl>(
       std::move(input_file_path),
-      std::move(output_ksync_file_path),
-      std::move(output_compressed_file_path),
-      block_size,
-      threads);
+      nullptr,
+      std::move(variants),
+      threads,
+      options);
+}
+
+std::unique_ptr<PrepareCommand> PrepareCommand::Create(
+    std::istream &input,
+    std::vector<PrepareVariant> variants,
+    int threads,
+    const PrepareOptions &options) {
+  return std::make_unique<PrepareCommandImpl>(
+      fs::path(),
+      &input,
+      std::move(variants),
+      threads,
+      options);
 }
 
 PrepareCommand::PrepareCommand() : KySyncCommand("prepare") {}
 
-const std::vector<uint32_t> &PrepareCommandImpl::GetWeakChecksums() const {
-  return weak_checksums_;
+std::span<const uint32_t> PrepareCommandImpl::GetWeakChecksums() const {
+  return variants_[0]->weak_checksums_;
 }
 
-const std::vector<StrongChecksum> &PrepareCommandImpl::GetStrongChecksums()
+std::span<const StrongChecksum> PrepareCommandImpl::GetStrongChecksums()
     const {
-  return strong_checksums_;
+  return variants_[0]->strong_checksums_;
 }
 
-void PrepareCommandImpl::ChunkPreparer::Prepare() {
-  input_.seekg(start_offset_);
+bool PrepareCommandImpl::IsZero(const char *data, std::streamsize size) {
+  // comparing the data to itself shifted by one byte lets memcmp do the work
+  // with its vectorized loop
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
 
-  auto block_size = static_cast<std::streamsize>(buffer_.size());
+void PrepareCommandImpl::ChunkPreparer::Prepare() {
+  auto block_size = variant_.block_size_;
 
   auto current_offset = start_offset_;
-  auto block_index = static_cast<int>(start_offset_ / block_size);
+  auto block_index = start_offset_ / block_size;
 
   while (current_offset < finish_offset_) {
-    auto size_to_read = ky::Min(block_size, finish_offset_ - current_offset);
-    memset(buffer_.data() + size_to_read, 0, buffer_.size() - size_to_read);
+    auto size = ky::Min(block_size, finish_offset_ - current_offset);
+    const auto *block = data_ + (current_offset - start_offset_);
+
+    // the last block of the input is zero padded
+    if (size < block_size) {
+      memcpy(buffer_.data(), block, size);
+      memset(buffer_.data() + size, 0, block_size - size);
+      block = buffer_.data();
+    }
+
+    auto &prepare_command = variant_.prepare_command_;
+    if (prepare_command.options_.zero_blocks && IsZero(block, size)) {
+      // the trailing block is zero padded, so it has the same checksums
+      variant_.weak_checksums_[block_index] = variant_.zero_weak_checksum_;
+      variant_.strong_checksums_[block_index] = variant_.zero_strong_checksum_;
+      variant_.compressed_sizes_[block_index] = 0;
+      variant_.block_encodings_[block_index] = BlockEncoding::kZero;
+      prepare_command.zero_bytes_ += size;
+    } else {
+      // FIXME(kyotov): should this be `size` instead of `block_size`
+      variant_.weak_checksums_[block_index] = WeakChecksum(block, block_size);
+
+      variant_.strong_checksums_[block_index] =
+          StrongChecksum::Compute(block, block_size);
+
+      CompressBuffer(block_index, block, current_offset, size);
+    }
+
+    prepare_command.AdvanceProgress(size);
 
-    input_.read(buffer_.data(), size_to_read);
-    CHECK(input_);
-    CHECK(input_.gcount() == size_to_read);
+    current_offset += block_size;
+    block_index++;
+  }
+}
 
-    // FIXME(kyotov): should this be `size_to_read` instead of `block_size`
-    prepare_command_.weak_checksums_[block_index] =
-        WeakChecksum(buffer_.data(), block_size);
+void PrepareCommandImpl::ChunkPreparer::CompressBuffer(
+    std::streamsize block_index,
+    const char *block,
+    std::streamoff offset,
+    std::streamsize size) {
+  auto compressed_size =
+      variant_.prepare_command_.options_.blocks_per_frame > 1
+          ? CompressFrameBlock(block, offset, size)
+          : CompressBlock(block_index, block, size);
 
-    prepare_command_.strong_checksums_[block_index] =
-        StrongChecksum::Compute(buffer_.data(), block_size);
+  compressed_size_ += compressed_size;
 
-    CompressBuffer(block_index, size_to_read);
+  variant_.compressed_sizes_[block_index] = compressed_size;
+  variant_.prepare_command_.compressed_bytes_ += compressed_size;
+}
 
-    prepare_command_.AdvanceProgress(size_to_read);
+std::streamsize PrepareCommandImpl::ChunkPreparer::CompressBlock(
+    std::streamsize block_index,
+    const char *block,
+    std::streamsize size) {
+  auto &prepare_command = variant_.prepare_command_;
+
+  // compressed blocks are laid out back to back, exactly as they are going to
+  // appear in the compressed output
+  auto *compressed_block = compressed_buffer_.data() + compressed_size_;
+
+  const auto *previous_block = variant_.FindPreviousBlock(block_index, size);
+  if (previous_block != nullptr) {
+    // the previous version was compressed by the same codec with the same
+    // dictionary, so its bytes are exactly what compressing would produce
+    CHECK_LE(
+        previous_block->compressed_size,
+        variant_.max_compressed_block_size_);
+    previous_compressed_input_.seekg(previous_block->compressed_offset);
+    previous_compressed_input_.read(
+        compressed_block,
+        previous_block->compressed_size);
+    CHECK(previous_compressed_input_)
+        << "error reading from "
+        << prepare_command.options_.previous_compressed_path;
+
+    variant_.block_encodings_[block_index] = previous_block->encoding;
+    if (previous_block->encoding == BlockEncoding::kRaw) {
+      prepare_command.raw_bytes_ += size;
+    }
+    prepare_command.reused_bytes_ += size;
+    return previous_block->compressed_size;
+  }
 
-    current_offset += block_size;
-    block_index++;
+  auto compressed_size = codec_.Compress(
+      compressed_block,
+      variant_.max_compressed_block_size_,
+      block,
+      size);
+
+  if (IsStoredRaw(size, compressed_size)) {
+    memcpy(compressed_block, block, size);
+    variant_.block_encodings_[block_index] = BlockEncoding::kRaw;
+    prepare_command.raw_bytes_ += size;
+    return size;
   }
+
+  return compressed_size;
 }
 
-void PrepareCommandImpl::ChunkPreparer::CompressBuffer(
-    int block_index,
+std::streamsize PrepareCommandImpl::ChunkPreparer::CompressFrameBlock(
+    const char *block,
+    std::streamoff offset,
     std::streamsize size) {
-  std::streamsize compressed_size =
-      ZSTD_compress(  // NOLINT(cppcoreguidelines-narrowing-conversions)
-          compressed_buffer_.data(),
-          prepare_command_.max_compressed_block_size_,
-          buffer_.data(),
-          size,
-          prepare_command_.compression_level_);
-  CHECK(!ZSTD_isError(compressed_size)) << ZSTD_getErrorName(compressed_size);
+  // NOTE: blocks of a frame are never stored raw as that would break the
+  // frame, but codecs with frames (i.e. zstd) store incompressible parts of a
+  // frame as is anyway
 
-  output_.seekp(block_index * prepare_command_.max_compressed_block_size_);
-  output_.write(compressed_buffer_.data(), compressed_size);
-  CHECK(output_);
+  // chunks are aligned to frames, so a frame never spans two chunks
+  auto frame_offset = offset - offset % variant_.frame_size_;
+  auto frame_end_offset =
+      ky::Min(frame_offset + variant_.frame_size_, finish_offset_);
 
-  prepare_command_.compressed_sizes_[block_index] = compressed_size;
-  prepare_command_.compressed_bytes_ += compressed_size;
+  if (offset == frame_offset) {
+    codec_.BeginFrame(frame_end_offset - frame_offset);
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  return codec_.CompressFrameBlock(
+      compressed_buffer_.data() + compressed_size_,
+      compressed_buffer_.size() - compressed_size_,
+      block,
+      size,
+      offset + size == frame_end_offset);
 }
 
 PrepareCommandImpl::ChunkPreparer::ChunkPreparer(
-    PrepareCommandImpl &prepare_command,
+    Variant &variant,
+    Codec &codec,
+    std::vector<char> &compressed_buffer,
+    const char *data,
     std::streamoff start_offset,
     std::streamoff finish_offset)
-    : prepare_command_(prepare_command),
-      input_(prepare_command.input_file_path_, std::ios::binary),
-      output_(std::move(prepare_command.output_compressed_file_stream_provider_
-                            .CreateFileStream())),
+    : variant_(variant),
+      codec_(codec),
+      data_(data),
       start_offset_(start_offset),
       finish_offset_(finish_offset),
-      buffer_(prepare_command.block_size_),
-      compressed_buffer_(prepare_command.max_compressed_block_size_) {
-  CHECK(start_offset_ % prepare_command_.block_size_ == 0);
-  CHECK(input_) << "error reading from " << prepare_command_.input_file_path_;
+      buffer_(variant.block_size_),
+      compressed_buffer_(compressed_buffer) {
+  CHECK(start_offset_ % variant_.block_size_ == 0);
+
+  if (!variant_.previous_blocks_.empty()) {
+    const auto &previous_compressed_path =
+        variant_.prepare_command_.options_.previous_compressed_path;
+    previous_compressed_input_.open(previous_compressed_path, std::ios::binary);
+    CHECK(previous_compressed_input_)
+        << "error reading from " << previous_compressed_path;
+  }
+
+  if (finish_offset_ > start_offset_) {
+    auto block_count =
+        (finish_offset_ - start_offset_ + variant_.block_size_ - 1) /
+        variant_.block_size_;
+    auto size = block_count * variant_.max_compressed_block_size_;
+    if (std::ssize(compressed_buffer_) < size) {
+      compressed_buffer_.resize(size);
+    }
+  }
 
   Prepare();
 }
 
+std::streamsize PrepareCommandImpl::ChunkPreparer::GetCompressedSize() const {
+  return compressed_size_;
+}
+
+std::span<const char> PrepareCommandImpl::ChunkPreparer::GetCompressedData()
+    const {
+  return {compressed_buffer_.data(), static_cast<size_t>(compressed_size_)};
+}
+
+void PrepareCommandImpl::ChunkPreparer::Deduplicate() {
+  auto &prepare_command = variant_.prepare_command_;
+  auto block_size = variant_.block_size_;
+  auto block_index = start_offset_ / block_size;
+
+  // the compressed blocks that are kept are moved down over the dropped ones,
+  // so that the buffer is again laid out exactly as the compressed output
+  std::streamsize compressed_offset = 0;
+  std::streamsize kept_size = 0;
+
+  for (auto offset = start_offset_; offset < finish_offset_;
+       offset += block_size, block_index++)
+  {
+    auto compressed_size = variant_.compressed_sizes_[block_index];
+    compressed_offset += compressed_size;
+
+    // blocks of zeros take no space already
+    if (variant_.block_encodings_[block_index] == BlockEncoding::kZero) {
+      continue;
+    }
+
+    // the checksums of a trailing partial block cover its zero padding, so it
+    // could be mistaken for a full block and is never deduplicated
+    auto canonical_block_index = finish_offset_ - offset >= block_size
+                                     ? variant_.FindCanonicalBlock(block_index)
+                                     : block_index;
+
+    if (canonical_block_index == block_index) {
+      memmove(
+          compressed_buffer_.data() + kept_size,
+          compressed_buffer_.data() + compressed_offset - compressed_size,
+          compressed_size);
+      kept_size += compressed_size;
+      continue;
+    }
+
+    auto &block_encoding = variant_.block_encodings_[block_index];
+    if (block_encoding == BlockEncoding::kRaw) {
+      prepare_command.raw_bytes_ -= block_size;
+    }
+    block_encoding = BlockEncoding::kDuplicate;
+
+    variant_.compressed_sizes_[block_index] = 0;
+    prepare_command.compressed_bytes_ -= compressed_size;
+    prepare_command.deduplicated_bytes_ += block_size;
+    variant_.canonical_blocks_.push_back(canonical_block_index);
+  }
+
+  compressed_size_ = kept_size;
+}
+
+void PrepareCommandImpl::ChunkPreparer::Write(
+    std::streamoff compressed_offset) const {
+  if (compressed_size_ == 0) {
+    return;
+  }
+
+  auto output =
+      variant_.output_compressed_file_stream_provider_.CreateFileStream();
+  output.seekp(compressed_offset);
+  output.write(compressed_buffer_.data(), compressed_size_);
+  CHECK(output) << "error writing compressed output";
+}
+
+PrepareCommandImpl::Variant::Variant(
+    PrepareCommandImpl &prepare_command,
+    PrepareVariant variant)
+    : prepare_command_(prepare_command),
+      output_ksync_file_path_(std::move(variant.output_ksync_file_path)),
+      output_compressed_file_stream_provider_(
+          std::move(variant.output_compressed_file_path)),
+      block_size_(variant.block_size),
+      frame_size_(
+          variant.block_size * prepare_command.options_.blocks_per_frame) {
+  for (int id = 0; id < prepare_command_.threads_; id++) {
+    codecs_.push_back(Codec::Create(prepare_command_.options_.codec));
+  }
+
+  max_compressed_block_size_ = codecs_[0]->GetMaxCompressedSize(block_size_);
+
+  if (prepare_command_.options_.zero_blocks) {
+    auto zeros = std::vector<char>(block_size_);
+    zero_weak_checksum_ = WeakChecksum(zeros.data(), block_size_);
+    zero_strong_checksum_ = StrongChecksum::Compute(zeros.data(), block_size_);
+  }
+}
+
 PrepareCommandImpl::PrepareCommandImpl(
     std::filesystem::path input_file_path,
-    std::filesystem::path output_ksync_file_path,
-    std::filesystem::path output_compressed_file_path,
-    std::streamsize block_size,
-    int threads)
-    : input_file_path_(std::move(input_file_path)),
-      output_ksync_file_path_(std::move(output_ksync_file_path)),
-      output_compressed_file_stream_provider_(
-          std::move(output_compressed_file_path)),
-      block_size_(block_size),
-      max_compressed_block_size_(
-          static_cast<std::streamsize>(ZSTD_compressBound(block_size))),
-      threads_(threads) {}
+    std::istream *input_stream,
+    std::vector<PrepareVariant> variants,
+    int threads,
+    PrepareOptions options)
+    : input_stream_(input_stream),
+      threads_(threads),
+      options_(std::move(options)) {
+  CHECK(!variants.empty()) << "at least one block size is required";
+  CHECK_GE(options_.blocks_per_frame, 1)
+      << "invalid number of blocks per frame";
+  CHECK(!options_.deduplicate || options_.blocks_per_frame == 1)
+      << "deduplication requires one block per frame";
+  CHECK(!options_.zero_blocks || options_.blocks_per_frame == 1)
+      << "blocks of zeros can only be flagged with one block per frame";
+  CHECK(
+      options_.strong_checksum_size >= kMinStrongChecksumSize &&
+      options_.strong_checksum_size <=
+          static_cast<int>(sizeof(StrongChecksum)))
+      << "invalid strong checksum size";
+  CHECK(
+      options_.previous_metadata_path.empty() ||
+      !options_.previous_compressed_path.empty())
+      << "the compressed data of the previous version is required";
+  CHECK(!options_.checkpoint || input_stream_ == nullptr)
+      << "a checkpoint cannot be resumed for a stream, which cannot be told "
+         "apart from another one";
+  for (const auto &variant : variants) {
+    CHECK(
+        options_.previous_compressed_path !=
+        variant.output_compressed_file_path)
+        << "the previous version cannot be overwritten while it is reused";
+  }
 
-int PrepareCommandImpl::Run() {
+  // inputs given as an uri (e.g. http:// or memory://) are read as is
+  input_uri_ = input_file_path.string();
+  if (input_uri_.find("://") == std::string::npos) {
+    input_uri_ = "file://" + input_uri_;
+  }
+
+  chunk_alignment_ = 1;
+  for (auto &variant : variants) {
+    variants_.push_back(std::make_unique<Variant>(*this, std::move(variant)));
+    chunk_alignment_ =
+        std::lcm(chunk_alignment_, variants_.back()->frame_size_);
+  }
+
+  auto chunk_size = ky::Min(kMaxChunkSize, kMaxRoundSize / threads_);
+  round_size_ = threads_ *
+                std::max<std::streamsize>(chunk_size / chunk_alignment_, 1) *
+                chunk_alignment_;
+  compressed_buffers_.resize(threads_);
+
+  checkpoint_path_ = variants_[0]->output_ksync_file_path_;
+  checkpoint_path_ += ".checkpoint";
+
+  const auto &codec = *variants_[0]->codecs_[0];
+  CHECK(options_.blocks_per_frame == 1 || codec.SupportsFrames())
+      << "the codec does not support frames of several blocks";
+  CHECK(options_.dictionary_size == 0 || codec.SupportsDictionary())
+      << "the codec does not support dictionaries";
+}
+
+PrepareCommandImpl::~PrepareCommandImpl() = default;
+
+std::span<const char> PrepareCommandImpl::GetColumn(
+    const std::vector<uint8_t> &metadata,
+    const MetadataHeader &header,
+    MetadataSection section) {
+  const auto &info = header.GetSection(section);
+  CHECK(
+      info.offset >= 0 && info.size >= 0 &&
+      info.offset + info.size <= std::ssize(metadata))
+      << "truncated metadata";
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  return {reinterpret_cast<const char *>(metadata.data()) + info.offset,
+          static_cast<size_t>(info.size)};
+}
+
+template <typename T>
+void PrepareCommandImpl::ReadColumn(
+    const std::vector<uint8_t> &metadata,
+    const MetadataHeader &header,
+    MetadataSection section,
+    std::vector<T> &column,
+    std::streamsize count) const {
+  auto data = GetColumn(metadata, header, section);
+  if (header.IsCompressed(section)) {
+    CompressedColumns::Decompress(data, column, count, threads_);
+    return;
+  }
+  CHECK_EQ(std::ssize(data), count * static_cast<std::streamsize>(sizeof(T)))
+      << "invalid metadata section";
+  column.resize(count);
+  memcpy(column.data(), data.data(), data.size());
+}
+
+void PrepareCommandImpl::LoadPreviousVersion() {
+  const auto &metadata_path = options_.previous_metadata_path;
   // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
-  std::streamsize data_size = std::filesystem::file_size(input_file_path_);
-  StartNextPhase(data_size);
+  std::streamsize metadata_size = std::filesystem::file_size(metadata_path);
+
+  StartNextPhase(metadata_size);
+  LOG(INFO) << "loading previous version...";
+
+  auto input = std::ifstream(metadata_path, std::ios::binary);
+  auto metadata = std::vector<uint8_t>(metadata_size);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  input.read(reinterpret_cast<char *>(metadata.data()), metadata_size);
+  CHECK(input) << "error reading from " << metadata_path;
+  AdvanceProgress(metadata_size);
+  previous_metadata_checksum_ =
+      StrongChecksum::Compute(metadata.data(), metadata_size);
+
+  auto header = MetadataHeader();
+  HeaderAdapter::ReadHeader(metadata, header);
+
+  // the previous blocks are reused by the variant with the same block size
+  auto variant = std::find_if(
+      variants_.begin(),
+      variants_.end(),
+      [&header](const auto &variant) {
+        return variant->block_size_ == header.block_size;
+      });
+
+  // the compressed blocks can only be reused if they are decoded the same way
+  // as the blocks compressed now, and if they are told apart by their whole
+  // strong checksums, as prepare does not verify them
+  if (header.version != HeaderAdapter::kVersion || variant == variants_.end() ||
+      header.codec != options_.codec || header.blocks_per_frame != 1 ||
+      options_.blocks_per_frame != 1 ||
+      (header.dictionary_size > 0) != (options_.dictionary_size > 0) ||
+      header.strong_checksum_size !=
+          static_cast<std::streamsize>(sizeof(StrongChecksum)))
+  {
+    LOG(WARNING) << "the previous version was prepared differently, "
+                    "preparing from scratch";
+    return;
+  }
+
+  (*variant)->LoadPreviousBlocks(header, metadata);
+}
+
+void PrepareCommandImpl::Variant::LoadPreviousBlocks(
+    const MetadataHeader &header,
+    const std::vector<uint8_t> &metadata) {
+  auto block_count = (header.data_size + block_size_ - 1) / block_size_;
+
+  auto weak_checksums = std::vector<uint32_t>();
+  auto strong_checksums = std::vector<StrongChecksum>();
+  auto compressed_offsets = std::vector<int64_t>();
+  auto block_encodings = std::vector<BlockEncoding>();
+  auto dictionary = std::vector<char>();
+
+  using Section = MetadataSection;
+  const auto &impl = prepare_command_;
+  impl.ReadColumn(
+      metadata,
+      header,
+      Section::kWeakChecksums,
+      weak_checksums,
+      block_count);
+  impl.ReadColumn(
+      metadata,
+      header,
+      Section::kStrongChecksums,
+      strong_checksums,
+      block_count);
+  if (header.IsCompressed(Section::kCompressedOffsets)) {
+    CompressedColumns::DecompressOffsets(
+        GetColumn(metadata, header, Section::kCompressedOffsets),
+        compressed_offsets,
+        block_count + 1,
+        impl.threads_);
+  } else {
+    impl.ReadColumn(
+        metadata,
+        header,
+        Section::kCompressedOffsets,
+        compressed_offsets,
+        block_count + 1);
+  }
+  impl.ReadColumn(
+      metadata,
+      header,
+      Section::kBlockEncodings,
+      block_encodings,
+      block_count);
+  impl.ReadColumn(
+      metadata,
+      header,
+      Section::kDictionary,
+      dictionary,
+      header.dictionary_size);
+
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  std::streamsize compressed_file_size = std::filesystem::file_size(
+      prepare_command_.options_.previous_compressed_path);
+  if (compressed_file_size != compressed_offsets.back()) {
+    LOG(WARNING) << "the previous compressed data does not match its "
+                    "metadata, preparing from scratch";
+    return;
+  }
+
+  // the previous dictionary is kept, as the reused blocks depend on it
+  if (!dictionary.empty()) {
+    dictionary_ = std::move(dictionary);
+    LoadDictionary();
+  }
+
+  // duplicates are left out, as their canonical block has the same content,
+  // and so are blocks of zeros, which have no content to reuse
+  for (std::streamsize i = 0; i < block_count; i++) {
+    if (block_encodings[i] != BlockEncoding::kDuplicate &&
+        block_encodings[i] != BlockEncoding::kZero)
+    {
+      previous_blocks_.emplace(
+          weak_checksums[i],
+          PreviousBlock{
+              .strong_checksum = strong_checksums[i],
+              .size = ky::Min(block_size_, header.data_size - i * block_size_),
+              .compressed_offset = compressed_offsets[i],
+              .compressed_size = compressed_offsets[i + 1] -
+                                 compressed_offsets[i],
+              .encoding = block_encodings[i]});
+    }
+  }
+}
+
+const PrepareCommandImpl::Variant::PreviousBlock *
+PrepareCommandImpl::Variant::FindPreviousBlock(
+    std::streamsize block_index,
+    std::streamsize size) const {
+  // the blocks are looked up at their own offset only, as the compressed
+  // bytes of the previous version exist only for its own block boundaries
+  auto weak_checksum = weak_checksums_[block_index];
+  auto [begin, end] = previous_blocks_.equal_range(weak_checksum);
+  for (auto it = begin; it != end; ++it) {
+    const auto &previous_block = it->second;
+    if (previous_block.size == size &&
+        previous_block.strong_checksum == strong_checksums_[block_index])
+    {
+      return &previous_block;
+    }
+  }
+  return nullptr;
+}
+
+void PrepareCommandImpl::Variant::TrainDictionary(
+    std::streamsize data_size,
+    const char *data) {
+  const auto &options = prepare_command_.options_;
+
+  auto block_count = (data_size + block_size_ - 1) / block_size_;
+  auto sample_count = ky::Min(
+      block_count,
+      std::max<std::streamsize>(
+          kDictionarySamplesFactor * options.dictionary_size / block_size_,
+          1));
+
+  // the samples are whole blocks spread evenly across the input, since the
+  // dictionary is used to compress each block on its own
+  auto stride = block_count / sample_count;
+
+  prepare_command_.StartNextPhase(sample_count * block_size_);
+  LOG(INFO) << "training dictionary from " << sample_count << " blocks...";
+
+  // the samples are copied from `data` when it holds the input, and read from
+  // the input otherwise
+  auto samples = std::vector<char>(sample_count * block_size_);
+  auto sample_sizes = std::vector<size_t>(sample_count);
+  std::streamsize samples_size = 0;
+
+  for (std::streamsize i = 0; i < sample_count; i++) {
+    auto offset = i * stride * block_size_;
+    auto size = ky::Min(block_size_, data_size - offset);
+
+    if (data != nullptr) {
+      memcpy(samples.data() + samples_size, data + offset, size);
+    } else {
+      auto count = prepare_command_.readers_[0]->Read(
+          samples.data() + samples_size,
+          offset,
+          size);
+      CHECK_EQ(count, size) << "error reading from "
+                            << prepare_command_.input_uri_;
+    }
+
+    sample_sizes[i] = size;
+    samples_size += size;
+    prepare_command_.AdvanceProgress(size);
+  }
+
+  dictionary_ = codecs_[0]->TrainDictionary(
+      samples,
+      sample_sizes,
+      options.dictionary_size);
+
+  if (dictionary_.empty()) {
+    LOG(WARNING) << "preparing without a dictionary";
+    return;
+  }
+
+  LoadDictionary();
+}
+
+void PrepareCommandImpl::Variant::LoadDictionary() {
+  // digested once, for the codecs of all the workers
+  auto dictionary = codecs_[0]->DigestDictionary(dictionary_);
+  for (auto &codec : codecs_) {
+    codec->LoadDictionary(dictionary);
+  }
+}
+
+std::streamsize PrepareCommandImpl::Variant::FindCanonicalBlock(
+    std::streamsize block_index) {
+  auto weak_checksum = weak_checksums_[block_index];
+  auto [begin, end] = unique_blocks_.equal_range(weak_checksum);
+  for (auto it = begin; it != end; ++it) {
+    if (strong_checksums_[it->second] == strong_checksums_[block_index]) {
+      return it->second;
+    }
+  }
 
+  unique_blocks_.emplace(weak_checksum, block_index);
+  return block_index;
+}
+
+void PrepareCommandImpl::Variant::Allocate(std::streamsize data_size) {
+  // the arrays grow round by round, as the size of a stream is only known
+  // once it ends
   auto block_count = (data_size + block_size_ - 1) / block_size_;
 
   weak_checksums_.resize(block_count);
   strong_checksums_.resize(block_count);
   compressed_sizes_.resize(block_count);
+  block_encodings_.resize(block_count, BlockEncoding::kCompressed);
+}
+
+void PrepareCommandImpl::Variant::WriteMetadata(std::streamsize data_size) {
+  output_compressed_file_stream_provider_.Resize(compressed_offset_);
+
+  // the strong checksums computed by the chunk workers are the leaves of the
+  // hash tree, so there is no need to read the input again
+  auto hash = StrongChecksum::ComputeTree(
+      strong_checksums_.data(),
+      std::ssize(strong_checksums_),
+      data_size);
+
+  // sync reads the compressed blocks at their offsets and copies the
+  // duplicates in place, so both are stored rather than computed on load
+  auto block_count = std::ssize(compressed_sizes_);
+  auto compressed_offsets = std::vector<int64_t>(block_count + 1);
+  auto duplicate_blocks = std::vector<int64_t>();
+  for (std::streamsize i = 0; i < block_count; i++) {
+    compressed_offsets[i + 1] = compressed_offsets[i] + compressed_sizes_[i];
+    if (block_encodings_[i] == BlockEncoding::kDuplicate) {
+      duplicate_blocks.push_back(i);
+    }
+  }
+
+  using Section = MetadataSection;
+  auto columns = std::array<std::span<const char>, kMetadataSectionCount>();
+  auto set_column = [&columns](Section section, const auto &column) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    columns[static_cast<int>(section)] = {
+        reinterpret_cast<const char *>(column.data()),
+        column.size() * sizeof(column[0])};
+  };
+  set_column(Section::kWeakChecksums, weak_checksums_);
+  set_column(Section::kStrongChecksums, strong_checksums_);
+
+  // only the first bytes of each strong checksum are kept when truncated
+  std::streamsize strong_checksum_size =
+      prepare_command_.options_.strong_checksum_size;
+  auto truncated_strong_checksums = std::vector<char>();
+  if (strong_checksum_size <
+      static_cast<std::streamsize>(sizeof(StrongChecksum)))
+  {
+    truncated_strong_checksums.resize(block_count * strong_checksum_size);
+    for (std::streamsize i = 0; i < block_count; i++) {
+      memcpy(
+          truncated_strong_checksums.data() + i * strong_checksum_size,
+          &strong_checksums_[i],
+          strong_checksum_size);
+    }
+    set_column(Section::kStrongChecksums, truncated_strong_checksums);
+  }
+  set_column(Section::kCompressedOffsets, compressed_offsets);
+  set_column(Section::kBlockEncodings, block_encodings_);
+  set_column(Section::kDuplicateBlocks, duplicate_blocks);
+  set_column(Section::kCanonicalBlocks, canonical_blocks_);
+  set_column(Section::kDictionary, dictionary_);
+
+  // sync probes the weak checksums in this index in place, rather than
+  // building a lookup table of its own
+  auto weak_checksum_index = WeakChecksumIndex::Build(
+      weak_checksums_,
+      block_encodings_,
+      0,
+      prepare_command_.threads_);
+  set_column(Section::kWeakChecksumIndex, weak_checksum_index);
+
+  // the columns sync looks the blocks up in are optionally compressed, to
+  // make the metadata cheaper to download
+  auto compress = prepare_command_.options_.compress_metadata;
+  auto compressed_columns = std::vector<std::vector<char>>();
+  if (compress) {
+    auto threads = prepare_command_.threads_;
+    compressed_columns = {
+        CompressedColumns::Compress(weak_checksums_, threads),
+        CompressedColumns::Compress(
+            columns[static_cast<int>(Section::kStrongChecksums)].data(),
+            block_count,
+            strong_checksum_size,
+            threads),
+        CompressedColumns::CompressOffsets(compressed_offsets, threads),
+        CompressedColumns::Compress(block_encodings_, threads)};
+    set_column(Section::kWeakChecksums, compressed_columns[0]);
+    set_column(Section::kStrongChecksums, compressed_columns[1]);
+    set_column(Section::kCompressedOffsets, compressed_columns[2]);
+    set_column(Section::kBlockEncodings, compressed_columns[3]);
+  }
+
+  // produce the ksync metadata output
+
+  auto output_ksync = std::ofstream(output_ksync_file_path_, std::ios::binary);
+  CHECK(output_ksync) << "unable to write to " << output_ksync_file_path_;
+
+  auto header = MetadataHeader{
+      .version = HeaderAdapter::kVersion,
+      .data_size = data_size,
+      .block_size = block_size_,
+      .hash = hash.ToString(),
+      .dictionary_size = static_cast<std::streamsize>(dictionary_.size()),
+      .blocks_per_frame = prepare_command_.options_.blocks_per_frame,
+      .codec = prepare_command_.options_.codec,
+      .compressed_columns = compress,
+      .strong_checksum_size = strong_checksum_size};
+  for (int i = 0; i < kMetadataSectionCount; i++) {
+    header.sections[i].size = std::ssize(columns[i]);
+  }
+  auto metadata_size = HeaderAdapter::LayoutSections(header);
+
+  HeaderAdapter::WriteHeader(output_ksync, header);
+  for (int i = 0; i < kMetadataSectionCount; i++) {
+    // the padding up to the aligned offset of each column is zeros
+    auto padding = header.sections[i].offset -
+                   static_cast<std::streamoff>(output_ksync.tellp());
+    CHECK_GE(padding, 0);
+    StreamWrite(output_ksync, std::vector<char>(padding));
+    StreamWrite(output_ksync, columns[i].data(), std::ssize(columns[i]));
+  }
+  CHECK(output_ksync) << "error writing to " << output_ksync_file_path_;
+  prepare_command_.AdvanceProgress(metadata_size);
+}
+
+bool PrepareCommandImpl::Variant::IsOutputIntact(
+    std::streamoff begin,
+    std::streamoff end,
+    const StrongChecksum &checksum) const {
+  // a missing or shorter output fails to be read
+  auto output = output_compressed_file_stream_provider_.CreateFileStream();
+  output.seekg(begin);
+  auto builder = StrongChecksumBuilder();
+  auto buffer = std::vector<char>(ky::Min(end - begin, kStreamReadSize));
+  for (auto offset = begin; offset < end; offset += std::ssize(buffer)) {
+    auto size = ky::Min(end - offset, std::ssize(buffer));
+    output.read(buffer.data(), size);
+    if (!output) {
+      return false;
+    }
+    builder.Update(buffer.data(), size);
+  }
+  return builder.Digest() == checksum;
+}
+
+template <typename T>
+void PrepareCommandImpl::WriteCheckpointColumn(
+    std::ostream &output,
+    const std::vector<T> &column,
+    std::streamoff begin,
+    std::streamoff end) {
+  StreamWrite(
+      output,
+      column.data() + begin,
+      (end - begin) * static_cast<std::streamsize>(sizeof(T)));
+}
 
-  auto compressed_buffer = std::vector<char>(max_compressed_block_size_);
+void PrepareCommandImpl::ComputeInputFingerprint() {
+  input_fingerprint_ = {data_size_};
 
+  static constexpr std::string_view kFileScheme = "file://";
+  if (input_uri_.starts_with(kFileScheme)) {
+    auto path = fs::path(input_uri_.substr(kFileScheme.size()));
+    input_fingerprint_.push_back(
+        fs::last_write_time(path).time_since_epoch().count());
+  }
+
+  auto buffer =
+      std::vector<char>(ky::Min(kCheckpointFingerprintSize, data_size_));
+  auto count = readers_[0]->Read(buffer.data(), 0, std::ssize(buffer));
+  CHECK_EQ(count, std::ssize(buffer)) << "error reading from " << input_uri_;
+  auto checksum = StrongChecksum::Compute(buffer.data(), count);
+  auto words = std::array<int64_t, 2>();
+  memcpy(words.data(), &checksum, sizeof(checksum));
+  input_fingerprint_.insert(
+      input_fingerprint_.end(),
+      words.begin(),
+      words.end());
+}
+
+std::vector<int64_t> PrepareCommandImpl::GetCheckpointHeader() const {
+  // a checkpoint is only resumed by a prepare of the same input with the same
+  // arguments, i.e. everything that affects the outputs
+  auto header = std::vector<int64_t>{
+      kCheckpointVersion,
+      round_size_,
+      options_.blocks_per_frame,
+      static_cast<int64_t>(options_.codec),
+      options_.deduplicate ? 1 : 0,
+      options_.zero_blocks ? 1 : 0,
+      options_.dictionary_size,
+      options_.compress_metadata ? 1 : 0,
+      options_.strong_checksum_size,
+      std::ssize(variants_)};
+  for (const auto &variant : variants_) {
+    header.push_back(variant->block_size_);
+  }
+
+  auto words = std::array<int64_t, 2>();
+  memcpy(
+      words.data(),
+      &previous_metadata_checksum_,
+      sizeof(previous_metadata_checksum_));
+  header.insert(header.end(), words.begin(), words.end());
+
+  header.push_back(std::ssize(input_fingerprint_));
+  header.insert(
+      header.end(),
+      input_fingerprint_.begin(),
+      input_fingerprint_.end());
+  return header;
+}
+
+std::streamoff PrepareCommandImpl::LoadCheckpoint() {
+  if (!fs::exists(checkpoint_path_)) {
+    return 0;
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+  std::streamsize checkpoint_size = fs::file_size(checkpoint_path_);
+
+  StartNextPhase(checkpoint_size);
+  LOG(INFO) << "loading checkpoint...";
+
+  auto input = std::ifstream(checkpoint_path_, std::ios::binary);
+  auto checkpoint = std::vector<uint8_t>(checkpoint_size);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  input.read(reinterpret_cast<char *>(checkpoint.data()), checkpoint_size);
+  CHECK(input) << "error reading from " << checkpoint_path_;
+  AdvanceProgress(checkpoint_size);
+
+  // the last round may have been interrupted while it was appended, so
+  // running out of data is not an error
+  std::streamoff offset = 0;
+  auto read = [&checkpoint, &offset](auto &column, std::streamsize count) {
+    auto size = count * static_cast<std::streamsize>(sizeof(column[0]));
+    if (count < 0 || offset + size > std::ssize(checkpoint)) {
+      return false;
+    }
+    column.resize(count);
+    memcpy(column.data(), checkpoint.data() + offset, size);
+    offset += size;
+    return true;
+  };
+
+  auto expected_header = GetCheckpointHeader();
+  auto header = std::vector<int64_t>();
+  auto dictionary_size = std::vector<int64_t>();
+  auto dictionaries = std::vector<std::vector<char>>(variants_.size());
+  auto is_compatible =
+      read(header, std::ssize(expected_header)) && header == expected_header;
+  for (std::size_t v = 0; is_compatible && v < variants_.size(); v++) {
+    // a dictionary adopted from the previous version cannot be replaced
+    const auto &dictionary = variants_[v]->dictionary_;
+    is_compatible = read(dictionary_size, 1) &&
+                    read(dictionaries[v], dictionary_size[0]) &&
+                    (dictionary.empty() || dictionary == dictionaries[v]);
+  }
+  if (!is_compatible) {
+    LOG(WARNING) << "the checkpoint was written by a different prepare, "
+                    "preparing from scratch";
+    return 0;
+  }
+
+  struct RoundResults {
+    std::vector<int64_t> compressed_offset;
+    std::vector<StrongChecksum> round_checksum;
+    std::vector<uint32_t> weak_checksums;
+    std::vector<StrongChecksum> strong_checksums;
+    std::vector<std::streamsize> compressed_sizes;
+    std::vector<BlockEncoding> block_encodings;
+    std::vector<int64_t> canonical_blocks;
+  };
+
+  std::streamoff round_offset = 0;
+  auto round = std::vector<int64_t>();
+  auto checkpoint_end = offset;
+  while (read(round, 2) && round[0] == round_offset && round[1] > 0) {
+    auto round_size = round[1];
+
+    // a round is only applied once all of it is read
+    auto results = std::vector<RoundResults>(variants_.size());
+    auto is_complete = true;
+    for (std::size_t v = 0; is_complete && v < variants_.size(); v++) {
+      auto block_size = variants_[v]->block_size_;
+      auto block_count = (round_size + block_size - 1) / block_size;
+      auto &r = results[v];
+      is_complete = read(r.compressed_offset, 1) &&
+                    read(r.round_checksum, 1) &&
+                    read(r.weak_checksums, block_count) &&
+                    read(r.strong_checksums, block_count) &&
+                    read(r.compressed_sizes, block_count) &&
+                    read(r.block_encodings, block_count) &&
+                    read(
+                        r.canonical_blocks,
+                        std::count(
+                            r.block_encodings.begin(),
+                            r.block_encodings.end(),
+                            BlockEncoding::kDuplicate));
+    }
+    if (!is_complete) {
+      break;
+    }
+
+    // the compressed output of a round may have been deleted or changed since
+    // it was written, and is then prepared again
+    auto is_intact = true;
+    for (std::size_t v = 0; is_intact && v < variants_.size(); v++) {
+      is_intact = variants_[v]->IsOutputIntact(
+          variants_[v]->compressed_offset_,
+          results[v].compressed_offset[0],
+          results[v].round_checksum[0]);
+    }
+    if (!is_intact) {
+      LOG(WARNING) << "the compressed output changed after " << round_offset
+                   << " bytes were checkpointed, preparing from there";
+      break;
+    }
+
+    for (std::size_t v = 0; v < variants_.size(); v++) {
+      auto &variant = *variants_[v];
+      auto &r = results[v];
+      auto block_index = round_offset / variant.block_size_;
+
+      variant.Allocate(round_offset + round_size);
+      std::copy(
+          r.weak_checksums.begin(),
+          r.weak_checksums.end(),
+          variant.weak_checksums_.begin() + block_index);
+      std::copy(
+          r.strong_checksums.begin(),
+          r.strong_checksums.end(),
+          variant.strong_checksums_.begin() + block_index);
+      std::copy(
+          r.compressed_sizes.begin(),
+          r.compressed_sizes.end(),
+          variant.compressed_sizes_.begin() + block_index);
+      std::copy(
+          r.block_encodings.begin(),
+          r.block_encodings.end(),
+          variant.block_encodings_.begin() + block_index);
+      variant.canonical_blocks_.insert(
+          variant.canonical_blocks_.end(),
+          r.canonical_blocks.begin(),
+          r.canonical_blocks.end());
+      variant.compressed_offset_ = r.compressed_offset[0];
+
+      // the blocks kept so far are the canonical blocks of later duplicates
+      if (options_.deduplicate) {
+        for (std::size_t i = 0; i < r.block_encodings.size(); i++) {
+          if (r.block_encodings[i] != BlockEncoding::kDuplicate &&
+              r.block_encodings[i] != BlockEncoding::kZero)
+          {
+            variant.unique_blocks_.emplace(
+                r.weak_checksums[i],
+                block_index + static_cast<std::streamsize>(i));
+          }
+        }
+      }
+    }
+
+    round_offset += round_size;
+    checkpoint_end = offset;
+    resumed_bytes_ += round_size;
+  }
+
+  if (round_offset == 0) {
+    return 0;
+  }
+
+  for (std::size_t v = 0; v < variants_.size(); v++) {
+    auto &variant = *variants_[v];
+    if (variant.dictionary_.empty() && !dictionaries[v].empty()) {
+      variant.dictionary_ = std::move(dictionaries[v]);
+      variant.LoadDictionary();
+    }
+  }
+
+  // an interrupted round is dropped, so that the next one is appended to the
+  // last completed one
+  fs::resize_file(checkpoint_path_, checkpoint_end);
+
+  LOG(INFO) << "resuming after " << round_offset << " bytes";
+  return round_offset;
+}
+
+void PrepareCommandImpl::WriteCheckpointHeader() const {
+  auto output = std::ofstream(checkpoint_path_, std::ios::binary);
+  CHECK(output) << "unable to write to " << checkpoint_path_;
+
+  StreamWrite(output, GetCheckpointHeader());
+  for (const auto &variant : variants_) {
+    StreamWrite(output, std::vector<int64_t>{std::ssize(variant->dictionary_)});
+    StreamWrite(output, variant->dictionary_);
+  }
+  CHECK(output) << "error writing to " << checkpoint_path_;
+}
+
+void PrepareCommandImpl::WriteCheckpoint(
+    std::streamoff round_offset,
+    std::streamsize round_size) const {
+  auto output =
+      std::ofstream(checkpoint_path_, std::ios::binary | std::ios::app);
+  CHECK(output) << "unable to write to " << checkpoint_path_;
+
+  StreamWrite(output, std::vector<int64_t>{round_offset, round_size});
+  for (const auto &variant : variants_) {
+    auto block_size = variant->block_size_;
+    auto begin = round_offset / block_size;
+    auto end = (round_offset + round_size + block_size - 1) / block_size;
+
+    // the canonical blocks of the duplicates of the round are the last ones
+    const auto &canonical_blocks = variant->canonical_blocks_;
+    auto duplicate_count = std::count(
+        variant->block_encodings_.begin() + begin,
+        variant->block_encodings_.begin() + end,
+        BlockEncoding::kDuplicate);
+
+    StreamWrite(output, std::vector<int64_t>{variant->compressed_offset_});
+    StreamWrite(output, std::vector<StrongChecksum>{variant->round_checksum_});
+    WriteCheckpointColumn(output, variant->weak_checksums_, begin, end);
+    WriteCheckpointColumn(output, variant->strong_checksums_, begin, end);
+    WriteCheckpointColumn(output, variant->compressed_sizes_, begin, end);
+    WriteCheckpointColumn(output, variant->block_encodings_, begin, end);
+    WriteCheckpointColumn(
+        output,
+        canonical_blocks,
+        std::ssize(canonical_blocks) - duplicate_count,
+        std::ssize(canonical_blocks));
+  }
+  CHECK(output) << "error writing to " << checkpoint_path_;
+}
+
+std::streamsize PrepareCommandImpl::ReadRound(
+    std::vector<char> &buffer,
+    std::streamoff round_offset) {
+  // the buffers grow with the input, so small inputs need little memory
+  if (input_stream_ != nullptr) {
+    std::streamsize round_size = 0;
+    while (round_size < round_size_ && *input_stream_) {
+      auto size = ky::Min(kStreamReadSize, round_size_ - round_size);
+      if (std::ssize(buffer) < round_size + size) {
+        buffer.resize(round_size + size);
+      }
+      input_stream_->read(buffer.data() + round_size, size);
+      CHECK(!input_stream_->bad()) << "error reading from the input stream";
+      round_size += input_stream_->gcount();
+    }
+    return round_size;
+  }
+
+  if (round_offset >= data_size_) {
+    return 0;
+  }
+
+  auto round_size = ky::Min(round_size_, data_size_ - round_offset);
+  if (std::ssize(buffer) < round_size) {
+    buffer.resize(round_size);
+  }
+
+  // each worker reads a large part of the round with its own reader, so that
+  // many reads are in flight at once
   ky::parallelize::Parallelize(
-      data_size,
-      block_size_,
+      round_size,
+      chunk_alignment_,
       0,
       threads_,
-      [this](int, auto start_offset, auto finish_offset) {
-        auto p = ChunkPreparer(*this, start_offset, finish_offset);
+      [this, &buffer, round_offset](int id, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        auto count = readers_[id]->Read(
+            buffer.data() + beg,
+            round_offset + beg,
+            end - beg);
+        CHECK_EQ(count, end - beg) << "error reading from " << input_uri_;
       });
+  return round_size;
+}
 
-  StrongChecksumBuilder hash;
-
-  auto input = std::ifstream(input_file_path_, std::ios::binary);
-  auto buffer = std::vector<char>(block_size_);
+void PrepareCommandImpl::PrepareRound(
+    std::streamoff round_offset,
+    std::streamsize round_size,
+    const char *round_data) {
+  // the chunks of the input are read once and prepared for every variant in
+  // turn, each reusing the compressed buffers of the workers
+  for (auto &variant : variants_) {
+    variant->Allocate(round_offset + round_size);
+
+    auto preparers = std::vector<std::unique_ptr<ChunkPreparer>>(threads_);
+    ky::parallelize::Parallelize(
+        round_size,
+        chunk_alignment_,
+        0,
+        threads_,
+        [this, &variant, round_offset, round_data, &preparers](
+            int id,
+            auto start_offset,
+            auto finish_offset) {
+          // the trailing workers may get no part of a small round
+          if (finish_offset <= start_offset) {
+            return;
+          }
+
+          preparers[id] = std::make_unique<ChunkPreparer>(
+              *variant,
+              *variant->codecs_[id],
+              compressed_buffers_[id],
+              round_data + start_offset,
+              round_offset + start_offset,
+              round_offset + finish_offset);
+        });
+
+    // the chunks are visited in order, so that the first copy of a block is
+    // the one that is kept, regardless of the number of threads
+    if (options_.deduplicate) {
+      for (auto &preparer : preparers) {
+        if (preparer) {
+          preparer->Deduplicate();
+        }
+      }
+    }
+
+    // the chunks are consecutive, so an exclusive prefix sum of their
+    // compressed sizes yields the final position of each chunk in the
+    // compressed output
+    auto chunk_offsets = std::vector<std::streamoff>(threads_);
+    for (int id = 0; id < threads_; id++) {
+      chunk_offsets[id] = variant->compressed_offset_;
+      if (preparers[id]) {
+        variant->compressed_offset_ += preparers[id]->GetCompressedSize();
+      }
+    }
+
+    ky::parallelize::Parallelize(
+        round_size,
+        chunk_alignment_,
+        0,
+        threads_,
+        [&preparers, &chunk_offsets](int id, auto, auto) {
+          if (preparers[id]) {
+            preparers[id]->Write(chunk_offsets[id]);
+          }
+        });
+
+    // the chunks follow one another in the output as they do here
+    if (options_.checkpoint) {
+      auto builder = StrongChecksumBuilder();
+      for (const auto &preparer : preparers) {
+        if (preparer) {
+          auto data = preparer->GetCompressedData();
+          builder.Update(data.data(), std::ssize(data));
+        }
+      }
+      variant->round_checksum_ = builder.Digest();
+    }
+  }
+}
 
-  // TODO(kyotov): this is going to improve with issue
-  //  https://github.com/kyotov/ksync/issues/100
-  StartNextPhase(data_size + 2 * compressed_bytes_);
+std::streamsize PrepareCommandImpl::PrepareInput() {
+  if (input_stream_ == nullptr) {
+    for (int id = 0; id < threads_; id++) {
+      readers_.push_back(Reader::Create(input_uri_));
+    }
+    data_size_ = readers_[0]->GetSize();
+  }
 
-  auto compressed_input =
-      output_compressed_file_stream_provider_.CreateFileStream();
-  auto compressed_output =
-      output_compressed_file_stream_provider_.CreateFileStream();
+  std::streamoff round_offset = 0;
+  if (options_.checkpoint) {
+    ComputeInputFingerprint();
+    round_offset = LoadCheckpoint();
+  }
 
-  for (int i = 0; i < compressed_sizes_.size(); i++) {
-    compressed_input.seekg(i * max_compressed_block_size_);
-    compressed_input.read(compressed_buffer.data(), compressed_sizes_[i]);
-    CHECK(compressed_input);
-    CHECK(compressed_input.gcount() == compressed_sizes_[i]);
-    compressed_output.write(compressed_buffer.data(), compressed_sizes_[i]);
-    CHECK(compressed_output);
+  auto round_size = ReadRound(round_buffers_[0], round_offset);
+
+  // a stream cannot be read twice, so its dictionary is trained from the
+  // first round (a resumed prepare keeps the dictionary of its checkpoint)
+  if (options_.dictionary_size > 0 && round_offset == 0 && round_size > 0) {
+    for (auto &variant : variants_) {
+      if (variant->dictionary_.empty()) {
+        if (input_stream_ != nullptr) {
+          variant->TrainDictionary(round_size, round_buffers_[0].data());
+        } else {
+          variant->TrainDictionary(data_size_, nullptr);
+        }
+      }
+    }
+  }
 
-    input.read(buffer.data(), block_size_);
-    hash.Update(buffer.data(), input.gcount());
+  if (options_.checkpoint && round_offset == 0) {
+    WriteCheckpointHeader();
+  }
 
-    AdvanceProgress(input.gcount() + 2 * compressed_sizes_[i]);
+  // every variant advances the progress through the rest of the input, the
+  // size of a stream is unknown though
+  StartNextPhase(
+      std::max<std::streamsize>(data_size_ - round_offset, 0) *
+      std::ssize(variants_));
+
+  for (std::size_t current = 0; round_size > 0; current ^= 1) {
+    auto next_round_offset = round_offset + round_size;
+    auto next_round_size = std::async(
+        std::launch::async,
+        [this, &buffer = round_buffers_[current ^ 1], next_round_offset]() {
+          return ReadRound(buffer, next_round_offset);
+        });
+
+    PrepareRound(round_offset, round_size, round_buffers_[current].data());
+    if (options_.checkpoint) {
+      WriteCheckpoint(round_offset, round_size);
+    }
+
+    round_offset = next_round_offset;
+    round_size = next_round_size.get();
   }
 
-  output_compressed_file_stream_provider_.Resize(compressed_output.tellp());
+  return round_offset;
+}
 
-  // produce the ksync metadata output
+int PrepareCommandImpl::Run() {
+  if (!options_.previous_metadata_path.empty()) {
+    LoadPreviousVersion();
+  }
 
-  auto output_ksync = std::ofstream(output_ksync_file_path_, std::ios::binary);
-  CHECK(output_ksync) << "unable to write to " << output_ksync_file_path_;
+  auto data_size = PrepareInput();
 
   StartNextPhase(1);
 
-  auto header_size = HeaderAdapter::WriteHeader(
-      output_ksync,
-      2,
-      data_size,
-      block_size_,
-      hash.Digest().ToString());
-  AdvanceProgress(header_size);
+  for (auto &variant : variants_) {
+    variant->WriteMetadata(data_size);
+  }
 
-  AdvanceProgress(StreamWrite(output_ksync, weak_checksums_));
-  AdvanceProgress(StreamWrite(output_ksync, strong_checksums_));
-  AdvanceProgress(StreamWrite(output_ksync, compressed_sizes_));
+  if (options_.checkpoint) {
+    fs::remove(checkpoint_path_);
+  }
 
   StartNextPhase(0);
   return 0;
@@ -272,6 +1594,11 @@ int PrepareCommandImpl::Run() {
 
 void PrepareCommandImpl::Accept(ky::metrics::MetricVisitor &visitor) {
   VISIT_METRICS(compressed_bytes_);
+  VISIT_METRICS(raw_bytes_);
+  VISIT_METRICS(deduplicated_bytes_);
+  VISIT_METRICS(reused_bytes_);
+  VISIT_METRICS(resumed_bytes_);
+  VISIT_METRICS(zero_bytes_);
 }
 
-}  // namespace kysync
\ No newline at end of file
+}  // namespace kysync
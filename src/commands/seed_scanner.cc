@@ -0,0 +1,180 @@
+#include "seed_scanner.h"
+
+#include <ky/min.h>
+#include <kysync/checksums/weak_checksum.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+namespace kysync {
+
+SeedScanner::SeedScanner(
+    Reader &seed_reader,
+    std::streamsize block_size,
+    std::streamsize strong_checksum_size,
+    const WeakChecksumIndex &weak_checksum_index,
+    Target &target)
+    : seed_reader_(seed_reader),
+      seed_size_(seed_reader.GetSize()),
+      block_size_(block_size),
+      neighbour_required_(
+          strong_checksum_size < kMinSingleMatchStrongChecksumSize),
+      weak_checksum_index_(weak_checksum_index),
+      target_(target),
+      read_size_(
+          std::max<std::streamsize>(kSeedReadSize / block_size, 1) *
+          block_size),
+      buffer_(block_size + read_size_),
+      window_checksums_(block_size) {}
+
+SeedScanner::Counts SeedScanner::Scan(
+    std::streamoff start_offset,
+    std::streamoff end_offset,
+    const std::function<void(std::streamsize)> &advance_progress) {
+  // The block before the range is kept in front of it, for the windows that
+  // start there (zeros before the first range, which the running checksum
+  // starts from).
+  auto *read_buffer = buffer_.data() + block_size_;
+  memset(buffer_.data(), 0, block_size_);
+
+  auto counts = Counts();
+  uint32_t running_wcs = 0;
+
+  // the windows before this offset are skipped, as they start before the
+  // part or overlap the last accepted match
+  auto next_offset = start_offset;
+
+  // when the strong checksums are short a block that matched is only accepted
+  // along with the next block, the matches within a block of the scanned
+  // window wait for it (oldest first)
+  auto pending_matches = std::deque<PendingMatch>();
+
+  // the scan goes on a little past the end of the part then, so that the last
+  // match of the part can be followed by the next block
+  auto scan_end_offset =
+      end_offset + (neighbour_required_ ? 2 * block_size_ : 0);
+
+  for (std::streamoff range_offset = start_offset;
+       range_offset < scan_end_offset;
+       range_offset += read_size_)
+  {
+    auto range_blocks =
+        (scan_end_offset - range_offset + block_size_ - 1) / block_size_;
+    auto range_size = ky::Min(read_size_, range_blocks * block_size_);
+    auto count = seed_reader_.Read(read_buffer, range_offset, range_size);
+    memset(read_buffer + count, 0, range_size - count);
+
+    for (std::streamoff block_offset = 0; block_offset < range_size;
+         block_offset += block_size_)
+    {
+      auto seed_offset = range_offset + block_offset;
+      auto *buffer = read_buffer + block_offset;
+
+      running_wcs = WeakChecksum(
+          buffer,
+          block_size_,
+          running_wcs,
+          window_checksums_.data());
+
+      /* The filter of the index rejects most weak checksums. Its probes are
+       * random accesses that do not depend on each other, so they are issued
+       * ahead of time for all the windows of the block, and only the windows
+       * that pass it are looked up and verified.
+       * Previously each window was looked up as soon as it was rolled:
+       * https://github.com/kyotov/ksync/blob/2d98f83cd1516066416e8319fbfa995e3f49f3dd/commands/SyncCommand.cpp#L128-L132
+       */
+      candidates_.clear();
+      for (std::streamsize i = 0; i < block_size_; i++) {
+        if (i + kFilterPrefetchDistance < block_size_) {
+          weak_checksum_index_.Prefetch(
+              window_checksums_[i + kFilterPrefetchDistance]);
+        }
+        if (weak_checksum_index_.MayContain(window_checksums_[i])) {
+          candidates_.push_back(i);
+        }
+      }
+
+      for (auto i : candidates_) {
+        auto offset = i + 1 - block_size_;
+        auto window_offset = seed_offset + offset;
+        if (window_offset < next_offset || window_offset >= seed_size_) {
+          continue;
+        }
+
+        auto index = weak_checksum_index_.Find(window_checksums_[i]);
+        if (index < 0 || target_.GetSeedOffset(index) >= 0) {
+          continue;
+        }
+        counts.weak_checksum_matches++;
+
+        auto seed_digest =
+            StrongChecksum::Compute(buffer + offset, block_size_);
+
+        // there was a verification here in previous versions...
+        // restore if needed for debugging by running blame on this line.
+        if (!target_.MatchesStrongChecksum(index, seed_digest)) {
+          counts.weak_checksum_false_positives++;
+          continue;
+        }
+        counts.strong_checksum_matches++;
+
+        while (!pending_matches.empty() &&
+               pending_matches.front().offset < window_offset - block_size_)
+        {
+          pending_matches.pop_front();
+        }
+
+        // the previous block may also have been accepted by another part
+        auto follows_previous = target_.FollowsPrevious(index);
+        auto previous_match = std::find(
+            pending_matches.begin(),
+            pending_matches.end(),
+            PendingMatch{index - 1, window_offset - block_size_});
+        auto follows_pending_match =
+            follows_previous && previous_match != pending_matches.end();
+        auto follows_accepted_match =
+            follows_previous &&
+            target_.GetSeedOffset(index - 1) == window_offset - block_size_;
+
+        // a rejected match may overlap a block that is accepted later, so the
+        // scan only skips past the accepted ones
+        if (!neighbour_required_ || follows_pending_match ||
+            follows_accepted_match)
+        {
+          if (follows_pending_match) {
+            target_.Accept(previous_match->index, previous_match->offset);
+          }
+          target_.Accept(index, window_offset);
+          next_offset = window_offset + block_size_;
+          pending_matches.clear();
+        } else {
+          pending_matches.push_back({index, window_offset});
+        }
+      }
+    }
+
+    auto progress_end = ky::Min(range_offset + range_size, end_offset);
+    if (progress_end > range_offset) {
+      advance_progress(progress_end - range_offset);
+    }
+
+    memcpy(
+        read_buffer - block_size_,
+        read_buffer + range_size - block_size_,
+        block_size_);
+  }
+
+  // the block after the last matches may have been accepted by another part
+  for (const auto &match : pending_matches) {
+    if (target_.FollowsPrevious(match.index + 1) &&
+        target_.GetSeedOffset(match.index + 1) == match.offset + block_size_)
+    {
+      target_.Accept(match.index, match.offset);
+    }
+  }
+
+  return counts;
+}
+
+}  // namespace kysync
@@ -0,0 +1,125 @@
+#ifndef KSYNC_SRC_COMMANDS_SEED_SCANNER_H
+#define KSYNC_SRC_COMMANDS_SEED_SCANNER_H
+
+#include <kysync/checksums/strong_checksum.h>
+#include <kysync/readers/reader.h>
+
+#include <cstdint>
+#include <functional>
+#include <ios>
+#include <vector>
+
+#include "weak_checksum_index.h"
+
+namespace kysync {
+
+/**
+ * Finds the blocks of the target in the seed, the way sync looks up the blocks
+ * it reuses. Advise scans the seed for samples of the target the same way, so
+ * that what it estimates follows what sync does.
+ *
+ * The seed is read a range of blocks at a time. The weak checksums of all the
+ * windows that end in a block are rolled at once and probed in the filter of
+ * the index ahead of time, and only the windows that pass it are looked up and
+ * have their strong checksum verified. The scan skips past each accepted
+ * match. When the strong checksums are short, a block is only accepted along
+ * with the block before or after it in the target.
+ */
+class SeedScanner {
+public:
+  /**
+   * The blocks of the target that are looked up, numbered as in the index.
+   * Several scanners may use it at the same time.
+   */
+  class Target {
+  public:
+    virtual ~Target() = default;
+
+    /**
+     * Where the block was accepted in the seed, or -1 if it was not yet.
+     */
+    [[nodiscard]] virtual std::streamoff GetSeedOffset(
+        std::streamsize block) const = 0;
+
+    /**
+     * True if `block` is looked up and follows `block - 1` in the target, so
+     * that the two can vouch for each other.
+     */
+    [[nodiscard]] virtual bool FollowsPrevious(std::streamsize block) const = 0;
+
+    /**
+     * True if the (truncated) strong checksum of the block is that of the
+     * window of the seed.
+     */
+    [[nodiscard]] virtual bool MatchesStrongChecksum(
+        std::streamsize block,
+        const StrongChecksum &strong_checksum) const = 0;
+
+    virtual void Accept(std::streamsize block, std::streamoff seed_offset) = 0;
+  };
+
+  /**
+   * What a scan counts, for the metrics of the command.
+   */
+  struct Counts {
+    std::streamsize weak_checksum_matches{};
+    std::streamsize weak_checksum_false_positives{};
+    std::streamsize strong_checksum_matches{};
+  };
+
+  // strong checksums shorter than this match by chance often enough that a
+  // block is only reused from the seed together with a neighbouring block
+  static constexpr std::streamsize kMinSingleMatchStrongChecksumSize = 8;
+
+  SeedScanner(
+      Reader &seed_reader,
+      std::streamsize block_size,
+      std::streamsize strong_checksum_size,
+      const WeakChecksumIndex &weak_checksum_index,
+      Target &target);
+
+  /**
+   * Scans the windows that start from `start_offset` to `end_offset` (and a
+   * little past it for the neighbours of the last ones). `advance_progress` is
+   * called with the bytes of the part that are scanned, a range at a time.
+   */
+  Counts Scan(
+      std::streamoff start_offset,
+      std::streamoff end_offset,
+      const std::function<void(std::streamsize)> &advance_progress);
+
+private:
+  // the seed is scanned in reads of about this size
+  static constexpr std::streamsize kSeedReadSize = 256 * 1024;
+
+  // the filter of the index is probed this many windows after it is prefetched
+  static constexpr std::streamsize kFilterPrefetchDistance = 16;
+
+  // a block of the seed that matched and waits for the next one to match too
+  struct PendingMatch {
+    std::streamsize index;
+    std::streamoff offset;
+
+    bool operator==(const PendingMatch &) const = default;
+  };
+
+  Reader &seed_reader_;
+  std::streamsize seed_size_;
+  std::streamsize block_size_;
+  bool neighbour_required_;
+  const WeakChecksumIndex &weak_checksum_index_;
+  Target &target_;
+
+  // the block before the range that is read is kept in front of it
+  std::streamsize read_size_;
+  std::vector<char> buffer_;
+
+  // the weak checksums of the windows that end in the block that is scanned,
+  // and those of them that pass the filter of the index
+  std::vector<uint32_t> window_checksums_;
+  std::vector<std::streamsize> candidates_;
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_COMMANDS_SEED_SCANNER_H
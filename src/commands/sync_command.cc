@@ -3,22 +3,27 @@
 #include <ky/metrics/metrics.h>
 #include <ky/min.h>
 #include <ky/parallelize.h>
+#include <kysync/checksums/strong_checksum.h>
 #include <kysync/checksums/strong_checksum_builder.h>
 #include <kysync/checksums/weak_checksum.h>
+#include <kysync/codecs/codec.h>
 #include <kysync/commands/sync_command.h>
 #include <kysync/readers/reader.h>
 #include <kysync/streams.h>
-#include <zstd.h>
 
-#include <bitset>
+#include <algorithm>
+#include <array>
 #include <fstream>
 #include <future>
 #include <ios>
 #include <map>
-#include <unordered_map>
+#include <span>
 #include <utility>
 
+#include "compressed_columns.h"
 #include "pb/header_adapter.h"
+#include "seed_scanner.h"
+#include "weak_checksum_index.h"
 
 namespace kysync {
 
@@ -30,6 +35,10 @@ class SyncCommandImpl final : public SyncCommand {
   bool compression_disabled_;
   int blocks_per_batch_;
   int threads_;
+  // The target is synced in windows of this many blocks, one after the other,
+  // so that the memory sync takes is bounded by the size of a window rather
+  // than of the target. There is one window for the whole target if 0.
+  std::streamsize window_blocks_;
 
   ky::FileStreamProvider output_path_file_stream_provider_;
 
@@ -39,34 +48,211 @@ class SyncCommandImpl final : public SyncCommand {
   ky::metrics::Metric reused_bytes_{};
   ky::metrics::Metric downloaded_bytes_{};
   ky::metrics::Metric decompressed_bytes_{};
+  ky::metrics::Metric deduplicated_bytes_{};
+  ky::metrics::Metric zero_bytes_{};
+  ky::metrics::Metric loaded_windows_{};
 
   std::streamsize size_{};
-  std::streamsize header_size_{};
   std::streamsize block_size_{};
   std::streamsize block_count_{};
-  std::streamsize max_compressed_size_{};
+  std::streamsize blocks_per_frame_{};
+  CodecType codec_{};
 
   std::string hash_;
 
-  std::vector<uint32_t> weak_checksums_;
-  std::vector<StrongChecksum> strong_checksums_;
-  std::vector<std::streamsize> compressed_sizes_;
-  std::vector<std::streamoff> compressed_file_offsets_;
+  /**
+   * A column of the metadata, or the part of it for the blocks of the window
+   * that is synced, indexed by the blocks of the whole target.
+   */
+  template <typename T>
+  class BlockColumn {
+    std::span<T> data_;
+    std::streamsize first_block_{};
+
+  public:
+    BlockColumn() = default;
+
+    BlockColumn(std::span<T> data, std::streamsize first_block)
+        : data_(data),
+          first_block_(first_block) {}
+
+    T &operator[](std::streamsize block) const {
+      return data_[block - first_block_];
+    }
+
+    [[nodiscard]] std::span<T> GetData() const { return data_; }
+  };
+
+  // the blocks of the window that is synced
+  std::streamsize window_begin_{};
+  std::streamsize window_end_{};
+
+  // The columns of the metadata are used in place, where the metadata reader
+  // maps them or where the whole metadata is read to, and in the buffers
+  // below otherwise (i.e. when they are compressed, or read for a window).
+  std::unique_ptr<Reader> metadata_reader_;
+  std::vector<char> metadata_buffer_;
+  const char *metadata_{};
+  MetadataHeader metadata_header_;
+
+  // the compressed columns of the whole target, decompressed while the rest
+  // of the metadata was downloaded
+  bool columns_decompressed_{};
+
+  BlockColumn<const uint32_t> weak_checksums_;
+  // the first `strong_checksum_size_` bytes of the strong checksum of each
+  // block of the window, one after the other
+  std::span<const char> strong_checksums_;
+  std::streamsize strong_checksum_size_{};
+  // one more than the blocks of the window, the end of the last one
+  BlockColumn<const int64_t> compressed_offsets_;
+  BlockColumn<const BlockEncoding> block_encodings_;
+
+  // the duplicate blocks of the window and, at the same position, their
+  // canonical blocks, which are never after them
+  std::span<const int64_t> duplicate_blocks_;
+  std::span<const int64_t> canonical_blocks_;
+
+  std::vector<uint32_t> weak_checksums_buffer_;
+  std::vector<char> strong_checksums_buffer_;
+  std::vector<int64_t> compressed_offsets_buffer_;
+  std::vector<BlockEncoding> block_encodings_buffer_;
+  std::vector<int64_t> duplicate_blocks_buffer_;
+  std::vector<int64_t> canonical_blocks_buffer_;
+  std::vector<char> weak_checksum_index_buffer_;
+
+  // digested once, for the codecs of all the workers and windows
+  std::shared_ptr<const CodecDictionary> dictionary_;
+
+  WeakChecksumIndex weak_checksum_index_;
 
   static constexpr std::streamoff kInvalidOffset = -1;
-  struct WcsMapData {
-    std::streamsize index{};
-    std::streamoff seed_offset{kInvalidOffset};
+
+  // the columns of the metadata with an element per block, in section order
+  static constexpr std::array kBlockColumns = {
+      MetadataSection::kWeakChecksums,
+      MetadataSection::kStrongChecksums,
+      MetadataSection::kCompressedOffsets,
+      MetadataSection::kBlockEncodings};
+
+  // metadata that is not used in place is read in ranges of this size, several
+  // at a time (i.e. as parallel range requests over http)
+  static constexpr std::streamsize kMetadataRangeSize = 4 * 1024 * 1024;
+
+  // the target is verified this many blocks at a time, so that the strong
+  // checksums of its blocks are not all kept at once
+  static constexpr std::streamsize kVerifyRangeBlocks = 64 * 1024;
+
+  /**
+   * Where each block of the window is found in the seed, if it is. The offsets
+   * take 32 bits when the seed is small enough for them (below 4 GiB), which
+   * halves the memory sync takes for each block.
+   */
+  class SeedOffsets {
+    static constexpr uint32_t kNarrowInvalidOffset = UINT32_MAX;
+
+    std::vector<uint32_t> narrow_offsets_;
+    std::vector<std::streamoff> wide_offsets_;
+    std::streamsize first_block_{};
+
+  public:
+    void Reset(
+        std::streamsize begin,
+        std::streamsize end,
+        std::streamsize seed_size) {
+      first_block_ = begin;
+      narrow_offsets_.clear();
+      wide_offsets_.clear();
+      if (seed_size < kNarrowInvalidOffset) {
+        narrow_offsets_.assign(end - begin, kNarrowInvalidOffset);
+      } else {
+        wide_offsets_.assign(end - begin, kInvalidOffset);
+      }
+    }
+
+    std::streamoff operator[](std::streamsize block) const {
+      if (wide_offsets_.empty()) {
+        auto offset = narrow_offsets_[block - first_block_];
+        return offset == kNarrowInvalidOffset ? kInvalidOffset : offset;
+      }
+      return wide_offsets_[block - first_block_];
+    }
+
+    void Set(std::streamsize block, std::streamoff offset) {
+      if (wide_offsets_.empty()) {
+        narrow_offsets_[block - first_block_] = static_cast<uint32_t>(offset);
+      } else {
+        wide_offsets_[block - first_block_] = offset;
+      }
+    }
   };
 
-  static constexpr auto k4Gb = 0x100000000LL;
+  SeedOffsets seed_offsets_;
+
+  /**
+   * The blocks of the window that the seed is scanned for.
+   */
+  class SeedBlocks final : public SeedScanner::Target {
+    SyncCommandImpl &parent_;
+
+  public:
+    explicit SeedBlocks(SyncCommandImpl &parent) : parent_(parent) {}
+
+    [[nodiscard]] std::streamoff GetSeedOffset(
+        std::streamsize block) const override {
+      return parent_.seed_offsets_[block];
+    }
+
+    [[nodiscard]] bool FollowsPrevious(std::streamsize block) const override {
+      return block > parent_.window_begin_ && block < parent_.window_end_;
+    }
 
-  std::unique_ptr<std::bitset<k4Gb>> set_;
-  std::unordered_map<uint32_t, WcsMapData> analysis_;
-  std::vector<std::streamoff> seed_offsets_;
+    [[nodiscard]] bool MatchesStrongChecksum(
+        std::streamsize block,
+        const StrongChecksum &strong_checksum) const override {
+      return memcmp(
+                 parent_.strong_checksums_.data() +
+                     (block - parent_.window_begin_) *
+                         parent_.strong_checksum_size_,
+                 &strong_checksum,
+                 parent_.strong_checksum_size_) == 0;
+    }
+
+    void Accept(std::streamsize block, std::streamoff seed_offset) override {
+      parent_.seed_offsets_.Set(block, seed_offset);
+    }
+  };
 
   void ParseHeader(Reader &metadata_reader);
-  void UpdateCompressedOffsetsAndMaxSize();
+  std::span<const char> ReadSectionRange(
+      MetadataSection section,
+      std::streamoff offset,
+      std::streamsize size,
+      std::vector<char> &buffer);
+  CompressedColumns::ReadRange GetSectionReader(
+      MetadataSection section,
+      std::vector<char> &buffer);
+  template <typename T>
+  std::span<const T> LoadColumn(
+      MetadataSection section,
+      std::streamoff begin,
+      std::streamoff end,
+      std::streamsize count,
+      std::streamsize element_size,
+      std::vector<T> &buffer);
+  [[nodiscard]] std::streamsize FindDuplicate(std::streamsize block);
+  void ValidateDuplicates() const;
+  void LoadBlockColumn(
+      MetadataSection section,
+      std::streamsize begin,
+      std::streamsize end);
+  void LoadWindow(std::streamsize begin, std::streamsize end);
+  void ReadMetadataChunk(
+      std::streamoff start_offset,
+      std::streamoff end_offset);
+  void ReadMetadataRange(
+      std::streamoff start_offset,
+      std::streamoff end_offset);
   void ReadMetadata() override;
   void AnalyzeSeedChunk(
       int id,
@@ -79,23 +265,37 @@ class SyncCommandImpl final : public SyncCommand {
       std::streamoff start_offset,
       std::streamoff end_offset);
 
-  void ValidateBlockSize(int block_index, std::streamsize count) const;
+  [[nodiscard]] std::streamsize GetBlocksPerFrame() const;
+  [[nodiscard]] std::streamsize GetCompressedSize(
+      std::streamsize block_index) const;
+
+  void ValidateBlockSize(std::streamsize block_index, std::streamsize count)
+      const;
+  void ReconstructDuplicatesChunk(
+      std::streamoff start_index,
+      std::streamoff end_index);
   void ReconstructSource();
 
-  const std::vector<uint32_t> &GetWeakChecksums() const override;
-  const std::vector<StrongChecksum> &GetStrongChecksums() const override;
-  std::vector<std::streamoff> GetTestAnalysis() const override;
+  void VerifyTargetChunk(
+      std::vector<StrongChecksum> &target_checksums,
+      std::streamsize first_block,
+      std::streamoff start_offset,
+      std::streamoff end_offset);
 
-  template <typename T>
-  std::streamsize ReadIntoContainer(
-      Reader &metadata_reader,
-      std::streamoff offset,
-      std::vector<T> &container);
+  void VerifyTarget(StrongChecksumBuilder &hash_builder);
+  void SyncWindow(StrongChecksumBuilder &hash_builder);
+
+  std::span<const uint32_t> GetWeakChecksums() const override;
+  std::span<const StrongChecksum> GetStrongChecksums() const override;
+  std::vector<std::streamoff> GetTestAnalysis() const override;
 
   class ChunkReconstructor {
     SyncCommandImpl &parent_impl_;
 
+    std::unique_ptr<Codec> codec_;
+
     std::vector<char> buffer_;
+    std::vector<char> frame_buffer_;
     std::unique_ptr<Reader> seed_reader_;
     std::unique_ptr<Reader> data_reader_;
     std::fstream output_;
@@ -111,21 +311,33 @@ class SyncCommandImpl final : public SyncCommand {
         const char *read_buffer,
         const BatchRetrivalInfo &retrieval_info);
 
+    void WriteRetrievedFrame(
+        const char *read_buffer,
+        const BatchRetrivalInfo &retrieval_info);
+
     void ValidateAndWrite(
-        int block_index,
+        std::streamsize block_index,
         const char *buffer,
         std::streamsize count);
 
     std::streamsize Decompress(
         std::streamsize compressed_size,
         const void *decompression_buffer,
-        void *output_buffer) const;
+        void *output_buffer);
 
   public:
     ChunkReconstructor(SyncCommandImpl &parent, std::streamoff start_offset);
 
-    void ReconstructFromSeed(int block_index, std::streamoff seed_offset);
-    void EnqueueBlockRetrieval(int block_index, std::streamoff begin_offset);
+    void ReconstructFromSeed(
+        std::streamsize block_index,
+        std::streamoff seed_offset);
+    void SkipBlock();
+    void EnqueueBlockRetrieval(
+        std::streamsize block_index,
+        std::streamoff begin_offset);
+    void EnqueueFrameRetrieval(
+        std::streamsize begin_block_index,
+        std::streamsize end_block_index);
     void FlushBatch(bool force);
   };
 
@@ -137,7 +349,8 @@ public:
       std::filesystem::path output_path,
       bool compression_disabled,
       int num_blocks_in_batch,
-      int threads);
+      int threads,
+      std::streamsize window_blocks);
 
   int Run() override;
 
@@ -151,7 +364,8 @@ std::unique_ptr<SyncCommand> SyncCommand::Create(
     std::filesystem::path output_path,
     bool compression_disabled,
     int num_blocks_in_batch,
-    int threads) {
+    int threads,
+    std::streamsize window_blocks) {
   return std::make_unique<SyncCommandImpl>(
       std::move(data_uri),
       std::move(metadata_uri),
@@ -159,152 +373,451 @@ std::unique_ptr<SyncCommand> SyncCommand::Create(
       std::move(output_path),
       compression_disabled,
       num_blocks_in_batch,
-      threads);
+      threads,
+      window_blocks);
 }
 
-const std::vector<uint32_t> &SyncCommandImpl::GetWeakChecksums() const {
-  return weak_checksums_;
+std::span<const uint32_t> SyncCommandImpl::GetWeakChecksums() const {
+  return weak_checksums_.GetData();
 }
 
-const std::vector<StrongChecksum> &SyncCommandImpl::GetStrongChecksums() const {
-  return strong_checksums_;
+std::span<const StrongChecksum> SyncCommandImpl::GetStrongChecksums() const {
+  CHECK_EQ(
+      strong_checksum_size_,
+      static_cast<std::streamsize>(sizeof(StrongChecksum)))
+      << "the strong checksums are truncated";
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  return {reinterpret_cast<const StrongChecksum *>(strong_checksums_.data()),
+          static_cast<size_t>(block_count_)};
 }
 
 std::vector<std::streamoff> SyncCommandImpl::GetTestAnalysis() const {
   std::vector<std::streamoff> result;
 
-  for (int i = 0; i < block_count_; i++) {
-    auto wcs = weak_checksums_[i];
-    auto data = analysis_.find(wcs);
-    result.push_back(data->second.seed_offset);
+  for (std::streamsize i = 0; i < block_count_; i++) {
+    auto index = weak_checksum_index_.Find(weak_checksums_[i]);
+    result.push_back(index >= 0 ? seed_offsets_[index] : kInvalidOffset);
   }
 
   return result;
 }
 
 void SyncCommandImpl::ParseHeader(Reader &metadata_reader) {
-  static constexpr std::streamsize kMaxHeaderSize = 1024;
-  std::vector<uint8_t> buffer(kMaxHeaderSize);
-  metadata_reader.Read(buffer.data(), 0, kMaxHeaderSize);
-
-  int version = 0;
-  header_size_ =
-      HeaderAdapter::ReadHeader(buffer, version, size_, block_size_, hash_);
-  CHECK(version == 2) << "unsupported version" << version;
+  std::vector<uint8_t> buffer(HeaderAdapter::kMaxHeaderSize);
+  metadata_reader.Read(buffer.data(), 0, HeaderAdapter::kMaxHeaderSize);
+
+  auto &header = metadata_header_;
+  HeaderAdapter::ReadHeader(buffer, header);
+  CHECK(header.version == HeaderAdapter::kVersion)
+      << "unsupported version" << header.version;
+
+  size_ = header.data_size;
+  block_size_ = header.block_size;
+  hash_ = header.hash;
+  // metadata written before frames were introduced has one frame per block
+  blocks_per_frame_ = std::max<std::streamsize>(header.blocks_per_frame, 1);
+  codec_ = header.codec;
   block_count_ = (size_ + block_size_ - 1) / block_size_;
+  strong_checksum_size_ = header.strong_checksum_size;
+  CHECK(
+      strong_checksum_size_ > 0 &&
+      strong_checksum_size_ <=
+          static_cast<std::streamsize>(sizeof(StrongChecksum)))
+      << "invalid strong checksum size " << strong_checksum_size_;
+
+  auto metadata_size = metadata_reader.GetSize();
+  for (int i = 0; i < kMetadataSectionCount; i++) {
+    const auto &info = header.sections[i];
+    CHECK(
+        info.offset >= 0 && info.size >= 0 &&
+        info.offset + info.size <= metadata_size)
+        << "invalid metadata section " << i;
+  }
 }
 
-template <typename T>
-std::streamsize SyncCommandImpl::ReadIntoContainer(
-    Reader &metadata_reader,
+std::span<const char> SyncCommandImpl::ReadSectionRange(
+    MetadataSection section,
     std::streamoff offset,
-    std::vector<T> &container) {
-  std::streamsize size_to_read =
-      block_count_ * sizeof(typename std::vector<T>::value_type);
-  container.resize(block_count_);
-  std::streamsize size_read =
-      metadata_reader.Read(container.data(), offset, size_to_read);
-  CHECK_EQ(size_to_read, size_read) << "cannot Read metadata";
-  AdvanceProgress(size_read);
-  return size_read;
-}
-
-void SyncCommandImpl::UpdateCompressedOffsetsAndMaxSize() {
-  compressed_file_offsets_.push_back(0);
-  if (!compressed_sizes_.empty()) {
-    max_compressed_size_ = compressed_sizes_[0];
+    std::streamsize size,
+    std::vector<char> &buffer) {
+  const auto &info = metadata_header_.GetSection(section);
+  CHECK(offset >= 0 && size >= 0 && offset + size <= info.size)
+      << "invalid metadata section " << static_cast<int>(section);
+  if (metadata_ != nullptr) {
+    return {metadata_ + info.offset + offset, static_cast<size_t>(size)};
   }
-  for (int i = 1; i < block_count_; i++) {
-    compressed_file_offsets_.push_back(
-        compressed_file_offsets_[i - 1] + compressed_sizes_[i - 1]);
-    max_compressed_size_ = std::max(max_compressed_size_, compressed_sizes_[i]);
+  buffer.resize(size);
+  auto size_read =
+      metadata_reader_->Read(buffer.data(), info.offset + offset, size);
+  CHECK_EQ(size_read, size) << "cannot Read metadata";
+  AdvanceProgress(size);
+  return buffer;
+}
+
+CompressedColumns::ReadRange SyncCommandImpl::GetSectionReader(
+    MetadataSection section,
+    std::vector<char> &buffer) {
+  return [this, section, &buffer](auto offset, auto size) {
+    return ReadSectionRange(section, offset, size, buffer);
+  };
+}
+
+template <typename T>
+std::span<const T> SyncCommandImpl::LoadColumn(
+    MetadataSection section,
+    std::streamoff begin,
+    std::streamoff end,
+    std::streamsize count,
+    std::streamsize element_size,
+    std::vector<T> &buffer) {
+  auto size = (end - begin) * element_size;
+  auto element_count = size / static_cast<std::streamsize>(sizeof(T));
+
+  if (metadata_header_.IsCompressed(section)) {
+    auto read_buffer = std::vector<char>();
+    buffer.resize(element_count);
+    CompressedColumns::DecompressRange(
+        GetSectionReader(section, read_buffer),
+        buffer.data(),
+        begin,
+        end,
+        count,
+        element_size,
+        threads_);
+    return buffer;
   }
+
+  CHECK_EQ(metadata_header_.GetSection(section).size, count * element_size)
+      << "invalid metadata section " << static_cast<int>(section);
+  auto offset = begin * element_size;
+  if (metadata_ != nullptr) {
+    const auto *data = metadata_ +
+                       metadata_header_.GetSection(section).offset + offset;
+    CHECK_EQ(reinterpret_cast<uintptr_t>(data) % alignof(T), 0U)
+        << "invalid metadata section " << static_cast<int>(section);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    return {reinterpret_cast<const T *>(data),
+            static_cast<size_t>(element_count)};
+  }
+  buffer.resize(element_count);
+  auto size_read = metadata_reader_->Read(
+      buffer.data(),
+      metadata_header_.GetSection(section).offset + offset,
+      size);
+  CHECK_EQ(size_read, size) << "cannot Read metadata";
+  AdvanceProgress(size);
+  return buffer;
 }
 
-void SyncCommandImpl::ReadMetadata() {
-  auto metadata_reader = Reader::Create(metadata_uri_);
+std::streamsize SyncCommandImpl::GetCompressedSize(
+    std::streamsize block_index) const {
+  return compressed_offsets_[block_index + 1] -
+         compressed_offsets_[block_index];
+}
 
-  StartNextPhase(metadata_reader->GetSize());
-  LOG(INFO) << "reading metadata...";
+std::streamsize SyncCommandImpl::FindDuplicate(std::streamsize block) {
+  // the duplicate blocks are in block order, so they are searched for by
+  // bisection, which reads a few of them where they are not in place
+  static constexpr auto kEntrySize =
+      static_cast<std::streamsize>(sizeof(int64_t));
+  auto buffer = std::vector<char>();
+  std::streamsize begin = 0;
+  std::streamsize end =
+      metadata_header_.GetSection(MetadataSection::kDuplicateBlocks).size /
+      kEntrySize;
+  while (begin < end) {
+    auto middle = begin + (end - begin) / 2;
+    int64_t duplicate_block = 0;
+    memcpy(
+        &duplicate_block,
+        ReadSectionRange(
+            MetadataSection::kDuplicateBlocks,
+            middle * kEntrySize,
+            kEntrySize,
+            buffer)
+            .data(),
+        kEntrySize);
+    if (duplicate_block < block) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
+
+void SyncCommandImpl::ValidateDuplicates() const {
+  for (size_t i = 0; i < duplicate_blocks_.size(); i++) {
+    auto duplicate_block = duplicate_blocks_[i];
+    auto canonical_block = canonical_blocks_[i];
+    CHECK(
+        duplicate_block >= window_begin_ && duplicate_block < window_end_ &&
+        block_encodings_[duplicate_block] == BlockEncoding::kDuplicate)
+        << "invalid duplicate block " << duplicate_block;
+    // the canonical blocks before the window were synced already
+    CHECK(
+        canonical_block >= 0 && canonical_block < duplicate_block &&
+        (canonical_block < window_begin_ ||
+         block_encodings_[canonical_block] != BlockEncoding::kDuplicate))
+        << "invalid canonical block " << canonical_block;
+  }
+}
 
-  ParseHeader(*metadata_reader);
-  AdvanceProgress(header_size_);
-  auto offset = header_size_;
-  offset += ReadIntoContainer(*metadata_reader, offset, weak_checksums_);
-  offset += ReadIntoContainer(*metadata_reader, offset, strong_checksums_);
-  ReadIntoContainer(*metadata_reader, offset, compressed_sizes_);
+void SyncCommandImpl::LoadBlockColumn(
+    MetadataSection section,
+    std::streamsize begin,
+    std::streamsize end) {
+  using Section = MetadataSection;
+  switch (section) {
+    case Section::kWeakChecksums:
+      weak_checksums_ = {
+          LoadColumn(
+              section,
+              begin,
+              end,
+              block_count_,
+              sizeof(uint32_t),
+              weak_checksums_buffer_),
+          begin};
+      break;
+    case Section::kStrongChecksums:
+      strong_checksums_ = LoadColumn(
+          section,
+          begin,
+          end,
+          block_count_,
+          strong_checksum_size_,
+          strong_checksums_buffer_);
+      break;
+    case Section::kCompressedOffsets:
+      if (metadata_header_.IsCompressed(section)) {
+        auto read_buffer = std::vector<char>();
+        CompressedColumns::DecompressOffsetsRange(
+            GetSectionReader(section, read_buffer),
+            compressed_offsets_buffer_,
+            begin,
+            end + 1,
+            block_count_ + 1,
+            threads_);
+        compressed_offsets_ = {compressed_offsets_buffer_, begin};
+      } else {
+        compressed_offsets_ = {
+            LoadColumn(
+                section,
+                begin,
+                end + 1,
+                block_count_ + 1,
+                sizeof(int64_t),
+                compressed_offsets_buffer_),
+            begin};
+      }
+      break;
+    case Section::kBlockEncodings:
+      block_encodings_ = {
+          LoadColumn(
+              section,
+              begin,
+              end,
+              block_count_,
+              sizeof(BlockEncoding),
+              block_encodings_buffer_),
+          begin};
+      break;
+    default:
+      LOG(FATAL) << "not a block column " << static_cast<int>(section);
+  }
+}
 
-  UpdateCompressedOffsetsAndMaxSize();
-  seed_offsets_.resize(block_count_, kInvalidOffset);
+void SyncCommandImpl::LoadWindow(std::streamsize begin, std::streamsize end) {
+  window_begin_ = begin;
+  window_end_ = end;
+  loaded_windows_++;
+
+  // metadata that is not used in place is read for each window, about this
+  // much of it (less where its columns are compressed)
+  if (metadata_ == nullptr) {
+    StartNextPhase(
+        (end - begin) * (static_cast<std::streamsize>(
+                             sizeof(uint32_t) + sizeof(int64_t) +
+                             sizeof(BlockEncoding)) +
+                         strong_checksum_size_));
+    LOG(INFO) << "reading metadata of blocks " << begin << " to " << end
+              << "...";
+  }
 
-  for (auto index = 0; index < block_count_; index++) {
-    (*set_)[weak_checksums_[index]] = true;
-    analysis_[weak_checksums_[index]] = {index, kInvalidOffset};
+  using Section = MetadataSection;
+  for (auto section : kBlockColumns) {
+    if (!columns_decompressed_ || !metadata_header_.IsCompressed(section)) {
+      LoadBlockColumn(section, begin, end);
+    }
+  }
+
+  auto duplicate_count =
+      metadata_header_.GetSection(Section::kDuplicateBlocks).size /
+      static_cast<std::streamsize>(sizeof(int64_t));
+  auto duplicates_begin = FindDuplicate(begin);
+  auto duplicates_end = FindDuplicate(end);
+  duplicate_blocks_ = LoadColumn(
+      Section::kDuplicateBlocks,
+      duplicates_begin,
+      duplicates_end,
+      duplicate_count,
+      sizeof(int64_t),
+      duplicate_blocks_buffer_);
+  canonical_blocks_ = LoadColumn(
+      Section::kCanonicalBlocks,
+      duplicates_begin,
+      duplicates_end,
+      duplicate_count,
+      sizeof(int64_t),
+      canonical_blocks_buffer_);
+  ValidateDuplicates();
+
+  // the duplicates are not indexed, as they are copied from their canonical
+  // block, and neither are the blocks of zeros, which are left as holes, and
+  // the index prepare stores is used for the whole target
+  if (begin == 0 && end == block_count_) {
+    auto index = ReadSectionRange(
+        Section::kWeakChecksumIndex,
+        0,
+        metadata_header_.GetSection(Section::kWeakChecksumIndex).size,
+        weak_checksum_index_buffer_);
+    weak_checksum_index_ = WeakChecksumIndex(index, block_count_, threads_);
+  } else {
+    weak_checksum_index_buffer_ = WeakChecksumIndex::Build(
+        weak_checksums_.GetData(),
+        block_encodings_.GetData(),
+        begin,
+        threads_);
+    weak_checksum_index_ =
+        WeakChecksumIndex(weak_checksum_index_buffer_, block_count_, threads_);
   }
 }
 
-void SyncCommandImpl::AnalyzeSeedChunk(
-    int /*id*/,
+void SyncCommandImpl::ReadMetadataChunk(
     std::streamoff start_offset,
     std::streamoff end_offset) {
-  auto v_buffer = std::vector<char>(2 * block_size_);
-  auto *buffer = v_buffer.data() + block_size_;
-  memset(buffer, 0, block_size_);
+  if (end_offset <= start_offset) {
+    return;
+  }
 
-  auto seed_reader = Reader::Create(seed_uri_);
-  auto seed_size = seed_reader->GetSize();
+  // each chunk has a reader of its own, as they are not thread safe
+  auto metadata_reader = Reader::Create(metadata_uri_);
+  for (auto offset = start_offset; offset < end_offset;
+       offset += kMetadataRangeSize)
+  {
+    auto size = ky::Min(end_offset - offset, kMetadataRangeSize);
+    auto size_read =
+        metadata_reader->Read(metadata_buffer_.data() + offset, offset, size);
+    CHECK_EQ(size_read, size) << "cannot Read metadata";
+    AdvanceProgress(size);
+  }
+}
 
-  uint32_t running_wcs = 0;
+void SyncCommandImpl::ReadMetadataRange(
+    std::streamoff start_offset,
+    std::streamoff end_offset) {
+  ky::parallelize::Parallelize(
+      end_offset - start_offset,
+      kMetadataRangeSize,
+      0,
+      threads_,
+      [this, start_offset](auto /*id*/, auto beg, auto end) {
+        ReadMetadataChunk(start_offset + beg, start_offset + end);
+      });
+}
 
-  std::streamsize warmup = block_size_ - 1;
+void SyncCommandImpl::ReadMetadata() {
+  metadata_reader_ = Reader::Create(metadata_uri_);
+  auto metadata_size = metadata_reader_->GetSize();
+
+  ParseHeader(*metadata_reader_);
+
+  // windows hold whole frames, as the frames are retrieved whole
+  auto blocks_per_frame = GetBlocksPerFrame();
+  window_blocks_ =
+      (window_blocks_ + blocks_per_frame - 1) / blocks_per_frame *
+      blocks_per_frame;
+  auto windowed = window_blocks_ > 0 && window_blocks_ < block_count_;
+
+  // local metadata is mapped and used in place, so that this does not take
+  // longer for larger targets, and remote metadata is downloaded whole, all of
+  // its columns at once, unless the target is synced in windows, in which
+  // case the part of each column for a window is read along with it
+  metadata_ = metadata_reader_->GetData();
+
+  // only the dictionary is read here when the windows read the rest
+  StartNextPhase(
+      metadata_ == nullptr && windowed ? metadata_header_.dictionary_size
+                                       : metadata_size);
+  LOG(INFO) << "reading metadata...";
 
-  for (std::streamoff seed_offset = start_offset;  //
-       seed_offset < end_offset;
-       seed_offset += block_size_)
-  {
-    auto callback = [&](std::streamoff offset, uint32_t wcs) {
-      /* The `set` seems to improve performance. Previously the code was:
-       * https://github.com/kyotov/ksync/blob/2d98f83cd1516066416e8319fbfa995e3f49f3dd/commands/SyncCommand.cpp#L128-L132
-       */
-      if (--warmup < 0 && seed_offset + offset < seed_size && (*set_)[wcs]) {
-        weak_checksum_matches_++;
-        auto &data = analysis_[wcs];
-
-        auto source_digest = strong_checksums_[data.index];
-        auto seed_digest =
-            StrongChecksum::Compute(buffer + offset, block_size_);
-
-        // there was a verification here in previous versions...
-        // restore if needed for debugging by running blame on this line.
-        if (source_digest == seed_digest) {
-          (*set_)[wcs] = false;
-          warmup = block_size_ - 1;
-          strong_checksum_matches_++;
-          data.seed_offset = seed_offset + offset;
-          seed_offsets_[data.index] = data.seed_offset;
-        } else {
-          weak_checksum_false_positive_++;
-        }
+  if (metadata_ == nullptr && !windowed) {
+    metadata_buffer_.resize(metadata_size);
+    metadata_ = metadata_buffer_.data();
+
+    // the compressed columns are decompressed as soon as they are downloaded,
+    // while the rest of the metadata is (the columns are in section order)
+    auto decompressions = std::vector<std::future<void>>();
+    std::streamoff offset = 0;
+    for (auto section : kBlockColumns) {
+      if (!metadata_header_.IsCompressed(section)) {
+        continue;
       }
-    };
-
-    memcpy(buffer - block_size_, buffer, block_size_);
-    auto count = seed_reader->Read(buffer, seed_offset, block_size_);
-    memset(buffer + count, 0, block_size_ - count);
+      const auto &info = metadata_header_.GetSection(section);
+      ReadMetadataRange(offset, info.offset + info.size);
+      offset = info.offset + info.size;
+      decompressions.push_back(
+          std::async(std::launch::async, [this, section]() {
+            LoadBlockColumn(section, 0, block_count_);
+          }));
+    }
+    ReadMetadataRange(offset, metadata_size);
+    for (auto &decompression : decompressions) {
+      decompression.get();
+    }
+    columns_decompressed_ = !decompressions.empty();
+  } else if (metadata_ != nullptr) {
+    AdvanceProgress(metadata_size);
+  }
 
-    /* I tried to "optimize" the following by manually inlining `weakChecksum`
-     * and then unrolling the inner loop. To my surprise this did not help...
-     * The MSVC compiler must be already doing it...
-     * We should verify that other compilers do reasonably well before we
-     * abandon the idea completely.
-     * https://github.com/kyotov/ksync/blob/2d98f83cd1516066416e8319fbfa995e3f49f3dd/commands/SyncCommand.cpp#L166-L220
-     */
-    running_wcs = WeakChecksum(buffer, block_size_, running_wcs, callback);
+  auto dictionary_buffer = std::vector<char>();
+  auto dictionary = ReadSectionRange(
+      MetadataSection::kDictionary,
+      0,
+      metadata_header_.dictionary_size,
+      dictionary_buffer);
+  if (!dictionary.empty()) {
+    dictionary_ = Codec::Create(codec_)->DigestDictionary(
+        {dictionary.begin(), dictionary.end()});
+  }
 
-    AdvanceProgress(block_size_);
+  if (!windowed) {
+    window_blocks_ = block_count_;
+    LoadWindow(0, block_count_);
   }
 }
 
+void SyncCommandImpl::AnalyzeSeedChunk(
+    int /*id*/,
+    std::streamoff start_offset,
+    std::streamoff end_offset) {
+  auto seed_reader = Reader::Create(seed_uri_);
+  auto seed_blocks = SeedBlocks(*this);
+  auto counts = SeedScanner(
+                    *seed_reader,
+                    block_size_,
+                    strong_checksum_size_,
+                    weak_checksum_index_,
+                    seed_blocks)
+                    .Scan(start_offset, end_offset, [this](auto size) {
+                      AdvanceProgress(size);
+                    });
+  weak_checksum_matches_ += counts.weak_checksum_matches;
+  weak_checksum_false_positive_ += counts.weak_checksum_false_positives;
+  strong_checksum_matches_ += counts.strong_checksum_matches;
+}
+
 void SyncCommandImpl::AnalyzeSeed() {
   auto seed_reader = Reader::Create(seed_uri_);
   auto seed_data_size = seed_reader->GetSize();
@@ -312,6 +825,8 @@ void SyncCommandImpl::AnalyzeSeed() {
   StartNextPhase(seed_data_size);
   LOG(INFO) << "analyzing seed data...";
 
+  seed_offsets_.Reset(window_begin_, window_end_, seed_data_size);
+
   ky::parallelize::Parallelize(
       seed_data_size,
       block_size_,
@@ -322,8 +837,14 @@ void SyncCommandImpl::AnalyzeSeed() {
       [this](auto id, auto beg, auto end) { AnalyzeSeedChunk(id, beg, end); });
 }
 
-void SyncCommandImpl::ValidateBlockSize(int block_index, std::streamsize count)
-    const {
+std::streamsize SyncCommandImpl::GetBlocksPerFrame() const {
+  // the uncompressed data can be retrieved at any block boundary
+  return compression_disabled_ ? 1 : blocks_per_frame_;
+}
+
+void SyncCommandImpl::ValidateBlockSize(
+    std::streamsize block_index,
+    std::streamsize count) const {
   if (block_index < block_count_ - 1 || size_ % block_size_ == 0) {
     CHECK_EQ(count, block_size_);
   } else {
@@ -334,35 +855,69 @@ void SyncCommandImpl::ValidateBlockSize(int block_index, std::streamsize count)
 std::streamsize SyncCommandImpl::ChunkReconstructor::Decompress(
     std::streamsize compressed_size,
     const void *decompression_buffer,
-    void *output_buffer) const {
-  auto expected_size_after_decompression =
-      ZSTD_getFrameContentSize(decompression_buffer, compressed_size);
-  CHECK(expected_size_after_decompression != ZSTD_CONTENTSIZE_ERROR)
-      << " Not compressed by zstd!";
-  CHECK(expected_size_after_decompression != ZSTD_CONTENTSIZE_UNKNOWN)
-      << "Original size unknown when decompressing.";
-  CHECK(expected_size_after_decompression <= parent_impl_.block_size_)
-      << "Expected decompressed size is greater than block size.";
-  // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
-  std::streamsize decompressed_size = ZSTD_decompress(
+    void *output_buffer) {
+  auto decompressed_size = codec_->Decompress(
       output_buffer,
       parent_impl_.block_size_,
       decompression_buffer,
       compressed_size);
-  CHECK(!ZSTD_isError(decompressed_size))
-      << ZSTD_getErrorName(decompressed_size);
   LOG_ASSERT(decompressed_size <= parent_impl_.block_size_);
   return decompressed_size;
 }
 
+void SyncCommandImpl::ChunkReconstructor::WriteRetrievedFrame(
+    const char *read_buffer,
+    const BatchRetrivalInfo &retrieval_info) {
+  auto block_size = parent_impl_.block_size_;
+  auto begin_block_index = retrieval_info.block_index;
+
+  // the retrieved part of the frame ends with the last block that was missing
+  auto end_block_index = begin_block_index;
+  std::streamsize compressed_size = 0;
+  while (compressed_size < retrieval_info.size_to_read) {
+    compressed_size += parent_impl_.GetCompressedSize(end_block_index++);
+  }
+  CHECK_EQ(compressed_size, retrieval_info.size_to_read);
+
+  auto begin_offset = begin_block_index * block_size;
+  auto decompressed_size = ky::Min(
+      end_block_index * block_size - begin_offset,
+      parent_impl_.size_ - begin_offset);
+  codec_->DecompressFrame(
+      frame_buffer_.data(),
+      decompressed_size,
+      read_buffer,
+      compressed_size);
+  parent_impl_.decompressed_bytes_ += decompressed_size;
+
+  output_.seekp(retrieval_info.offset_to_write_to);
+  for (auto block_index = begin_block_index; block_index < end_block_index;
+       block_index++)
+  {
+    auto offset = (block_index - begin_block_index) * block_size;
+    ValidateAndWrite(
+        block_index,
+        frame_buffer_.data() + offset,
+        ky::Min(block_size, decompressed_size - offset));
+  }
+}
+
 void SyncCommandImpl::ChunkReconstructor::WriteRetrievedBatchMember(
     const char *read_buffer,
     const BatchRetrivalInfo &retrieval_info) {
+  if (parent_impl_.GetBlocksPerFrame() > 1) {
+    WriteRetrievedFrame(read_buffer, retrieval_info);
+    return;
+  }
+
   auto read_size = retrieval_info.size_to_read;
   output_.seekp(retrieval_info.offset_to_write_to);
   std::streamsize write_size = 0;
   const char *buffer_to_write = nullptr;
-  if (parent_impl_.compression_disabled_) {
+  if (parent_impl_.compression_disabled_ ||
+      parent_impl_.block_encodings_[retrieval_info.block_index] ==
+          BlockEncoding::kRaw)
+  {
     write_size = read_size;
     buffer_to_write = read_buffer;
   } else {
@@ -417,7 +972,7 @@ void SyncCommandImpl::ChunkReconstructor::FlushBatch(bool force) {
 }
 
 void SyncCommandImpl::ChunkReconstructor::EnqueueBlockRetrieval(
-    int block_index,
+    std::streamsize block_index,
     std::streamoff begin_offset) {
   std::streamoff offset_to_write_to = output_.tellp();
   auto remaining_size =
@@ -431,9 +986,8 @@ void SyncCommandImpl::ChunkReconstructor::EnqueueBlockRetrieval(
   } else {
     batched_retrieval_infos_.push_back(
         {.block_index = block_index,
-         .source_begin_offset =
-             parent_impl_.compressed_file_offsets_[block_index],
-         .size_to_read = parent_impl_.compressed_sizes_[block_index],
+         .source_begin_offset = parent_impl_.compressed_offsets_[block_index],
+         .size_to_read = parent_impl_.GetCompressedSize(block_index),
          .offset_to_write_to = offset_to_write_to});
   }
   // NOTE: the cast below is needed on MacOS / xcode 12
@@ -441,8 +995,26 @@ void SyncCommandImpl::ChunkReconstructor::EnqueueBlockRetrieval(
       output_.tellp() + static_cast<std::streamoff>(parent_impl_.block_size_));
 }
 
+void SyncCommandImpl::ChunkReconstructor::EnqueueFrameRetrieval(
+    std::streamsize begin_block_index,
+    std::streamsize end_block_index) {
+  std::streamoff offset_to_write_to = output_.tellp();
+  auto begin_offset = parent_impl_.compressed_offsets_[begin_block_index];
+  auto end_offset = parent_impl_.compressed_offsets_[end_block_index];
+  batched_retrieval_infos_.push_back(
+      {.block_index = begin_block_index,
+       .source_begin_offset = begin_offset,
+       .size_to_read = end_offset - begin_offset,
+       .offset_to_write_to = offset_to_write_to});
+  // NOTE: the cast below is needed on MacOS / xcode 12
+  output_.seekp(
+      output_.tellp() +
+      static_cast<std::streamoff>(
+          (end_block_index - begin_block_index) * parent_impl_.block_size_));
+}
+
 void SyncCommandImpl::ChunkReconstructor::ValidateAndWrite(
-    int block_index,
+    std::streamsize block_index,
     const char *buffer,
     std::streamsize count) {
   parent_impl_.ValidateBlockSize(block_index, count);
@@ -453,8 +1025,16 @@ void SyncCommandImpl::ChunkReconstructor::ValidateAndWrite(
 SyncCommandImpl::ChunkReconstructor::ChunkReconstructor(
     SyncCommandImpl &parent_instance,
     std::streamoff start_offset)
-    : parent_impl_(parent_instance) {
+    : parent_impl_(parent_instance),
+      codec_(Codec::Create(parent_instance.codec_)) {
+  if (parent_impl_.dictionary_) {
+    codec_->LoadDictionary(parent_impl_.dictionary_);
+  }
   buffer_ = std::vector<char>(parent_impl_.block_size_);
+  if (parent_impl_.GetBlocksPerFrame() > 1) {
+    frame_buffer_ = std::vector<char>(
+        parent_impl_.GetBlocksPerFrame() * parent_impl_.block_size_);
+  }
   seed_reader_ = Reader::Create(parent_impl_.seed_uri_);
   data_reader_ = Reader::Create(parent_impl_.data_uri_);
   output_ = parent_impl_.output_path_file_stream_provider_.CreateFileStream();
@@ -463,70 +1043,208 @@ SyncCommandImpl::ChunkReconstructor::ChunkReconstructor(
 }
 
 void SyncCommandImpl::ChunkReconstructor::ReconstructFromSeed(
-    int block_index,
+    std::streamsize block_index,
     std::streamoff seed_offset) {
-  auto count =
-      seed_reader_->Read(buffer_.data(), seed_offset, parent_impl_.block_size_);
+  // the last block is shorter, its checksums cover the zeros after it, which
+  // a longer seed may have
+  auto size = ky::Min(
+      parent_impl_.block_size_,
+      parent_impl_.size_ - block_index * parent_impl_.block_size_);
+  auto count = seed_reader_->Read(buffer_.data(), seed_offset, size);
   ValidateAndWrite(block_index, buffer_.data(), count);
   parent_impl_.reused_bytes_ += count;
 }
 
+void SyncCommandImpl::ChunkReconstructor::SkipBlock() {
+  // NOTE: the cast below is needed on MacOS / xcode 12
+  output_.seekp(
+      output_.tellp() + static_cast<std::streamoff>(parent_impl_.block_size_));
+}
+
 void SyncCommandImpl::ReconstructSourceChunk(
     int /*id*/,
     std::streamoff start_offset,
     std::streamoff end_offset) {
   ChunkReconstructor chunk_reconstructor(*this, start_offset);
-  LOG_ASSERT(start_offset % block_size_ == 0);
-  for (auto offset = start_offset; offset < end_offset; offset += block_size_) {
-    auto block_index = static_cast<int>(offset / block_size_);
-    if (seed_offsets_[block_index] != kInvalidOffset) {
+  auto blocks_per_frame = GetBlocksPerFrame();
+  auto frame_size = blocks_per_frame * block_size_;
+  LOG_ASSERT(start_offset % frame_size == 0);
+  for (auto offset = start_offset; offset < end_offset; offset += frame_size) {
+    auto begin_block_index = offset / block_size_;
+    auto end_block_index =
+        ky::Min(begin_block_index + blocks_per_frame, block_count_);
+
+    // duplicates only occur with one block per frame and are filled in once
+    // all the other blocks are in place
+    if (block_encodings_[begin_block_index] == BlockEncoding::kDuplicate) {
+      chunk_reconstructor.SkipBlock();
+      continue;
+    }
+
+    // blocks of zeros are neither retrieved nor written, the output reads as
+    // zeros there
+    if (block_encodings_[begin_block_index] == BlockEncoding::kZero) {
+      chunk_reconstructor.SkipBlock();
+      auto size = ky::Min(block_size_, size_ - offset);
+      zero_bytes_ += size;
+      AdvanceProgress(size);
+      continue;
+    }
+
+    // the blocks of a frame can only be decoded in order, so the frame is
+    // retrieved up to its last block that is missing from the seed and the
+    // blocks after it are reconstructed from the seed
+    auto retrieved_end_block_index = begin_block_index;
+    for (auto block_index = begin_block_index; block_index < end_block_index;
+         block_index++)
+    {
+      if (seed_offsets_[block_index] == kInvalidOffset) {
+        retrieved_end_block_index = block_index + 1;
+      }
+    }
+
+    if (retrieved_end_block_index > begin_block_index) {
+      if (blocks_per_frame > 1) {
+        chunk_reconstructor.EnqueueFrameRetrieval(
+            begin_block_index,
+            retrieved_end_block_index);
+      } else {
+        chunk_reconstructor.EnqueueBlockRetrieval(begin_block_index, offset);
+      }
+      chunk_reconstructor.FlushBatch(false);
+    }
+
+    for (auto block_index = retrieved_end_block_index;
+         block_index < end_block_index;
+         block_index++)
+    {
       chunk_reconstructor.ReconstructFromSeed(
           block_index,
           seed_offsets_[block_index]);
-    } else {
-      chunk_reconstructor.EnqueueBlockRetrieval(block_index, offset);
-      chunk_reconstructor.FlushBatch(false);
     }
   }
   // Retrieve trailing batch if any
   chunk_reconstructor.FlushBatch(true);
 }
 
+void SyncCommandImpl::ReconstructDuplicatesChunk(
+    std::streamoff start_index,
+    std::streamoff end_index) {
+  auto buffer = std::vector<char>(block_size_);
+
+  auto output = output_path_file_stream_provider_.CreateFileStream();
+
+  for (auto index = start_index; index < end_index; index++) {
+    auto canonical_block = canonical_blocks_[index];
+    output.seekg(canonical_block * block_size_);
+    output.read(buffer.data(), block_size_);
+    CHECK(output) << "error reading canonical block " << canonical_block;
+
+    auto duplicate_block = duplicate_blocks_[index];
+    output.seekp(duplicate_block * block_size_);
+    output.write(buffer.data(), block_size_);
+    CHECK(output) << "error writing duplicate block " << duplicate_block;
+
+    deduplicated_bytes_ += block_size_;
+    AdvanceProgress(block_size_);
+  }
+}
+
 void SyncCommandImpl::ReconstructSource() {
-  auto data_reader = Reader::Create(data_uri_);
-  auto data_size = size_;
+  auto window_offset = window_begin_ * block_size_;
+  auto window_size = ky::Min(window_end_ * block_size_, size_) - window_offset;
 
-  StartNextPhase(data_size);
+  StartNextPhase(window_size);
   LOG(INFO) << "reconstructing target...";
 
+  // chunks are aligned to frames, so that each frame is retrieved only once
   ky::parallelize::Parallelize(
-      data_size,
-      block_size_,
+      window_size,
+      GetBlocksPerFrame() * block_size_,
       0,
       threads_,
-      [this](auto id, auto beg, auto end) {
-        ReconstructSourceChunk(id, beg, end);
+      [this, window_offset](auto id, auto beg, auto end) {
+        ReconstructSourceChunk(id, window_offset + beg, window_offset + end);
       });
 
-  StartNextPhase(data_size);
-  LOG(INFO) << "verifying target...";
-
-  static constexpr auto kBufferSize = 1024 * 1024;
-  std::vector<char> buffer(kBufferSize);
+  // each distinct block is retrieved once and then copied to its duplicates
+  ky::parallelize::Parallelize(
+      static_cast<std::streamsize>(duplicate_blocks_.size()),
+      1,
+      0,
+      threads_,
+      [this](auto /*id*/, auto beg, auto end) {
+        ReconstructDuplicatesChunk(beg, end);
+      });
+}
 
-  StrongChecksumBuilder output_hash;
+void SyncCommandImpl::VerifyTargetChunk(
+    std::vector<StrongChecksum> &target_checksums,
+    std::streamsize first_block,
+    std::streamoff start_offset,
+    std::streamoff end_offset) {
+  auto buffer = std::vector<char>(block_size_);
 
   auto output = output_path_file_stream_provider_.CreateFileStream();
-  while (output) {
-    auto count = output.read(buffer.data(), kBufferSize).gcount();
-    output_hash.Update(buffer.data(), count);
+  output.seekg(start_offset);
+
+  for (auto offset = start_offset; offset < end_offset; offset += block_size_) {
+    auto count = output.read(buffer.data(), block_size_).gcount();
+    CHECK_EQ(count, ky::Min(block_size_, size_ - offset));
+    // the leaves of the hash tree are zero padded, just like in prepare
+    memset(buffer.data() + count, 0, block_size_ - count);
+
+    target_checksums[offset / block_size_ - first_block] =
+        StrongChecksum::Compute(buffer.data(), block_size_);
+
     AdvanceProgress(count);
   }
+}
 
-  CHECK_EQ(hash_, output_hash.Digest().ToString())
-      << "mismatch in hash of reconstructed data";
+void SyncCommandImpl::VerifyTarget(StrongChecksumBuilder &hash_builder) {
+  auto window_offset = window_begin_ * block_size_;
+  auto window_size = ky::Min(window_end_ * block_size_, size_) - window_offset;
 
-  StartNextPhase(0);
+  StartNextPhase(window_size);
+  LOG(INFO) << "verifying target...";
+
+  // the leaves of the hash tree are hashed a range of blocks at a time, which
+  // is the same as hashing all of them at once
+  auto target_checksums = std::vector<StrongChecksum>(
+      ky::Min(kVerifyRangeBlocks, window_end_ - window_begin_));
+  for (auto range_begin = window_begin_; range_begin < window_end_;
+       range_begin += kVerifyRangeBlocks)
+  {
+    auto range_end = ky::Min(range_begin + kVerifyRangeBlocks, window_end_);
+    auto range_offset = range_begin * block_size_;
+
+    ky::parallelize::Parallelize(
+        ky::Min(range_end * block_size_, size_) - range_offset,
+        block_size_,
+        0,
+        threads_,
+        [this, &target_checksums, range_begin, range_offset](
+            auto /*id*/,
+            auto beg,
+            auto end) {
+          VerifyTargetChunk(
+              target_checksums,
+              range_begin,
+              range_offset + beg,
+              range_offset + end);
+        });
+
+    hash_builder.Update(
+        target_checksums.data(),
+        (range_end - range_begin) *
+            static_cast<std::streamsize>(sizeof(StrongChecksum)));
+  }
+}
+
+void SyncCommandImpl::SyncWindow(StrongChecksumBuilder &hash_builder) {
+  AnalyzeSeed();
+  ReconstructSource();
+  VerifyTarget(hash_builder);
 }
 
 SyncCommand::SyncCommand() : KySyncCommand("sync") {}
@@ -538,7 +1256,8 @@ SyncCommandImpl::SyncCommandImpl(
     std::filesystem::path output_path,
     bool compression_disabled,
     int num_blocks_in_batch,
-    int threads)
+    int threads,
+    std::streamsize window_blocks)
     : data_uri_(std::move(data_uri)),
       metadata_uri_(std::move(metadata_uri)),
       seed_uri_(std::move(seed_uri)),
@@ -546,13 +1265,31 @@ SyncCommandImpl::SyncCommandImpl(
       compression_disabled_(compression_disabled),
       blocks_per_batch_(num_blocks_in_batch),
       threads_(threads),
-      set_(std::make_unique<std::bitset<k4Gb>>()) {}
+      window_blocks_(window_blocks) {}
 
 int SyncCommandImpl::Run() {
   ReadMetadata();
+  // the output is emptied first, so that the parts that are never written
+  // (i.e. blocks of zeros) are holes in a sparse file
+  output_path_file_stream_provider_.Resize(0);
   output_path_file_stream_provider_.Resize(size_);
-  AnalyzeSeed();
-  ReconstructSource();
+
+  // the hash is the root of the hash tree, see StrongChecksum::ComputeTree
+  auto hash_builder = StrongChecksumBuilder(size_);
+  if (window_blocks_ >= block_count_) {
+    SyncWindow(hash_builder);
+  } else {
+    for (std::streamsize begin = 0; begin < block_count_;
+         begin += window_blocks_)
+    {
+      LoadWindow(begin, ky::Min(begin + window_blocks_, block_count_));
+      SyncWindow(hash_builder);
+    }
+  }
+  auto hash = hash_builder.Digest();
+  CHECK_EQ(hash_, hash.ToString()) << "mismatch in hash of reconstructed data";
+
+  StartNextPhase(0);
   return 0;
 }
 
@@ -563,6 +1300,9 @@ void SyncCommandImpl::Accept(ky::metrics::MetricVisitor &visitor) {
   VISIT_METRICS(reused_bytes_);
   VISIT_METRICS(downloaded_bytes_);
   VISIT_METRICS(decompressed_bytes_);
+  VISIT_METRICS(deduplicated_bytes_);
+  VISIT_METRICS(zero_bytes_);
+  VISIT_METRICS(loaded_windows_);
 }
 
 }  // namespace kysync
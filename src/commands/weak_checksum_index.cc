@@ -0,0 +1,378 @@
+#include "weak_checksum_index.h"
+
+#include <glog/logging.h>
+#include <ky/parallelize.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <utility>
+
+namespace kysync {
+
+namespace {
+
+constexpr int kHashBits = 32;
+
+// the filter is at least one word
+constexpr int kMinFilterBits = 6;
+
+// so that an entry keeps at least one bit of the hash, and up to 63 bits of the
+// block
+constexpr int kMaxBucketBits = kHashBits - 1;
+
+constexpr std::streamsize kWordBits = 64;
+
+// the entries are built in at most this many partitions
+constexpr int kMaxPartitionBits = 16;
+
+int Log2Ceil(std::streamsize value) {
+  int bits = 0;
+  while ((std::streamsize{1} << bits) < value) {
+    bits++;
+  }
+  return bits;
+}
+
+std::streamsize AlignUp(std::streamsize offset) {
+  static constexpr std::streamsize kAlignment = sizeof(int64_t);
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+template <typename T>
+std::span<const T> GetArray(
+    std::span<const char> data,
+    std::streamoff offset,
+    std::streamsize count) {
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  return {reinterpret_cast<const T *>(data.data() + offset),
+          static_cast<size_t>(count)};
+}
+
+}  // namespace
+
+struct WeakChecksumIndex::Layout {
+  std::array<int64_t, 3> header{};
+
+  std::streamoff filter_offset{};
+  std::streamsize filter_words{};
+  std::streamoff bucket_starts_offset{};
+  std::streamsize bucket_count{};
+  std::streamoff entries_offset{};
+  std::streamsize size{};
+
+  Layout(int filter_bits, int bucket_bits, std::streamsize entry_count)
+      : header{filter_bits, bucket_bits, entry_count} {
+    filter_offset = sizeof(header);
+    filter_words = (std::streamsize{1} << filter_bits) / kWordBits;
+    bucket_starts_offset =
+        filter_offset +
+        filter_words * static_cast<std::streamsize>(sizeof(uint64_t));
+    bucket_count = std::streamsize{1} << bucket_bits;
+    entries_offset = AlignUp(
+        bucket_starts_offset +
+        (bucket_count + 1) * static_cast<std::streamsize>(sizeof(uint32_t)));
+    size = entries_offset +
+           entry_count * static_cast<std::streamsize>(sizeof(uint64_t));
+  }
+
+  // the blocks below `block_count` have to fit in the low bits of the entries,
+  // which are 32 and as many as there are bucket bits
+  Layout(std::streamsize entry_count, std::streamsize block_count)
+      : Layout(
+            std::clamp(
+                Log2Ceil(entry_count * kFilterBitsPerEntry),
+                kMinFilterBits,
+                kHashBits),
+            std::min(
+                std::max(
+                    Log2Ceil(
+                        (entry_count + kEntriesPerBucket - 1) /
+                        kEntriesPerBucket),
+                    Log2Ceil(block_count) - kHashBits),
+                kMaxBucketBits),
+            entry_count) {}
+
+  [[nodiscard]] int GetBlockBits() const {
+    return kHashBits + static_cast<int>(header[1]);
+  }
+};
+
+std::vector<char> WeakChecksumIndex::Build(
+    std::span<const uint32_t> weak_checksums,
+    std::span<const BlockEncoding> block_encodings,
+    std::streamsize first_block,
+    int threads) {
+  CHECK_EQ(weak_checksums.size(), block_encodings.size());
+  auto block_count = std::ssize(weak_checksums);
+  auto is_indexed = [&block_encodings](std::streamsize block) {
+    return block_encodings[block] != BlockEncoding::kDuplicate &&
+           block_encodings[block] != BlockEncoding::kZero;
+  };
+
+  // the entries are partitioned by the top bits of their hashes, a few
+  // partitions per thread, so that the partitions are sorted on their own and
+  // follow one another in order
+  auto partition_bits = std::min(Log2Ceil(threads) + 2, kMaxPartitionBits);
+  auto partition_shift = kHashBits - partition_bits;
+  auto partition_count = std::streamsize{1} << partition_bits;
+
+  // each thread counts the entries of its blocks in each partition, and then
+  // puts them in place (the threads get the same blocks both times)
+  auto positions = std::vector<std::streamsize>(threads * partition_count);
+  ky::parallelize::Parallelize(
+      block_count,
+      1,
+      0,
+      threads,
+      [&](auto id, auto beg, auto end) {
+        auto *counts = &positions[id * partition_count];
+        for (auto block = beg; block < end; block++) {
+          if (is_indexed(block)) {
+            counts[Hash(weak_checksums[block]) >> partition_shift]++;
+          }
+        }
+      });
+  auto partition_starts = std::vector<std::streamsize>(partition_count + 1);
+  std::streamsize position = 0;
+  for (std::streamsize partition = 0; partition < partition_count;
+       partition++)
+  {
+    partition_starts[partition] = position;
+    for (auto id = 0; id < threads; id++) {
+      position += std::exchange(
+          positions[id * partition_count + partition],
+          position);
+    }
+  }
+  partition_starts[partition_count] = position;
+
+  auto entries = std::vector<std::pair<uint64_t, int64_t>>(position);
+  ky::parallelize::Parallelize(
+      block_count,
+      1,
+      0,
+      threads,
+      [&](auto id, auto beg, auto end) {
+        auto *next = &positions[id * partition_count];
+        for (auto block = beg; block < end; block++) {
+          if (is_indexed(block)) {
+            auto hash = Hash(weak_checksums[block]);
+            entries[next[hash >> partition_shift]++] = {hash, block};
+          }
+        }
+      });
+
+  // the hashes are distinct for distinct weak checksums, so sorting by them,
+  // and by the blocks from the last, puts the last block of each weak checksum
+  // first in its run, where it is kept
+  auto sorted_starts = std::vector<std::streamsize>(partition_count + 1);
+  ky::parallelize::Parallelize(
+      partition_count,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        for (auto partition = beg; partition < end; partition++) {
+          auto first = entries.begin() + partition_starts[partition];
+          auto last = entries.begin() + partition_starts[partition + 1];
+          std::sort(first, last, [](const auto &a, const auto &b) {
+            return a.first != b.first ? a.first < b.first
+                                      : a.second > b.second;
+          });
+          sorted_starts[partition] =
+              std::unique(
+                  first,
+                  last,
+                  [](const auto &a, const auto &b) {
+                    return a.first == b.first;
+                  }) -
+              first;
+        }
+      });
+
+  // the entries that are kept are gathered partition after partition
+  std::streamsize entry_count = 0;
+  for (auto &start : sorted_starts) {
+    entry_count += std::exchange(start, entry_count);
+  }
+  // the buckets start at 32 bit positions, which keeps them compact
+  CHECK_LT(entry_count, std::streamsize{1} << kHashBits)
+      << "too many distinct blocks for the weak checksum index";
+  auto sorted_entries = std::vector<std::pair<uint64_t, int64_t>>(entry_count);
+  ky::parallelize::Parallelize(
+      partition_count,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        for (auto partition = beg; partition < end; partition++) {
+          auto first = entries.begin() + partition_starts[partition];
+          std::copy(
+              first,
+              first + (sorted_starts[partition + 1] - sorted_starts[partition]),
+              sorted_entries.begin() + sorted_starts[partition]);
+        }
+      });
+  entries = {};
+
+  auto layout = Layout(entry_count, first_block + block_count);
+  auto filter_shift = kHashBits - static_cast<int>(layout.header[0]);
+  auto bucket_shift = kHashBits - static_cast<int>(layout.header[1]);
+  auto block_bits = layout.GetBlockBits();
+
+  // the entries of a range of words of the filter, or of buckets, follow one
+  // another, so each thread fills a range of them from the first of its
+  // entries on
+  auto find = [&sorted_entries](uint64_t hash) {
+    return std::lower_bound(
+        sorted_entries.begin(),
+        sorted_entries.end(),
+        hash,
+        [](const auto &entry, uint64_t value) { return entry.first < value; });
+  };
+  auto filter = std::vector<uint64_t>(layout.filter_words);
+  ky::parallelize::Parallelize(
+      layout.filter_words,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        auto end_bit = static_cast<uint64_t>(end) * kWordBits;
+        for (auto it = find((beg * kWordBits) << filter_shift);
+             it != sorted_entries.end() && it->first >> filter_shift < end_bit;
+             it++)
+        {
+          auto bit = it->first >> filter_shift;
+          filter[bit / kWordBits] |= uint64_t{1} << (bit % kWordBits);
+        }
+      });
+  auto bucket_starts = std::vector<uint32_t>(layout.bucket_count + 1);
+  ky::parallelize::Parallelize(
+      layout.bucket_count + 1,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        auto it = find(static_cast<uint64_t>(beg) << bucket_shift);
+        for (auto bucket = beg; bucket < end; bucket++) {
+          while (it != sorted_entries.end() &&
+                 std::cmp_less(it->first >> bucket_shift, bucket)) {
+            it++;
+          }
+          bucket_starts[bucket] =
+              static_cast<uint32_t>(it - sorted_entries.begin());
+        }
+      });
+  auto index_entries = std::vector<uint64_t>(entry_count);
+  ky::parallelize::Parallelize(
+      entry_count,
+      1,
+      0,
+      threads,
+      [&](auto /*id*/, auto beg, auto end) {
+        for (auto i = beg; i < end; i++) {
+          // the bucket bits of the hash are shifted out
+          index_entries[i] =
+              (sorted_entries[i].first << block_bits) |
+              static_cast<uint64_t>(first_block + sorted_entries[i].second);
+        }
+      });
+
+  auto result = std::vector<char>(layout.size);
+  auto write = [&result](std::streamoff offset, const auto &array) {
+    memcpy(
+        result.data() + offset,
+        std::data(array),
+        std::size(array) * sizeof(array[0]));
+  };
+  write(0, layout.header);
+  write(layout.filter_offset, filter);
+  write(layout.bucket_starts_offset, bucket_starts);
+  write(layout.entries_offset, index_entries);
+  return result;
+}
+
+std::streamsize WeakChecksumIndex::GetSize(
+    std::streamsize entry_count,
+    std::streamsize block_count) {
+  return Layout(entry_count, block_count).size;
+}
+
+WeakChecksumIndex::WeakChecksumIndex(
+    std::span<const char> data,
+    std::streamsize block_count,
+    int threads) {
+  auto header = std::array<int64_t, 3>();
+  CHECK_GE(data.size(), sizeof(header)) << "invalid weak checksum index";
+  memcpy(header.data(), data.data(), sizeof(header));
+  auto [filter_bits, bucket_bits, entry_count] = header;
+  CHECK(
+      filter_bits >= kMinFilterBits && filter_bits <= kHashBits &&
+      bucket_bits >= 0 && bucket_bits <= kMaxBucketBits && entry_count >= 0 &&
+      entry_count <= block_count)
+      << "invalid weak checksum index";
+
+  auto layout = Layout(
+      static_cast<int>(filter_bits),
+      static_cast<int>(bucket_bits),
+      entry_count);
+  CHECK_EQ(std::ssize(data), layout.size) << "invalid weak checksum index";
+  CHECK_EQ(reinterpret_cast<uintptr_t>(data.data()) % sizeof(int64_t), 0U)
+      << "the weak checksum index is not aligned";
+
+  filter_shift_ = kHashBits - static_cast<int>(filter_bits);
+  bucket_shift_ = kHashBits - static_cast<int>(bucket_bits);
+  tag_mask_ = (uint64_t{1} << bucket_shift_) - 1;
+  block_bits_ = layout.GetBlockBits();
+  block_mask_ = (uint64_t{1} << block_bits_) - 1;
+  filter_ =
+      GetArray<uint64_t>(data, layout.filter_offset, layout.filter_words);
+  bucket_starts_ = GetArray<uint32_t>(
+      data,
+      layout.bucket_starts_offset,
+      layout.bucket_count + 1);
+  entries_ = GetArray<uint64_t>(data, layout.entries_offset, entry_count);
+
+  // the index is probed without bounds checks
+  CHECK_EQ(bucket_starts_.front(), 0U) << "invalid weak checksum index";
+  CHECK_EQ(bucket_starts_.back(), entry_count)
+      << "invalid weak checksum index";
+  ky::parallelize::Parallelize(
+      layout.bucket_count + 1,
+      1,
+      1,
+      threads,
+      [this](auto /*id*/, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        CHECK(std::is_sorted(
+            bucket_starts_.begin() + beg,
+            bucket_starts_.begin() + end))
+            << "invalid weak checksum index";
+      });
+  ky::parallelize::Parallelize(
+      entry_count,
+      1,
+      0,
+      threads,
+      [this, block_count](auto /*id*/, auto beg, auto end) {
+        if (end <= beg) {
+          return;
+        }
+        CHECK(std::all_of(
+            entries_.begin() + beg,
+            entries_.begin() + end,
+            [this, block_count](auto entry) {
+              return static_cast<std::streamsize>(entry & block_mask_) <
+                     block_count;
+            }))
+            << "invalid weak checksum index";
+      });
+}
+
+}  // namespace kysync
@@ -0,0 +1,132 @@
+#ifndef KSYNC_SRC_COMMANDS_WEAK_CHECKSUM_INDEX_H
+#define KSYNC_SRC_COMMANDS_WEAK_CHECKSUM_INDEX_H
+
+#include <cstdint>
+#include <ios>
+#include <span>
+#include <vector>
+
+#include "pb/header_adapter.h"
+
+namespace kysync {
+
+/**
+ * Looks up the block sync reuses from the seed by its weak checksum. Prepare
+ * builds it and stores it in the metadata, where sync probes it in place, so
+ * that sync does not build a lookup table of its own.
+ *
+ * The weak checksums are scrambled into hashes. A bit filter addressed by the
+ * top bits of the hashes rejects most of the checksums sync probes, and the
+ * rest are looked up in buckets, also addressed by the top bits of the hashes,
+ * which hold a few entries each. An entry is a uint64_t: the bits of the hash
+ * below the bucket bits, which tell the weak checksums of a bucket apart, over
+ * the block (in the low 32 bits and as many more as there are bucket bits). A
+ * candidate is thus checked and found in the same word, and the entries of a
+ * bucket share a cache line or two.
+ *
+ * The index is the header (the log2 of the number of bits of the filter and of
+ * the number of buckets and the number of entries), the filter as uint64_t
+ * words, the start of each bucket and the end of the last one as uint32_t and,
+ * at an 8 byte aligned offset, the entries.
+ */
+class WeakChecksumIndex {
+public:
+  // the filter has about this many bits per entry
+  static constexpr std::streamsize kFilterBitsPerEntry = 16;
+  // and there are about this many entries per bucket
+  static constexpr std::streamsize kEntriesPerBucket = 4;
+
+  /**
+   * Indexes each weak checksum of the blocks that sync looks up in the seed,
+   * i.e. all but the duplicates and the blocks of zeros. When blocks share a
+   * weak checksum, the last of them is indexed. The blocks are numbered from
+   * `first_block`, for an index of a part of the target. The index is built
+   * with `threads` threads, and is the same for any number of them.
+   */
+  static std::vector<char> Build(
+      std::span<const uint32_t> weak_checksums,
+      std::span<const BlockEncoding> block_encodings,
+      std::streamsize first_block,
+      int threads);
+
+  /**
+   * The size of an index of `entry_count` entries of blocks below
+   * `block_count`.
+   */
+  static std::streamsize GetSize(
+      std::streamsize entry_count,
+      std::streamsize block_count);
+
+  WeakChecksumIndex() = default;
+
+  /**
+   * Uses the index in `data` in place, which must outlive it and be 8 byte
+   * aligned. The blocks of the entries must be below `block_count`, which is
+   * checked with `threads` threads.
+   */
+  WeakChecksumIndex(
+      std::span<const char> data,
+      std::streamsize block_count,
+      int threads);
+
+  /**
+   * Starts loading the word of the filter for the weak checksum, so that
+   * `MayContain` does not wait for it when probes are issued a little ahead.
+   */
+  void Prefetch(uint32_t weak_checksum) const {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(&filter_[(Hash(weak_checksum) >> filter_shift_) / 64]);
+#endif
+  }
+
+  /**
+   * False if the weak checksum is certainly not indexed. Only the filter is
+   * read.
+   */
+  [[nodiscard]] bool MayContain(uint32_t weak_checksum) const {
+    auto bit = Hash(weak_checksum) >> filter_shift_;
+    return ((filter_[bit / 64] >> (bit % 64)) & 1) != 0;
+  }
+
+  /**
+   * The block indexed for the weak checksum, or -1 if there is none.
+   */
+  [[nodiscard]] std::streamsize Find(uint32_t weak_checksum) const {
+    if (!MayContain(weak_checksum)) {
+      return -1;
+    }
+    auto hash = Hash(weak_checksum);
+    auto bucket = hash >> bucket_shift_;
+    auto tag = hash & tag_mask_;
+    for (auto i = bucket_starts_[bucket]; i < bucket_starts_[bucket + 1]; i++)
+    {
+      if (entries_[i] >> block_bits_ == tag) {
+        return static_cast<std::streamsize>(entries_[i] & block_mask_);
+      }
+    }
+    return -1;
+  }
+
+private:
+  struct Layout;
+
+  // spreads the weak checksums, which are not uniform, over all the bits
+  static uint64_t Hash(uint32_t weak_checksum) {
+    static constexpr uint32_t kMultiplier = 0x9E3779B1;
+    return static_cast<uint32_t>(weak_checksum * kMultiplier);
+  }
+
+  int filter_shift_{};
+  int bucket_shift_{};
+  // the bits of the hash below the bucket bits, over the block
+  uint64_t tag_mask_{};
+  int block_bits_{};
+  uint64_t block_mask_{};
+  std::span<const uint64_t> filter_;
+  std::span<const uint32_t> bucket_starts_;
+  std::span<const uint64_t> entries_;
+};
+
+}  // namespace kysync
+
+#endif  // KSYNC_SRC_COMMANDS_WEAK_CHECKSUM_INDEX_H
@@ -2,13 +2,19 @@
 #include <glog/logging.h>
 #include <ky/noexcept.h>
 #include <ky/observability/observer.h>
+#include <kysync/commands/advise_command.h>
 #include <kysync/commands/prepare_command.h>
 #include <kysync/commands/sync_command.h>
 
+#include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
-DEFINE_string(command, "", "prepare, sync, ...");  // NOLINT
-DEFINE_string(input_filename, "", "input file");   // NOLINT
+DEFINE_string(command, "", "prepare, sync, advise");           // NOLINT
+DEFINE_string(input_filename, "", "input file, - for stdin");  // NOLINT
 // TODO(kyotov): maybe output_path? it is used elsewhere...
 DEFINE_string(  // NOLINT
     output_kysync_filename,
@@ -23,13 +29,102 @@ DEFINE_string(data_uri, "", "data uri");                            // NOLINT
 DEFINE_string(metadata_uri, "", "metadata uri");                    // NOLINT
 DEFINE_string(seed_data_uri, "", "seed data uri");                  // NOLINT
 DEFINE_uint32(block_size, 1024, "block size");                      // NOLINT
+DEFINE_string(  // NOLINT
+    block_sizes,
+    "",
+    "comma separated block sizes prepare produces outputs for in one pass, "
+    "each named with its block size before the extension");
 DEFINE_int32(threads, 32, "number of threads");                     // NOLINT
 DEFINE_int32(num_blocks_in_batch, 4, "number of blocks in batch");  // NOLINT
 DEFINE_bool(use_compression, true, "use compression");              // NOLINT
+DEFINE_uint32(  // NOLINT
+    dictionary_size,
+    0,
+    "capacity of the compression dictionary trained by prepare (0 for none)");
+DEFINE_string(  // NOLINT
+    codec,
+    "zstd",
+    "codec prepare compresses the blocks with: zstd, lz4 or none");
+DEFINE_int32(  // NOLINT
+    blocks_per_frame,
+    1,
+    "number of consecutive blocks prepare compresses into one frame");
+DEFINE_bool(  // NOLINT
+    deduplicate,
+    false,
+    "store identical blocks once in the data prepared by prepare");
+DEFINE_bool(  // NOLINT
+    zero_blocks,
+    false,
+    "flag the blocks of zeros instead of storing them, so that sync leaves "
+    "holes in its output for them");
+DEFINE_string(  // NOLINT
+    previous_kysync_filename,
+    "",
+    "metadata of a previous version whose compressed blocks prepare reuses");
+DEFINE_string(  // NOLINT
+    previous_compressed_filename,
+    "",
+    "compressed data of the previous version");
+DEFINE_bool(  // NOLINT
+    checkpoint,
+    false,
+    "let prepare resume where it stopped when rerun with the same arguments "
+    "(file inputs only)");
+DEFINE_bool(  // NOLINT
+    compress_metadata,
+    false,
+    "compress the block checksums, offsets and encodings in the metadata");
+DEFINE_int32(  // NOLINT
+    strong_checksum_size,
+    16,
+    "number of bytes of each strong checksum prepare stores (4 to 16)");
+DEFINE_string(  // NOLINT
+    seed_filenames,
+    "",
+    "comma separated seeds advise predicts the cost of syncing from");
+DEFINE_int64(  // NOLINT
+    advise_samples,
+    4096,
+    "maximum number of blocks of the input advise samples per block size");
+DEFINE_int64(  // NOLINT
+    advise_seed_stride,
+    16,
+    "advise scans one in this many windows of each seed (1 for all)");
+DEFINE_int64(  // NOLINT
+    sync_window_blocks,
+    0,
+    "sync the target in windows of this many blocks to bound the memory "
+    "sync uses (0 for all at once); the whole seed is scanned for each "
+    "window, so the scan takes as many times longer as there are windows");
 
 DECLARE_bool(help);      // NOLINT
 DECLARE_string(helpon);  // NOLINT
 
+static std::vector<std::string> Split(const std::string &list) {
+  auto items = std::vector<std::string>();
+  auto stream = std::istringstream(list);
+  for (std::string item; std::getline(stream, item, ',');) {
+    items.push_back(item);
+  }
+  return items;
+}
+
+// the options of prepare, which advise predicts the outcome of as well
+static kysync::PrepareOptions GetPrepareOptions() {
+  return {
+      .dictionary_size = FLAGS_dictionary_size,
+      .blocks_per_frame = FLAGS_blocks_per_frame,
+      .codec = kysync::Codec::ParseType(FLAGS_codec),
+      .deduplicate = FLAGS_deduplicate,
+      .zero_blocks = FLAGS_zero_blocks,
+      .previous_metadata_path = FLAGS_previous_kysync_filename,
+      .previous_compressed_path = FLAGS_previous_compressed_filename,
+      .checkpoint = FLAGS_checkpoint,
+      .compress_metadata = FLAGS_compress_metadata,
+      .strong_checksum_size = FLAGS_strong_checksum_size};
+}
+
 int main(int argc, char **argv) {
   ky::NoExcept([&argc, &argv]() {
     google::InitGoogleLogging(argv[0]);
@@ -38,10 +133,17 @@ int main(int argc, char **argv) {
     FLAGS_logtostderr = true;
     FLAGS_colorlogtostderr = true;
 
-    gflags::SetUsageMessage("--command=[prepare|sync] ...");
+    gflags::SetUsageMessage("--command=[prepare|sync|advise] ...");
     gflags::SetVersionString("v0.1");
 
     if (FLAGS_command == "prepare") {
+      // the outputs cannot be named after stdin
+      auto from_stdin = FLAGS_input_filename == "-";
+      CHECK(
+          !from_stdin || (!FLAGS_output_kysync_filename.empty() &&
+                          !FLAGS_output_compressed_filename.empty()))
+          << "the outputs are required when preparing from stdin";
+
       if (FLAGS_output_kysync_filename.empty()) {
         FLAGS_output_kysync_filename = FLAGS_input_filename + ".kysync";
         LOG(INFO) << "metadata filename defaulted to "
@@ -54,12 +156,56 @@ int main(int argc, char **argv) {
                   << FLAGS_output_compressed_filename;
       }
 
-      auto c = kysync::PrepareCommand::Create(
-          FLAGS_input_filename,
-          FLAGS_output_kysync_filename,
-          FLAGS_output_compressed_filename,
-          FLAGS_block_size,
-          FLAGS_threads);
+      if (!FLAGS_previous_kysync_filename.empty() &&
+          FLAGS_previous_compressed_filename.empty())
+      {
+        FLAGS_previous_compressed_filename =
+            std::filesystem::path(FLAGS_previous_kysync_filename)
+                .replace_extension(".pzst")
+                .string();
+        LOG(INFO) << "previous compressed data defaulted to "
+                  << FLAGS_previous_compressed_filename;
+      }
+
+      auto variants = std::vector<kysync::PrepareVariant>();
+      if (FLAGS_block_sizes.empty()) {
+        variants.push_back(
+            {.block_size = FLAGS_block_size,
+             .output_ksync_file_path = FLAGS_output_kysync_filename,
+             .output_compressed_file_path = FLAGS_output_compressed_filename});
+      } else {
+        // e.g. data.bin.kysync -> data.bin.4096.kysync
+        auto with_block_size = [](const std::string &filename,
+                                  const std::string &block_size) {
+          auto path = std::filesystem::path(filename);
+          auto extension = path.extension().string();
+          return path.replace_extension("." + block_size + extension);
+        };
+
+        for (const auto &block_size : Split(FLAGS_block_sizes)) {
+          variants.push_back(
+              {.block_size = std::stoll(block_size),
+               .output_ksync_file_path =
+                   with_block_size(FLAGS_output_kysync_filename, block_size),
+               .output_compressed_file_path = with_block_size(
+                   FLAGS_output_compressed_filename,
+                   block_size)});
+        }
+      }
+
+      auto options = GetPrepareOptions();
+
+      auto c = from_stdin
+                   ? kysync::PrepareCommand::Create(
+                         std::cin,
+                         variants,
+                         FLAGS_threads,
+                         options)
+                   : kysync::PrepareCommand::Create(
+                         FLAGS_input_filename,
+                         variants,
+                         FLAGS_threads,
+                         options);
 
       return ky::observability::Observer(*c).Run([&c]() { return c->Run(); });
     }
@@ -90,12 +236,54 @@ int main(int argc, char **argv) {
           FLAGS_output_filename,
           !FLAGS_use_compression,
           FLAGS_num_blocks_in_batch,
-          FLAGS_threads);
+          FLAGS_threads,
+          FLAGS_sync_window_blocks);
 
       return ky::observability::Observer(*c).Run([&c]() { return c->Run(); });
     }
 
-    LOG(ERROR) << "expected `--command=prepare` or `--command=sync`";
+    if (FLAGS_command == "advise") {
+      auto block_sizes = std::vector<std::streamsize>();
+      if (FLAGS_block_sizes.empty()) {
+        block_sizes.push_back(FLAGS_block_size);
+      } else {
+        for (const auto &block_size : Split(FLAGS_block_sizes)) {
+          block_sizes.push_back(std::stoll(block_size));
+        }
+      }
+
+      auto seed_file_paths = std::vector<std::filesystem::path>();
+      for (const auto &seed_filename : Split(FLAGS_seed_filenames)) {
+        seed_file_paths.emplace_back(seed_filename);
+      }
+
+      auto c = kysync::AdviseCommand::Create(
+          FLAGS_input_filename,
+          seed_file_paths,
+          block_sizes,
+          FLAGS_advise_samples,
+          FLAGS_advise_seed_stride,
+          FLAGS_threads,
+          GetPrepareOptions());
+
+      auto result =
+          ky::observability::Observer(*c).Run([&c]() { return c->Run(); });
+
+      std::cout << "block_size,seed,metadata_size,downloaded_size,"
+                   "reused_size,cpu_ms"
+                << std::endl;
+      for (const auto &advice : c->GetAdvice()) {
+        std::cout << advice.block_size << "," << advice.seed_file_path.string()
+                  << "," << advice.metadata_size << ","
+                  << advice.downloaded_size << "," << advice.reused_size << ","
+                  << advice.cpu_ms << std::endl;
+      }
+
+      return result;
+    }
+
+    LOG(ERROR) << "expected `--command=prepare`, `--command=sync` or "
+                  "`--command=advise`";
 
     FLAGS_help = false;
     FLAGS_helpon = "main";
@@ -1,6 +1,12 @@
 #include <glog/logging.h>
 #include <kysync/readers/file_reader.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace kysync {
 
 namespace fs = std::filesystem;
@@ -11,6 +17,14 @@ FileReader::FileReader(const std::filesystem::path &path)
   CHECK(data_) << "unable to open " << path << " for reading";
 }
 
+FileReader::~FileReader() {
+#ifndef _WIN32
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+#endif
+}
+
 std::streamsize FileReader::GetSize() const {
   // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
   return fs::file_size(path_);
@@ -28,4 +42,33 @@ FileReader::Read(void *buffer, std::streamoff offset, std::streamsize size) {
   return Reader::Read(buffer, offset, data_.gcount());
 }
 
-}  // namespace kysync
\ No newline at end of file
+const char *FileReader::GetData() {
+#ifndef _WIN32
+  if (mapping_ == nullptr) {
+    auto size = GetSize();
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg,hicpp-vararg)
+    auto fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0 || size == 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return nullptr;
+    }
+    auto *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid once the file is closed
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      LOG(WARNING) << "unable to map " << path_;
+      return nullptr;
+    }
+    mapping_ = mapping;
+    mapping_size_ = size;
+  }
+  return static_cast<const char *>(mapping_);
+#else
+  // the file is read instead on windows
+  return nullptr;
+#endif
+}
+
+}  // namespace kysync
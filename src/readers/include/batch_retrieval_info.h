@@ -6,7 +6,7 @@
 namespace kysync {
 
 struct BatchRetrivalInfo {
-  int block_index;
+  std::streamsize block_index;
   std::streamoff source_begin_offset;
   std::streamsize size_to_read;
   std::streamoff offset_to_write_to;
@@ -11,14 +11,24 @@ namespace kysync {
 class FileReader final : public Reader {
   std::filesystem::path path_;
   std::ifstream data_;
+  // the whole file, once it is memory mapped by `GetData`
+  void *mapping_{};
+  std::streamsize mapping_size_{};
 
 public:
   explicit FileReader(const std::filesystem::path &path);
 
+  FileReader(const FileReader &) = delete;
+  FileReader &operator=(const FileReader &) = delete;
+
+  ~FileReader() override;
+
   [[nodiscard]] std::streamsize GetSize() const override;
 
   std::streamsize
   Read(void *buffer, std::streamoff offset, std::streamsize size) override;
+
+  [[nodiscard]] const char *GetData() override;
 };
 
 }  // namespace kysync
@@ -18,6 +18,8 @@ public:
 
   std::streamsize
   Read(void *buffer, std::streamoff offset, std::streamsize size) override;
+
+  [[nodiscard]] const char *GetData() override;
 };
 
 }  // namespace kysync
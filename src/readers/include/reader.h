@@ -31,6 +31,13 @@ public:
       std::vector<BatchRetrivalInfo> &batch_retrieval_infos,
       const ReadCallback &read_callback);
 
+  /**
+   * Returns all of the data in place, for as long as the reader lives, if it
+   * can be accessed without copying (e.g. by memory mapping a local file).
+   * Returns nullptr otherwise, in which case the data has to be `Read`.
+   */
+  [[nodiscard]] virtual const char *GetData();
+
   void Accept(ky::metrics::MetricVisitor &visitor) override;
 
   static std::unique_ptr<Reader> Create(const std::string &uri);
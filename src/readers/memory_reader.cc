@@ -22,4 +22,6 @@ MemoryReader::Read(void* buffer, std::streamoff offset, std::streamsize size) {
   return Reader::Read(buffer, offset, count);
 }
 
+const char* MemoryReader::GetData() { return static_cast<const char*>(data_); }
+
 }  // namespace kysync
\ No newline at end of file
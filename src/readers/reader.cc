@@ -43,6 +43,8 @@ std::streamsize Reader::Read(
   return total_size_read;
 }
 
+const char *Reader::GetData() { return nullptr; }
+
 void Reader::Accept(ky::metrics::MetricVisitor &visitor) {
   VISIT_METRICS(total_reads_);
   VISIT_METRICS(total_bytes_read_);
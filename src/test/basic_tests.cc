@@ -4,6 +4,8 @@
 #include <ky/temp_path.h>
 #include <kysync/checksums/strong_checksum.h>
 #include <kysync/checksums/weak_checksum.h>
+#include <kysync/codecs/codec.h>
+#include <kysync/commands/advise_command.h>
 #include <kysync/commands/prepare_command.h>
 #include <kysync/commands/sync_command.h>
 #include <kysync/path_config.h>
@@ -16,6 +18,12 @@
 
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <utility>
+#include <vector>
 
 namespace kysync {
 
@@ -86,6 +94,14 @@ TEST_F(Tests, RollingWeakChecksum) {  // NOLINT
   cs = WeakChecksum(data + 2 * size, size, cs, check);
   EXPECT_EQ(count, 11);
   EXPECT_EQ(cs, 183829005);
+
+  // the checksums of the windows can also be stored rather than called back
+  auto checksums = std::vector<uint32_t>(size);
+  cs = WeakChecksum(data + 2 * size, size, 183829005, checksums.data());
+  EXPECT_EQ(cs, 183829005);
+  for (auto i = 0; i < size; i++) {
+    EXPECT_EQ(checksums[i], WeakChecksum(data + size + i + 1, size));
+  }
 }
 
 TEST_F(Tests, SimpleStringChecksum) {  // NOLINT
@@ -117,6 +133,19 @@ TEST_F(Tests, StreamingStringChecksum) {  // NOLINT
   EXPECT_EQ(scs_1, scs_2);
 }
 
+TEST_F(Tests, TreeChecksum) {  // NOLINT
+  auto leaves = std::vector<StrongChecksum>{
+      StrongChecksum::Compute("0123", 4),
+      StrongChecksum::Compute("45\0\0", 4)};
+
+  auto root = StrongChecksum::ComputeTree(leaves.data(), Size(leaves), 6);
+
+  // the same leaves describe data with trailing zeros, but the size differs
+  EXPECT_FALSE(root == StrongChecksum::ComputeTree(leaves.data(), 2, 7));
+  EXPECT_FALSE(root == StrongChecksum::ComputeTree(leaves.data(), 1, 6));
+  EXPECT_EQ(root, StrongChecksum::ComputeTree(leaves.data(), 2, 6));
+}
+
 void TestReader(Reader &reader, std::streamsize expected_size) {
   ASSERT_EQ(reader.GetSize(), expected_size);
 
@@ -182,6 +211,28 @@ TEST_F(Tests, FileReaderSimple) {  // NOLINT
   TestReader(*Reader::Create("file://" + path.string()), Size(data));
 }
 
+TEST_F(Tests, ReadersProvideDataInPlace) {  // NOLINT
+  const auto *data = "0123456789";
+
+  auto memory_reader = MemoryReader(data, Size(data));
+  EXPECT_EQ(memory_reader.GetData(), data);
+
+  auto tmp = ky::TempPath();
+  auto path = tmp.GetPath() / "data.bin";
+
+  std::ofstream f(path, std::ios::binary);
+  f.write(data, Size(data));
+  f.close();
+
+  // files are mapped where the platform supports it
+  auto file_reader = FileReader(path);
+  const auto *mapped_data = file_reader.GetData();
+  if (mapped_data != nullptr) {
+    EXPECT_EQ(std::string(mapped_data, Size(data)), data);
+    EXPECT_EQ(file_reader.GetData(), mapped_data);
+  }
+}
+
 TEST_F(Tests, ReadersWithBadUri) {  // NOLINT
   // invalid protocol
   EXPECT_THROW(  // NOLINT{cppcoreguidelines-avoid-goto}
@@ -226,14 +277,15 @@ std::string ReadFile(const fs::path &path) {
 
 class KySyncTest {
 public:
-  static const std::vector<uint32_t> &ExamineWeakChecksums(
-      const KySyncCommand &c) {
-    return c.GetWeakChecksums();
+  static std::vector<uint32_t> ExamineWeakChecksums(const KySyncCommand &c) {
+    auto weak_checksums = c.GetWeakChecksums();
+    return {weak_checksums.begin(), weak_checksums.end()};
   }
 
-  static const std::vector<StrongChecksum> &ExamineStrongChecksums(
+  static std::vector<StrongChecksum> ExamineStrongChecksums(
       const KySyncCommand &c) {
-    return c.GetStrongChecksums();
+    auto strong_checksums = c.GetStrongChecksums();
+    return {strong_checksums.begin(), strong_checksums.end()};
   }
 
   static void ReadMetadata(SyncCommand &c) { c.ReadMetadata(); }
@@ -272,6 +324,63 @@ std::streamsize GetExpectedCompressedSize(
   return compressed_size;
 }
 
+struct PrepareAndSyncResult {
+  std::unique_ptr<PrepareCommand> prepare = nullptr;
+  std::unique_ptr<SyncCommand> sync = nullptr;
+  std::string metadata = {};
+  std::string compressed = {};
+};
+
+// Prepares the data and syncs it from the seed data, and checks that the
+// output is the data. The commands are returned for their metrics, along with
+// the outputs of prepare.
+PrepareAndSyncResult PrepareAndSync(
+    const std::string &data,
+    const std::string &seed_data,
+    std::streamsize block_size,
+    int threads,
+    const PrepareOptions &options = {},
+    std::streamsize window_blocks = 0) {
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  auto kysync_path = tmp.GetPath() / "data.bin.kysync";
+  auto pzst_path = tmp.GetPath() / "data.bin.pzst";
+  auto seed_data_path = tmp.GetPath() / "seed_data.bin";
+  auto output_path = tmp.GetPath() / "output.bin";
+
+  WriteFile(data_path, data);
+  WriteFile(seed_data_path, seed_data);
+
+  auto result = PrepareAndSyncResult{
+      .prepare = PrepareCommand::Create(
+          data_path,
+          kysync_path,
+          pzst_path,
+          block_size,
+          threads,
+          options)};
+  result.prepare->Run();
+  result.metadata = ReadFile(kysync_path);
+  result.compressed = ReadFile(pzst_path);
+
+  // the previous content of the output does not show through the holes
+  WriteFile(output_path, std::string(data.size(), 'x'));
+
+  result.sync = SyncCommand::Create(
+      "file://" + pzst_path.string(),
+      "file://" + kysync_path.string(),
+      "file://" + seed_data_path.string(),
+      output_path,
+      false,
+      4,
+      threads,
+      window_blocks);
+  result.sync->Run();
+
+  EXPECT_EQ(data, ReadFile(output_path));
+  return result;
+}
+
 TEST_F(Tests, SimplePrepareCommand) {  // NOLINT
   auto data = std::string("0123456789");
   auto block = 4;
@@ -300,6 +409,9 @@ TEST_F(Tests, SimplePrepareCommand) {  // NOLINT
   EXPECT_EQ(StrongChecksum::Compute("0123", block), scs[0]);
   EXPECT_EQ(StrongChecksum::Compute("4567", block), scs[1]);
   EXPECT_EQ(StrongChecksum::Compute("89\0\0", block), scs[2]);
+
+  // the columns of small metadata are packed rather than aligned to pages
+  EXPECT_LT(Size(kysync_path), 256);
 }
 
 TEST_F(Tests, SimplePrepareCommand2) {  // NOLINT
@@ -329,6 +441,872 @@ TEST_F(Tests, SimplePrepareCommand2) {  // NOLINT
   EXPECT_EQ(StrongChecksum::Compute("1234", block), scs[2]);
 }
 
+TEST_F(Tests, PrepareCommandIsThreadIndependent) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr std::streamsize kSize = 1000 * kBlock + 123;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kSize; i++) {
+    // a small alphabet so that the blocks are compressible to various degrees
+    data += static_cast<char>('a' + random() % (1 + i / kBlock % 16));
+  }
+
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  WriteFile(data_path, data);
+
+  auto prepare = [&](const std::string &name, int threads) {
+    auto kysync_path = tmp.GetPath() / (name + ".kysync");
+    auto pzst_path = tmp.GetPath() / (name + ".pzst");
+    PrepareCommand::Create(data_path, kysync_path, pzst_path, kBlock, threads)
+        ->Run();
+    return std::make_pair(kysync_path, pzst_path);
+  };
+
+  auto [kysync_1, pzst_1] = prepare("t1", 1);
+  auto [kysync_n, pzst_n] = prepare("tn", kThreads);
+
+  EXPECT_EQ(ReadFile(kysync_1), ReadFile(kysync_n));
+  EXPECT_EQ(ReadFile(pzst_1), ReadFile(pzst_n));
+}
+
+TEST_F(Tests, PrepareWithDictionary) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kRecords = 40'000;
+
+  // many small blocks of similar records, which compress poorly on their own
+  auto data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kRecords; i++) {
+    data += "{\"id\": " + std::to_string(i) +
+            ", \"status\": \"active\", \"score\": " +
+            std::to_string(random() % 1000) + "}\n";
+  }
+  auto seed_data = data.substr(0, data.size() / 2);
+
+  auto dictionary = PrepareAndSync(
+      data,
+      seed_data,
+      kBlock,
+      kThreads,
+      {.dictionary_size = 16 * 1024});
+  auto plain = PrepareAndSync(data, seed_data, kBlock, kThreads);
+
+  EXPECT_LT(Size(dictionary.compressed), Size(plain.compressed));
+
+  // the codecs of each window share the dictionary digested once
+  PrepareAndSync(
+      data,
+      seed_data,
+      kBlock,
+      kThreads,
+      {.dictionary_size = 16 * 1024},
+      64);
+}
+
+TEST_F(Tests, PrepareWithFrames) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kRecords = 40'000;
+  static constexpr int kBlocksPerFrame = 16;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kRecords; i++) {
+    data += "{\"id\": " + std::to_string(i) +
+            ", \"score\": " + std::to_string(random() % 1000) + "}\n";
+  }
+
+  auto options = PrepareOptions{.blocks_per_frame = kBlocksPerFrame};
+  auto frames = PrepareAndSync(data, "", kBlock, 1, options);
+  auto plain = PrepareAndSync(data, "", kBlock, kThreads);
+
+  EXPECT_LT(Size(frames.compressed), Size(plain.compressed));
+
+  // each frame holds its blocks, and only the last one is shorter
+  auto frame_sizes = std::vector<std::streamsize>();
+  for (std::streamsize offset = 0; offset < Size(frames.compressed);) {
+    const auto *frame = frames.compressed.data() + offset;
+    auto remaining = Size(frames.compressed) - offset;
+    auto compressed_size = ZSTD_findFrameCompressedSize(frame, remaining);
+    ASSERT_FALSE(ZSTD_isError(compressed_size));
+    auto content_size = ZSTD_getFrameContentSize(frame, remaining);
+    frame_sizes.push_back(static_cast<std::streamsize>(content_size));
+    offset += static_cast<std::streamsize>(compressed_size);
+  }
+  auto frame_size = kBlocksPerFrame * kBlock;
+  auto expected_frame_sizes =
+      std::vector<std::streamsize>(Size(data) / frame_size, frame_size);
+  if (Size(data) % frame_size != 0) {
+    expected_frame_sizes.push_back(Size(data) % frame_size);
+  }
+  EXPECT_EQ(frame_sizes, expected_frame_sizes);
+
+  // the seeds miss whole frames, the tails of frames and scattered blocks
+  for (const auto &seed_data : {
+           std::string(),
+           data.substr(0, data.size() / 2),
+           data.substr(0, 5 * kBlock) + data.substr(9 * kBlock)})
+  {
+    auto result = PrepareAndSync(data, seed_data, kBlock, kThreads, options);
+    EXPECT_EQ(result.metadata, frames.metadata);
+    EXPECT_EQ(result.compressed, frames.compressed);
+  }
+}
+
+TEST_F(Tests, PrepareStoresIncompressibleBlocksRaw) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 100;
+  static constexpr int kCompressionLevel = 1;  // the level of the zstd codec
+  static constexpr std::streamsize kMinCompressionGainDivisor = 32;
+
+  // the blocks have fewer and fewer zeros among random bytes, so they range
+  // from compressing well to compressing too little to be worth it, and to
+  // only growing by the overhead of their zstd frame
+  auto data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kBlocks * kBlock + kBlock / 2; i++) {
+    auto zeros = 1 + i / kBlock % 20;
+    data += static_cast<char>(random() % zeros == 0 ? 0 : random());
+  }
+
+  // a block is stored raw unless it compresses by at least 1/32 of its size
+  std::streamsize raw_size = 0;
+  std::streamsize compressed_size = 0;
+  auto barely_compressible_blocks = 0;
+  for (std::streamsize offset = 0; offset < Size(data); offset += kBlock) {
+    auto block = data.substr(offset, kBlock);
+    auto size = Size(block);
+    auto block_compressed_size =
+        GetExpectedCompressedSize(block, kCompressionLevel, kBlock);
+    if (block_compressed_size > size - size / kMinCompressionGainDivisor) {
+      raw_size += size;
+      barely_compressible_blocks += block_compressed_size < size ? 1 : 0;
+    } else {
+      compressed_size += block_compressed_size;
+    }
+  }
+  ASSERT_GT(barely_compressible_blocks, 0);
+  ASSERT_GT(compressed_size, 0);
+
+  auto result =
+      PrepareAndSync(data, data.substr(0, Size(data) / 2), kBlock, kThreads);
+  ExpectationCheckMetricVisitor(*result.prepare, {{"//raw_bytes_", raw_size}});
+  EXPECT_EQ(Size(result.compressed), raw_size + compressed_size);
+}
+
+TEST_F(Tests, PrepareWithDeduplication) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kDistinctBlocks = 8;
+  static constexpr int kBlocks = 100;
+
+  // random blocks do not compress, so only deduplication makes the compressed
+  // output smaller than the data
+  auto random = std::default_random_engine(kBlock);
+  auto blocks = std::vector<std::string>(kDistinctBlocks);
+  for (auto &block : blocks) {
+    for (auto i = 0; i < kBlock; i++) {
+      block += static_cast<char>(random());
+    }
+  }
+
+  auto data = std::string();
+  auto seen_blocks = std::set<int64_t>();
+  std::streamsize deduplicated_size = 0;
+  for (auto i = 0; i < kBlocks; i++) {
+    auto index = random() % kDistinctBlocks;
+    if (!seen_blocks.insert(index).second) {
+      deduplicated_size += kBlock;
+    }
+    data += blocks[index];
+  }
+  // the trailing partial block is never deduplicated
+  data += blocks[0].substr(0, kBlock / 2);
+
+  auto options = PrepareOptions{.deduplicate = true};
+  auto single = PrepareAndSync(data, "", kBlock, 1, options);
+  EXPECT_EQ(Size(single.compressed), kDistinctBlocks * kBlock + kBlock / 2);
+
+  // the canonical blocks are retrieved or found in the seed, either way their
+  // duplicates are copied from them
+  for (const auto &seed : {std::string(), blocks[1], data.substr(kBlock * 7)}) {
+    auto result = PrepareAndSync(data, seed, kBlock, kThreads, options);
+    EXPECT_EQ(result.metadata, single.metadata);
+    EXPECT_EQ(result.compressed, single.compressed);
+    ExpectationCheckMetricVisitor(
+        *result.prepare,
+        {{"//deduplicated_bytes_", deduplicated_size}});
+    ExpectationCheckMetricVisitor(
+        *result.sync,
+        {{"//deduplicated_bytes_", deduplicated_size}});
+  }
+}
+
+TEST_F(Tests, PrepareWithZeroBlocks) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 100;
+
+  // every other block is zeros, and so is the trailing partial block
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  std::streamsize zero_size = 0;
+  for (auto i = 0; i < kBlocks; i++) {
+    if (i % 2 == 0) {
+      data += std::string(kBlock, 0);
+      zero_size += kBlock;
+    } else {
+      for (auto j = 0; j < kBlock; j++) {
+        data += static_cast<char>(random());
+      }
+    }
+  }
+  data += std::string(kBlock / 2, 0);
+  zero_size += kBlock / 2;
+
+  // blocks of zeros are not deduplicated, they take no space already
+  for (auto deduplicate : {false, true}) {
+    auto result = PrepareAndSync(
+        data,
+        "",
+        kBlock,
+        kThreads,
+        {.deduplicate = deduplicate, .zero_blocks = true});
+    ExpectationCheckMetricVisitor(
+        *result.prepare,
+        {{"//zero_bytes_", zero_size}, {"//deduplicated_bytes_", 0}});
+
+    // the random blocks are stored raw
+    auto pzst_size = Size(data) - zero_size;
+    EXPECT_EQ(Size(result.compressed), pzst_size);
+
+    ExpectationCheckMetricVisitor(
+        *result.sync,
+        {{"//zero_bytes_", zero_size},
+         {"//deduplicated_bytes_", 0},
+         {"//downloaded_bytes_", pzst_size}});
+  }
+}
+
+TEST_F(Tests, PrepareWithCompressedMetadata) {  // NOLINT
+  // enough blocks for several chunks (of 64K blocks) of each compressed column
+  static constexpr std::streamsize kBlock = 16;
+  static constexpr int kBlocks = 140'000;
+
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks * kBlock + kBlock / 2; i++) {
+    data += static_cast<char>('a' + random() % 4);
+  }
+  auto seed_data = data.substr(0, data.size() / 2);
+
+  auto plain = PrepareAndSync(data, seed_data, kBlock, kThreads);
+  auto compressed = PrepareAndSync(
+      data,
+      seed_data,
+      kBlock,
+      kThreads,
+      {.compress_metadata = true});
+
+  // the compressed offsets and block encodings shrink the most
+  EXPECT_LT(Size(compressed.metadata), Size(plain.metadata) * 3 / 4);
+
+  // the blocks of compressed metadata are reused just the same
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  auto previous_kysync_path = tmp.GetPath() / "previous.bin.kysync";
+  auto previous_pzst_path = tmp.GetPath() / "previous.bin.pzst";
+  WriteFile(data_path, data);
+  WriteFile(previous_kysync_path, compressed.metadata);
+  WriteFile(previous_pzst_path, compressed.compressed);
+
+  auto prepare = PrepareCommand::Create(
+      data_path,
+      tmp.GetPath() / "data.bin.kysync",
+      tmp.GetPath() / "data.bin.pzst",
+      kBlock,
+      kThreads,
+      {.previous_metadata_path = previous_kysync_path,
+       .previous_compressed_path = previous_pzst_path});
+  prepare->Run();
+  ExpectationCheckMetricVisitor(*prepare, {{"//reused_bytes_", Size(data)}});
+}
+
+TEST_F(Tests, SyncWithTruncatedStrongChecksums) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 1000;
+
+  // every 10th block of the seed differs, so the other blocks are reused in
+  // runs of 9 next to each other
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks * kBlock; i++) {
+    data += static_cast<char>(random());
+  }
+  auto seed_data = data;
+  for (auto i = 0; i < kBlocks; i += 10) {
+    seed_data[i * kBlock] ^= 1;
+  }
+
+  std::streamsize previous_kysync_size = 0;
+  for (auto strong_checksum_size : {16, 8, 4}) {
+    auto result = PrepareAndSync(
+        data,
+        seed_data,
+        kBlock,
+        kThreads,
+        {.strong_checksum_size = strong_checksum_size});
+
+    auto kysync_size = Size(result.metadata);
+    if (previous_kysync_size > 0) {
+      EXPECT_LT(kysync_size, previous_kysync_size);
+    }
+    previous_kysync_size = kysync_size;
+
+    ExpectationCheckMetricVisitor(
+        *result.sync,
+        {{"//reused_bytes_", kBlocks / 10 * 9 * kBlock}});
+  }
+}
+
+TEST_F(Tests, SyncSkipsOnlyPastAcceptedMatches) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 10;
+  static constexpr std::streamsize kShift = 100;
+
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks * kBlock; i++) {
+    data += static_cast<char>(random());
+  }
+
+  // the second block starts with the end of the eighth one, so the seed has
+  // the eighth block (without the ninth after it) just before the second,
+  // third and fourth blocks
+  data.replace(
+      kBlock,
+      kBlock - kShift,
+      data,
+      7 * kBlock + kShift,
+      kBlock - kShift);
+  auto seed_data =
+      data.substr(7 * kBlock, kShift) + data.substr(kBlock, 3 * kBlock);
+
+  // the eighth block is rejected without its neighbour, and the scan does not
+  // skip the second block that it overlaps
+  auto result = PrepareAndSync(
+      data,
+      seed_data,
+      kBlock,
+      kThreads,
+      {.strong_checksum_size = 4});
+  ExpectationCheckMetricVisitor(
+      *result.sync,
+      {{"//reused_bytes_", 3 * kBlock}});
+}
+
+TEST_F(Tests, SyncLastBlockFromLongerSeed) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 10;
+
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks * kBlock + kBlock / 2; i++) {
+    data += static_cast<char>(random());
+  }
+
+  // the checksums of the last block cover the zeros after it, which the seed
+  // has as well
+  auto seed_data = data + std::string(kBlock, 0);
+
+  auto result = PrepareAndSync(data, seed_data, kBlock, kThreads);
+  ExpectationCheckMetricVisitor(
+      *result.sync,
+      {{"//reused_bytes_", Size(data)}});
+}
+
+TEST_F(Tests, SyncLooksUpLastBlockOfWeakChecksum) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 4;
+
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks * kBlock; i++) {
+    data += static_cast<char>(random() % 64);
+  }
+
+  // the last block differs from the second one in three bytes, by +1, -2 and
+  // +1, which leaves the weak checksum the same
+  auto last = data.substr(kBlock, kBlock);
+  last[10]++;
+  last[11] -= 2;
+  last[12]++;
+  data.replace((kBlocks - 1) * kBlock, kBlock, last);
+  ASSERT_NE(data.substr(kBlock, kBlock), last);
+  ASSERT_EQ(
+      WeakChecksum(data.data() + kBlock, kBlock),
+      WeakChecksum(last.data(), kBlock));
+
+  // only the last of the two blocks is indexed, so the second one is
+  // downloaded even though the seed has it
+  auto result = PrepareAndSync(data, data, kBlock, kThreads);
+  ExpectationCheckMetricVisitor(
+      *result.sync,
+      {{"//reused_bytes_", (kBlocks - 1) * kBlock}});
+}
+
+TEST_F(Tests, SyncInWindows) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kBlocks = 200;
+  static constexpr int kBlocksPerFrame = 4;
+
+  // every 5th block is zeros and every 7th a duplicate of an earlier block,
+  // and every 3rd block of the seed differs
+  auto random = std::default_random_engine(kBlock);
+  auto data = std::string();
+  for (auto i = 0; i < kBlocks; i++) {
+    if (i % 5 == 0) {
+      data += std::string(kBlock, 0);
+    } else if (i % 7 == 0) {
+      data += data.substr(i / 2 * kBlock, kBlock);
+    } else {
+      for (auto j = 0; j < kBlock; j++) {
+        data += static_cast<char>(random());
+      }
+    }
+  }
+  data += std::string(kBlock / 2, 'x');
+  auto seed_data = data;
+  for (auto i = 0; i < kBlocks; i += 3) {
+    seed_data[i * kBlock] ^= 1;
+  }
+  seed_data.back() ^= 1;
+
+  auto seed_blocks = std::set<std::string>();
+  for (auto i = 0; i < kBlocks; i++) {
+    seed_blocks.insert(seed_data.substr(i * kBlock, kBlock));
+  }
+
+  for (const auto &options : std::vector<PrepareOptions>{
+           {.deduplicate = true, .zero_blocks = true},
+           {.deduplicate = true,
+            .zero_blocks = true,
+            .compress_metadata = true},
+           {.blocks_per_frame = kBlocksPerFrame, .compress_metadata = true}})
+  {
+    // each content the seed has is reused once, unless it is zeros, when the
+    // blocks are deduplicated (otherwise each window reuses its own copy)
+    auto seen_blocks = std::set<std::string>{std::string(kBlock, 0)};
+    std::streamsize reused_bytes = 0;
+    for (auto i = 0; i < kBlocks; i++) {
+      auto block = data.substr(i * kBlock, kBlock);
+      if (seen_blocks.insert(block).second && seed_blocks.contains(block)) {
+        reused_bytes += kBlock;
+      }
+    }
+
+    // the windows are rounded up to whole frames, and the last one may be
+    // partial (the partial block of the data makes kBlocks + 1 blocks)
+    for (std::streamsize window_blocks : {0, 1, 7, 64, kBlocks + 1}) {
+      auto result = PrepareAndSync(
+          data,
+          seed_data,
+          kBlock,
+          kThreads,
+          options,
+          window_blocks);
+
+      auto frame_blocks = options.blocks_per_frame;
+      auto rounded_blocks =
+          (window_blocks + frame_blocks - 1) / frame_blocks * frame_blocks;
+      auto windows = rounded_blocks == 0 || rounded_blocks > kBlocks
+                         ? 1
+                         : (kBlocks + rounded_blocks) / rounded_blocks;
+      ExpectationCheckMetricVisitor(
+          *result.sync,
+          {{"//loaded_windows_", windows}});
+      if (options.deduplicate) {
+        ExpectationCheckMetricVisitor(
+            *result.sync,
+            {{"//reused_bytes_", reused_bytes}});
+      }
+    }
+  }
+}
+
+TEST_F(Tests, PrepareReusesPreviousVersion) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kRecords = 10'000;
+
+  auto previous_data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kRecords; i++) {
+    previous_data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  // the blocks that the changes do not touch keep their offsets
+  auto data = previous_data;
+  data.replace(kBlock * 10 + 7, 5, "*****");
+  data.replace(kBlock * 50, kBlock, kBlock, '*');
+  data += "appended\n";
+
+  auto previous = PrepareAndSync(previous_data, "", kBlock, kThreads);
+  auto fresh = PrepareAndSync(data, previous_data, kBlock, kThreads);
+
+  auto tmp = ky::TempPath();
+  auto previous_kysync_path = tmp.GetPath() / "previous_data.bin.kysync";
+  auto previous_pzst_path = tmp.GetPath() / "previous_data.bin.pzst";
+  auto data_path = tmp.GetPath() / "data.bin";
+  auto kysync_path = tmp.GetPath() / "data.bin.kysync";
+  auto pzst_path = tmp.GetPath() / "data.bin.pzst";
+
+  WriteFile(previous_kysync_path, previous.metadata);
+  WriteFile(previous_pzst_path, previous.compressed);
+  WriteFile(data_path, data);
+
+  auto prepare = PrepareCommand::Create(
+      data_path,
+      kysync_path,
+      pzst_path,
+      kBlock,
+      kThreads,
+      {.previous_metadata_path = previous_kysync_path,
+       .previous_compressed_path = previous_pzst_path});
+  prepare->Run();
+
+  // all but the two changed blocks and the last block are reused, and the
+  // result is the same as preparing from scratch
+  auto previous_block_count = Size(previous_data) / kBlock;
+  ExpectationCheckMetricVisitor(
+      *prepare,
+      {{"//reused_bytes_", (previous_block_count - 2) * kBlock}});
+  EXPECT_EQ(ReadFile(kysync_path), fresh.metadata);
+  EXPECT_EQ(ReadFile(pzst_path), fresh.compressed);
+}
+
+TEST_F(Tests, PrepareSeveralBlockSizes) {  // NOLINT
+  static constexpr int kRecords = 10'000;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kRecords);
+  for (auto i = 0; i < kRecords; i++) {
+    data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  WriteFile(data_path, data);
+
+  // the block sizes do not divide each other, so the chunks are aligned to
+  // their least common multiple
+  auto variants = std::vector<PrepareVariant>();
+  for (std::streamsize block_size : {512, 1000, 4096}) {
+    auto name = "data.bin." + std::to_string(block_size);
+    variants.push_back(
+        {.block_size = block_size,
+         .output_ksync_file_path = tmp.GetPath() / (name + ".kysync"),
+         .output_compressed_file_path = tmp.GetPath() / (name + ".pzst")});
+  }
+
+  PrepareCommand::Create(data_path, variants, kThreads)->Run();
+
+  // each variant is the same as if it was prepared on its own
+  for (const auto &variant : variants) {
+    auto result = PrepareAndSync(data, "", variant.block_size, kThreads);
+    EXPECT_EQ(ReadFile(variant.output_ksync_file_path), result.metadata);
+    EXPECT_EQ(ReadFile(variant.output_compressed_file_path), result.compressed);
+  }
+}
+
+TEST_F(Tests, PrepareFromStream) {  // NOLINT
+  static constexpr int kRecords = 10'000;
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr std::streamsize kDictionarySize = 4096;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kRecords);
+  for (auto i = 0; i < kRecords; i++) {
+    data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  auto options = PrepareOptions{.dictionary_size = kDictionarySize};
+  auto file = PrepareAndSync(data, "", kBlock, kThreads, options);
+
+  auto tmp = ky::TempPath();
+  auto stream_kysync_path = tmp.GetPath() / "stream.kysync";
+  auto stream_pzst_path = tmp.GetPath() / "stream.pzst";
+
+  // the input fits in the first round, so the dictionary is trained from the
+  // same samples and the outputs are the same as for the file
+  auto input = std::istringstream(data);
+  PrepareCommand::Create(
+      input,
+      {{.block_size = kBlock,
+        .output_ksync_file_path = stream_kysync_path,
+        .output_compressed_file_path = stream_pzst_path}},
+      kThreads,
+      options)
+      ->Run();
+
+  EXPECT_EQ(ReadFile(stream_kysync_path), file.metadata);
+  EXPECT_EQ(ReadFile(stream_pzst_path), file.compressed);
+}
+
+TEST_F(Tests, PrepareFromReader) {  // NOLINT
+  static constexpr int kRecords = 10'000;
+  static constexpr std::streamsize kBlock = 1024;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kRecords);
+  for (auto i = 0; i < kRecords; i++) {
+    data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  auto file = PrepareAndSync(data, "", kBlock, kThreads);
+
+  auto tmp = ky::TempPath();
+  auto memory_kysync_path = tmp.GetPath() / "memory.kysync";
+  auto memory_pzst_path = tmp.GetPath() / "memory.pzst";
+
+  PrepareCommand::Create(
+      CreateMemoryReaderUri(data),
+      memory_kysync_path,
+      memory_pzst_path,
+      kBlock,
+      kThreads)
+      ->Run();
+
+  EXPECT_EQ(ReadFile(memory_kysync_path), file.metadata);
+  EXPECT_EQ(ReadFile(memory_pzst_path), file.compressed);
+}
+
+TEST_F(Tests, PrepareResumesFromCheckpoint) {  // NOLINT
+  static constexpr std::streamsize kBlock = 4096;
+  static constexpr std::streamsize kRoundSize = 16 * 1024 * 1024;
+  static constexpr std::streamsize kHalfSize = 12 * 1024 * 1024;
+
+  // the second half repeats the first one, so that the duplicates of the
+  // resumed part refer to blocks prepared before the interruption
+  auto half = std::string();
+  auto random = std::default_random_engine(kHalfSize);
+  for (auto i = 0; Size(half) < kHalfSize; i++) {
+    half += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+  half.resize(kHalfSize);
+  auto data = half + half + "the end";
+
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  auto kysync_path = tmp.GetPath() / "data.bin.kysync";
+  auto pzst_path = tmp.GetPath() / "data.bin.pzst";
+  auto resumed_kysync_path = tmp.GetPath() / "resumed.kysync";
+  auto resumed_pzst_path = tmp.GetPath() / "resumed.pzst";
+  auto checkpoint_path = tmp.GetPath() / "resumed.kysync.checkpoint";
+  WriteFile(data_path, data);
+
+  auto options = PrepareOptions{.deduplicate = true, .checkpoint = true};
+  auto variants = std::vector<PrepareVariant>{
+      {.block_size = kBlock,
+       .output_ksync_file_path = resumed_kysync_path,
+       .output_compressed_file_path = resumed_pzst_path}};
+  auto prepare = [&]() {
+    return PrepareCommand::Create(data_path, variants, 1, options);
+  };
+
+  // the metadata cannot be written over a directory, so the prepare stops
+  // after every round is in the checkpoint
+  std::filesystem::create_directory(resumed_kysync_path);
+  EXPECT_DEATH(prepare()->Run(), "unable to write to");
+  std::filesystem::remove(resumed_kysync_path);
+  ASSERT_TRUE(std::filesystem::exists(checkpoint_path));
+
+  // with one thread the rounds are 16MB, cutting the checkpoint short drops
+  // the second (last) one, which is then prepared again
+  auto checkpoint = ReadFile(checkpoint_path);
+  checkpoint.pop_back();
+  WriteFile(checkpoint_path, checkpoint);
+
+  auto resumed = prepare();
+  resumed->Run();
+  ExpectationCheckMetricVisitor(*resumed, {{"//resumed_bytes_", kRoundSize}});
+  EXPECT_FALSE(std::filesystem::exists(checkpoint_path));
+
+  PrepareCommand::Create(
+      data_path,
+      kysync_path,
+      pzst_path,
+      kBlock,
+      kThreads,
+      {.deduplicate = true})
+      ->Run();
+
+  EXPECT_EQ(ReadFile(resumed_kysync_path), ReadFile(kysync_path));
+  EXPECT_EQ(ReadFile(resumed_pzst_path), ReadFile(pzst_path));
+
+  // a checkpoint is not resumed over a compressed output that was deleted,
+  // cut short or changed since
+  auto pzst_size = std::filesystem::file_size(resumed_pzst_path);
+  for (const auto &damage : std::vector<std::function<void()>>{
+           [&]() { std::filesystem::remove(resumed_pzst_path); },
+           [&]() {
+             std::filesystem::resize_file(resumed_pzst_path, pzst_size / 2);
+           },
+           [&]() {
+             auto pzst = ReadFile(resumed_pzst_path);
+             pzst[pzst.size() / 4] ^= 1;
+             WriteFile(resumed_pzst_path, pzst);
+           }})
+  {
+    std::filesystem::remove(resumed_kysync_path);
+    std::filesystem::create_directory(resumed_kysync_path);
+    EXPECT_DEATH(prepare()->Run(), "unable to write to");
+    std::filesystem::remove(resumed_kysync_path);
+    damage();
+
+    auto damaged = prepare();
+    damaged->Run();
+    ExpectationCheckMetricVisitor(*damaged, {{"//resumed_bytes_", 0}});
+    EXPECT_EQ(ReadFile(resumed_kysync_path), ReadFile(kysync_path));
+    EXPECT_EQ(ReadFile(resumed_pzst_path), ReadFile(pzst_path));
+  }
+
+  // a checkpoint of another input of the same size is not resumed
+  std::filesystem::remove(resumed_kysync_path);
+  std::filesystem::create_directory(resumed_kysync_path);
+  EXPECT_DEATH(prepare()->Run(), "unable to write to");
+  std::filesystem::remove(resumed_kysync_path);
+  WriteFile(data_path, half + half + "The end");
+
+  auto changed = prepare();
+  changed->Run();
+  ExpectationCheckMetricVisitor(*changed, {{"//resumed_bytes_", 0}});
+
+  // a stream cannot be told apart from another one
+  auto input = std::istringstream(data);
+  EXPECT_DEATH(
+      PrepareCommand::Create(input, variants, 1, options),
+      "cannot be resumed for a stream");
+}
+
+TEST_F(Tests, AdviseBlockSizes) {  // NOLINT
+  static constexpr int kRecords = 10'000;
+  static constexpr std::streamsize kNoisySize = 64 * 1024;
+  static constexpr std::streamsize kMaxSamples = 1'000'000;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kRecords);
+  for (auto i = 0; i < kRecords; i++) {
+    data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  // these blocks compress a little, but not enough for prepare to keep them
+  // compressed
+  data.resize((Size(data) + 2047) / 2048 * 2048, '\n');
+  for (auto i = 0; i < kNoisySize; i++) {
+    data += static_cast<char>(random() % 11 == 0 ? 0 : random());
+  }
+
+  auto tmp = ky::TempPath();
+  auto data_path = tmp.GetPath() / "data.bin";
+  auto kysync_path = tmp.GetPath() / "data.bin.kysync";
+  auto pzst_path = tmp.GetPath() / "data.bin.pzst";
+  auto same_seed_path = tmp.GetPath() / "same_seed.bin";
+  auto empty_seed_path = tmp.GetPath() / "empty_seed.bin";
+  auto sparse_seed_path = tmp.GetPath() / "sparse_seed.bin";
+
+  // every other block of 2048 bytes differs, which leaves the blocks of that
+  // size that are the same without a neighbour
+  auto sparse_seed = data;
+  for (auto i = 2048; i < Size(sparse_seed); i += 2 * 2048) {
+    sparse_seed[i] ^= 1;
+  }
+
+  WriteFile(data_path, data);
+  WriteFile(same_seed_path, data);
+  WriteFile(empty_seed_path, "");
+  WriteFile(sparse_seed_path, sparse_seed);
+
+  auto all_options = std::vector<PrepareOptions>{
+      {},
+      {.compress_metadata = true, .strong_checksum_size = 4}};
+  for (const auto &options : all_options) {
+    // with enough samples every block is sampled, and with a stride of 1 the
+    // seeds are scanned entirely, so the predicted sizes are exact
+    auto advise = AdviseCommand::Create(
+        data_path,
+        {same_seed_path, empty_seed_path, sparse_seed_path},
+        {512, 2048},
+        kMaxSamples,
+        1,
+        kThreads,
+        options);
+    advise->Run();
+
+    const auto &advice = advise->GetAdvice();
+    ASSERT_EQ(advice.size(), 6);
+
+    for (const auto &a : advice) {
+      auto prepare = PrepareCommand::Create(
+          data_path,
+          kysync_path,
+          pzst_path,
+          a.block_size,
+          kThreads,
+          options);
+      prepare->Run();
+
+      // the noisy blocks are stored raw
+      ExpectationCheckMetricVisitor(*prepare, {{"//raw_bytes_", kNoisySize}});
+
+      // the length of the hash in the header varies by a few bytes
+      EXPECT_NEAR(a.metadata_size, Size(kysync_path), 16);
+
+      if (a.seed_file_path == same_seed_path) {
+        EXPECT_EQ(a.reused_size, Size(data));
+        EXPECT_EQ(a.downloaded_size, 0);
+      } else if (a.seed_file_path == empty_seed_path) {
+        EXPECT_EQ(a.reused_size, 0);
+        EXPECT_EQ(a.downloaded_size, Size(pzst_path));
+      } else {
+        // with short strong checksums sync does not reuse the blocks without
+        // a neighbour, and neither does the prediction
+        auto result = PrepareAndSync(
+            data,
+            sparse_seed,
+            a.block_size,
+            kThreads,
+            options);
+        ExpectationCheckMetricVisitor(
+            *result.sync,
+            {{"//reused_bytes_", a.reused_size}});
+        EXPECT_EQ(
+            a.reused_size == 0,
+            options.strong_checksum_size < 8 && a.block_size == 2048);
+      }
+    }
+  }
+}
+
+TEST_F(Tests, SyncWithEachCodec) {  // NOLINT
+  static constexpr std::streamsize kBlock = 1024;
+  static constexpr int kRecords = 10'000;
+
+  auto data = std::string();
+  auto random = std::default_random_engine(kBlock);
+  for (auto i = 0; i < kRecords; i++) {
+    data += std::to_string(i) + ": " + std::to_string(random()) + "\n";
+  }
+
+  for (const auto *codec : {"zstd", "lz4", "none"}) {
+    SCOPED_TRACE(codec);
+    PrepareAndSync(
+        data,
+        data.substr(data.size() / 3),
+        kBlock,
+        kThreads,
+        {.codec = Codec::ParseType(codec)});
+  }
+}
+
 TEST(Tests2, MetadataRoundtrip) {  // NOLINT
   auto block = 4;
   std::string data = "0123456789";
@@ -0,0 +1,265 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <ky/timer.h>
+#include <kysync/test_common/test_environment.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "performance_test_fixture.h"
+
+// Micro benchmarks of the per-block compression and decompression paths used
+// by prepare and sync. Each benchmark reports the average cost of one block in
+// the perf log, so that allocating a fresh zstd context per block can be
+// compared to reusing one context per worker, and one frame per block can be
+// compared to frames of several blocks.
+
+namespace kysync {
+
+TestEnvironment *test_environment = dynamic_cast<TestEnvironment *>(  // NOLINT
+    testing::AddGlobalTestEnvironment(new TestEnvironment()));        // NOLINT
+
+class CompressionBenchmarks : public PerformanceTestFixture {
+protected:
+  static constexpr int kCompressionLevel = 1;
+
+  std::streamsize block_size_ =
+      TestEnvironment::GetEnv("TEST_BLOCK_SIZE", 16'384);
+  int block_count_ = TestEnvironment::GetEnvInt("TEST_BLOCK_COUNT", 1'024);
+  int blocks_per_frame_ =
+      TestEnvironment::GetEnvInt("TEST_BLOCKS_PER_FRAME", 16);
+  std::streamsize max_compressed_block_size_ =
+      static_cast<std::streamsize>(ZSTD_compressBound(block_size_));
+
+  std::vector<char> data_;
+  std::vector<char> compressed_data_;
+  std::vector<std::streamsize> compressed_sizes_;
+  std::vector<char> output_;
+
+  void SetUp() override {
+    PerformanceTestFixture::SetUp();
+
+    // a small alphabet makes the data about as compressible as text
+    auto random = std::default_random_engine(block_size_);
+    data_.resize(block_count_ * block_size_);
+    for (auto &c : data_) {
+      c = static_cast<char>('a' + random() % 16);
+    }
+
+    compressed_data_.resize(block_count_ * max_compressed_block_size_);
+    compressed_sizes_.resize(block_count_);
+    output_.resize(blocks_per_frame_ * block_size_);
+  }
+
+  [[nodiscard]] const char *GetBlock(int block_index) const {
+    return data_.data() + block_index * block_size_;
+  }
+
+  [[nodiscard]] char *GetCompressedBlock(int block_index) {
+    return compressed_data_.data() + block_index * max_compressed_block_size_;
+  }
+
+  void Measure(
+      const std::string &name,
+      const std::function<void(int /*block_index*/)> &f) {
+    auto beg = ky::timer::Now();
+    for (int block_index = 0; block_index < block_count_; block_index++) {
+      f(block_index);
+    }
+    auto end = ky::timer::Now();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg);
+    auto ns_per_block = ns.count() / block_count_;
+
+    std::streamsize compressed_bytes = 0;
+    for (auto compressed_size : compressed_sizes_) {
+      compressed_bytes += compressed_size;
+    }
+
+    auto &perf_log = test_environment->GetPerfLog();
+    perf_log << std::endl
+             << "name=" << name << std::endl
+             << "block_size=" << block_size_ << std::endl
+             << "block_count=" << block_count_ << std::endl
+             << "blocks_per_frame=" << blocks_per_frame_ << std::endl
+             << "compressed_bytes=" << compressed_bytes << std::endl
+             << "ns_per_block=" << ns_per_block << std::endl;
+    LOG(INFO) << name << ": " << ns_per_block << " ns per block";
+  }
+
+  void Compress(int block_index, std::streamsize compressed_size) {
+    CHECK(!ZSTD_isError(compressed_size)) << ZSTD_getErrorName(compressed_size);
+    compressed_sizes_[block_index] = compressed_size;
+  }
+
+  void Decompress(std::streamsize decompressed_size) {
+    CHECK(!ZSTD_isError(decompressed_size))
+        << ZSTD_getErrorName(decompressed_size);
+    CHECK_EQ(decompressed_size, block_size_);
+  }
+
+  [[nodiscard]] int GetFrameBlockCount(int frame_block_index) const {
+    return std::min(blocks_per_frame_, block_count_ - frame_block_index);
+  }
+};
+
+TEST_F(CompressionBenchmarks, Compress) {  // NOLINT
+  Measure("zstd_compress", [this](int block_index) {
+    Compress(
+        block_index,
+        // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+        ZSTD_compress(
+            GetCompressedBlock(block_index),
+            max_compressed_block_size_,
+            GetBlock(block_index),
+            block_size_,
+            kCompressionLevel));
+  });
+
+  auto context = std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>(
+      ZSTD_createCCtx(),
+      &ZSTD_freeCCtx);
+  ZSTD_CCtx_setParameter(
+      context.get(),
+      ZSTD_c_compressionLevel,
+      kCompressionLevel);
+
+  Measure("zstd_compress_with_context", [this, &context](int block_index) {
+    Compress(
+        block_index,
+        // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+        ZSTD_compress2(
+            context.get(),
+            GetCompressedBlock(block_index),
+            max_compressed_block_size_,
+            GetBlock(block_index),
+            block_size_));
+  });
+}
+
+TEST_F(CompressionBenchmarks, Decompress) {  // NOLINT
+  for (int block_index = 0; block_index < block_count_; block_index++) {
+    Compress(
+        block_index,
+        // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+        ZSTD_compress(
+            GetCompressedBlock(block_index),
+            max_compressed_block_size_,
+            GetBlock(block_index),
+            block_size_,
+            kCompressionLevel));
+  }
+
+  Measure("zstd_decompress", [this](int block_index) {
+    // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+    Decompress(ZSTD_decompress(
+        output_.data(),
+        block_size_,
+        GetCompressedBlock(block_index),
+        compressed_sizes_[block_index]));
+  });
+
+  auto context = std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>(
+      ZSTD_createDCtx(),
+      &ZSTD_freeDCtx);
+
+  Measure("zstd_decompress_with_context", [this, &context](int block_index) {
+    // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+    Decompress(ZSTD_decompressDCtx(
+        context.get(),
+        output_.data(),
+        block_size_,
+        GetCompressedBlock(block_index),
+        compressed_sizes_[block_index]));
+  });
+}
+
+TEST_F(CompressionBenchmarks, Frames) {  // NOLINT
+  auto compression_context =
+      std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>(
+          ZSTD_createCCtx(),
+          &ZSTD_freeCCtx);
+  ZSTD_CCtx_setParameter(
+      compression_context.get(),
+      ZSTD_c_compressionLevel,
+      kCompressionLevel);
+
+  // the blocks of a frame are flushed one by one, just like in prepare
+  std::streamsize frame_compressed_size = 0;
+  Measure("zstd_compress_frames", [&](int block_index) {
+    auto frame_block_index = block_index - block_index % blocks_per_frame_;
+    auto frame_block_count = GetFrameBlockCount(frame_block_index);
+    if (block_index == frame_block_index) {
+      ZSTD_CCtx_reset(compression_context.get(), ZSTD_reset_session_only);
+      ZSTD_CCtx_setPledgedSrcSize(
+          compression_context.get(),
+          frame_block_count * block_size_);
+      frame_compressed_size = 0;
+    }
+
+    auto input = ZSTD_inBuffer{
+        GetBlock(block_index),
+        static_cast<size_t>(block_size_),
+        0};
+    auto output = ZSTD_outBuffer{
+        GetCompressedBlock(frame_block_index) + frame_compressed_size,
+        static_cast<size_t>(
+            frame_block_count * max_compressed_block_size_ -
+            frame_compressed_size),
+        0};
+    auto end_of_frame =
+        block_index + 1 == frame_block_index + frame_block_count;
+    auto remaining = ZSTD_compressStream2(
+        compression_context.get(),
+        &output,
+        &input,
+        end_of_frame ? ZSTD_e_end : ZSTD_e_flush);
+    CHECK(!ZSTD_isError(remaining)) << ZSTD_getErrorName(remaining);
+    CHECK_EQ(remaining, 0);
+
+    // NOLINTNEXTLINE(cppcoreguidelines-narrowing-conversions)
+    Compress(block_index, output.pos);
+    frame_compressed_size += compressed_sizes_[block_index];
+  });
+
+  auto decompression_context =
+      std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>(
+          ZSTD_createDCtx(),
+          &ZSTD_freeDCtx);
+
+  // whole frames are decoded at once, at their first block
+  Measure("zstd_decompress_frames", [&](int block_index) {
+    if (block_index % blocks_per_frame_ != 0) {
+      return;
+    }
+
+    auto frame_block_count = GetFrameBlockCount(block_index);
+    frame_compressed_size = 0;
+    for (auto i = 0; i < frame_block_count; i++) {
+      frame_compressed_size += compressed_sizes_[block_index + i];
+    }
+
+    ZSTD_DCtx_reset(decompression_context.get(), ZSTD_reset_session_only);
+    auto input = ZSTD_inBuffer{
+        GetCompressedBlock(block_index),
+        static_cast<size_t>(frame_compressed_size),
+        0};
+    auto output = ZSTD_outBuffer{
+        output_.data(),
+        static_cast<size_t>(frame_block_count * block_size_),
+        0};
+    auto result = ZSTD_decompressStream(
+        decompression_context.get(),
+        &output,
+        &input);
+    CHECK_EQ(result, 0) << ZSTD_getErrorName(result);
+    CHECK_EQ(output.pos, output.size);
+  });
+}
+
+}  // namespace kysync
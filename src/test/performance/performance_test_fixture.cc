@@ -4,6 +4,8 @@
 #include <ky/observability/observer.h>
 #include <kysync/test_common/test_environment.h>
 
+#include <string>
+
 namespace kysync {
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
@@ -15,6 +17,21 @@ void PerformanceTestFixture::FlushCaches() {
                    "sudo sh -c \"/usr/bin/echo 3 > /proc/sys/vm/drop_caches\"");
 }
 
+std::streamsize PerformanceTestFixture::GetPeakMemory() {
+  auto status = std::ifstream("/proc/self/status");
+  for (std::string line; std::getline(status, line);) {
+    if (line.starts_with("VmHWM:")) {
+      return std::stoll(line.substr(line.find(':') + 1));
+    }
+  }
+  return 0;
+}
+
+void PerformanceTestFixture::ResetPeakMemory() {
+  // see "clear_refs" in `man 5 proc`
+  std::ofstream("/proc/self/clear_refs") << "5";
+}
+
 void PerformanceTestFixture::Run(Command &&command) {
   auto monitor = ky::observability::Observer(command);
 
@@ -16,6 +16,13 @@ protected:
 
 public:
   static void FlushCaches();
+
+  /**
+   * The peak resident memory of the process in KiB since the last
+   * `ResetPeakMemory` (0 where it is not known, i.e. outside of linux).
+   */
+  static std::streamsize GetPeakMemory();
+  static void ResetPeakMemory();
 };
 
 }  // namespace kysync
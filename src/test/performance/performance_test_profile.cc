@@ -10,25 +10,33 @@ PerformanceTestProfile::PerformanceTestProfile(
     std::streamsize seed_data_size,
     std::streamsize fragment_size,
     std::streamsize block_size,
+    std::streamsize dictionary_size,
+    int blocks_per_frame,
+    std::string codec,
     int blocks_in_batch,
     int similarity,
     int threads,
     bool compression,
     bool http,
     bool zsync,
-    bool flush_caches)
+    bool flush_caches,
+    bool wide_seed_offsets)
     : tag(std::move(tag)),
       data_size(data_size),
       seed_data_size(seed_data_size),
       fragment_size(fragment_size),
       block_size(block_size),
+      dictionary_size(dictionary_size),
+      blocks_per_frame(blocks_per_frame),
+      codec(std::move(codec)),
       blocks_in_batch(blocks_in_batch),
       similarity(similarity),
       threads(threads),
       compression(compression),
       http(http),
       zsync(zsync),
-      flush_caches(flush_caches) {}
+      flush_caches(flush_caches),
+      wide_seed_offsets(wide_seed_offsets) {}
 
 PerformanceTestProfile::PerformanceTestProfile()
     : PerformanceTestProfile(
@@ -37,12 +45,16 @@ PerformanceTestProfile::PerformanceTestProfile()
           TestEnvironment::GetEnv("TEST_SEED_DATA_SIZE", -1),
           TestEnvironment::GetEnv("TEST_FRAGMENT_SIZE", 123'456),
           TestEnvironment::GetEnv("TEST_BLOCK_SIZE", 16'384),
+          TestEnvironment::GetEnv("TEST_DICTIONARY_SIZE", 0),
+          TestEnvironment::GetEnvInt("TEST_BLOCKS_PER_FRAME", 1),
+          TestEnvironment::GetEnv("TEST_CODEC", std::string("zstd")),
           TestEnvironment::GetEnvInt("TEST_BLOCKS_IN_BATCH", 4),
           TestEnvironment::GetEnvInt("TEST_SIMILARITY", 90),
           TestEnvironment::GetEnvInt("TEST_THREADS", 32),
           TestEnvironment::GetEnv("TEST_COMPRESSION", false),
           TestEnvironment::GetEnv("TEST_HTTP", false),
           TestEnvironment::GetEnv("TEST_ZSYNC", false),
-          TestEnvironment::GetEnv("TEST_FLUSH_CACHES", true)) {}
+          TestEnvironment::GetEnv("TEST_FLUSH_CACHES", true),
+          TestEnvironment::GetEnv("TEST_WIDE_SEED_OFFSETS", false)) {}
 
 }  // namespace kysync
\ No newline at end of file
@@ -18,6 +18,12 @@ struct PerformanceTestProfile final {
   // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
   std::streamsize block_size;
   // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
+  std::streamsize dictionary_size;
+  // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
+  int blocks_per_frame;
+  // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
+  std::string codec;
+  // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
   int blocks_in_batch;
   // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
   int similarity;
@@ -31,6 +37,8 @@ struct PerformanceTestProfile final {
   bool zsync;
   // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
   bool flush_caches;
+  // NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
+  bool wide_seed_offsets;
 
   PerformanceTestProfile();
 
@@ -40,13 +48,17 @@ struct PerformanceTestProfile final {
       std::streamsize seed_data_size,
       std::streamsize fragment_size,
       std::streamsize block_size,
+      std::streamsize dictionary_size,
+      int blocks_per_frame,
+      std::string codec,
       int blocks_in_batch,
       int similarity,
       int threads,
       bool compression,
       bool http,
       bool zsync,
-      bool flush_caches);
+      bool flush_caches,
+      bool wide_seed_offsets);
 };
 
 }  // namespace kysync
@@ -14,7 +14,10 @@
 #include <kysync/test_http_servers/http_server.h>
 #include <kysync/test_http_servers/nginx_server.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
 
 #include "performance_test_fixture.h"
@@ -50,31 +53,40 @@ class PerformanceTestExecution {
   std::filesystem::path scratch_path_;
 
   void DumpContext() {
-    perf_log_ << std::endl                         //
-              << PERFLOG(data_file_path_)          //
-              << PERFLOG(seed_data_file_path_)     //
-              << PERFLOG(metadata_file_path_)      //
-              << PERFLOG(compressed_file_path_)    //
-              << PERFLOG(output_file_path_)        //
-              << PERFLOG(profile_.tag)             //
-              << PERFLOG(profile_.data_size)       //
-              << PERFLOG(profile_.seed_data_size)  //
-              << PERFLOG(profile_.fragment_size)   //
-              << PERFLOG(profile_.block_size)      //
-              << PERFLOG(profile_.similarity)      //
-              << PERFLOG(profile_.threads)         //
-              << PERFLOG(profile_.compression)     //
-              << PERFLOG(profile_.http)            //
-              << PERFLOG(profile_.zsync)           //
-              << PERFLOG(profile_.flush_caches);
+    perf_log_ << std::endl                           //
+              << PERFLOG(data_file_path_)            //
+              << PERFLOG(seed_data_file_path_)       //
+              << PERFLOG(metadata_file_path_)        //
+              << PERFLOG(compressed_file_path_)      //
+              << PERFLOG(output_file_path_)          //
+              << PERFLOG(profile_.tag)               //
+              << PERFLOG(profile_.data_size)         //
+              << PERFLOG(profile_.seed_data_size)    //
+              << PERFLOG(profile_.fragment_size)     //
+              << PERFLOG(profile_.block_size)        //
+              << PERFLOG(profile_.dictionary_size)   //
+              << PERFLOG(profile_.blocks_per_frame)  //
+              << PERFLOG(profile_.codec)             //
+              << PERFLOG(profile_.similarity)        //
+              << PERFLOG(profile_.threads)           //
+              << PERFLOG(profile_.compression)       //
+              << PERFLOG(profile_.http)              //
+              << PERFLOG(profile_.zsync)             //
+              << PERFLOG(profile_.flush_caches)      //
+              << PERFLOG(profile_.wide_seed_offsets);
   }
 
 protected:
   void RunAndCollectMetrics(Command &c) {
     auto monitor = ky::observability::Observer(c);
 
+    PerformanceTestFixture::ResetPeakMemory();
     EXPECT_EQ(monitor.Run([&c]() { return c.Run(); }), 0);
 
+    // only the commands that run in this process are measured (not zsync)
+    perf_log_ << "peak_memory_kb=" << PerformanceTestFixture::GetPeakMemory()
+              << std::endl;
+
     monitor.SnapshotPhases([this](auto key, auto value) {
       perf_log_ << key << "=" << value << std::endl;
     });
@@ -125,6 +137,17 @@ protected:
     RunAndCollectMetrics(gen_data);
   }
 
+  // Sync keeps the seed offset of each block in 32 bits when the seed is
+  // below 4 GiB. A hole at the end of the seed makes it use 64 bits instead,
+  // without changing what sync finds in the seed.
+  void ExtendSeedData() {
+    static constexpr std::uintmax_t kWideSeedDataSize = (1ULL << 32) + 1;
+    auto size = std::filesystem::file_size(seed_data_file_path_);
+    std::filesystem::resize_file(
+        seed_data_file_path_,
+        std::max(size, kWideSeedDataSize));
+  }
+
   virtual void Prepare() = 0;
 
   virtual void Sync() = 0;
@@ -169,6 +192,9 @@ public:
     if (IsProfileSupported()) {
       DumpContext();
       GenData();
+      if (profile_.wide_seed_offsets) {
+        ExtendSeedData();
+      }
       if (profile_.flush_caches) {
         PerformanceTestFixture::FlushCaches();
       }
@@ -190,7 +216,10 @@ class KySyncPerformanceTestExecution final : public PerformanceTestExecution {
         GetMetadataFilePath(),
         GetCompressedFilePath(),
         GetProfile().block_size,
-        GetProfile().threads);
+        GetProfile().threads,
+        {.dictionary_size = GetProfile().dictionary_size,
+         .blocks_per_frame = GetProfile().blocks_per_frame,
+         .codec = Codec::ParseType(GetProfile().codec)});
     RunAndCollectMetrics(*prepare);
   }
 
@@ -272,6 +301,47 @@ TEST_F(Performance, KySync) {  // NOLINT
   execution->Execute();
 }
 
+TEST_F(Performance, KySync_Dictionary) {  // NOLINT
+  auto profile = PerformanceTestProfile();
+  profile.compression = true;
+  if (profile.dictionary_size == 0) {
+    profile.dictionary_size = 112'640;  // the default capacity of zstd
+  }
+  auto execution = GetExecution(profile);
+  execution->Execute();
+}
+
+TEST_F(Performance, KySync_Frames) {  // NOLINT
+  auto profile = PerformanceTestProfile();
+  profile.compression = true;
+  if (profile.blocks_per_frame == 1) {
+    profile.blocks_per_frame = 16;
+  }
+  auto execution = GetExecution(profile);
+  execution->Execute();
+}
+
+// compares the end to end sync time per codec, e.g. for links where
+// decompression rather than the network is the bottleneck
+TEST_F(Performance, KySync_Codecs) {  // NOLINT
+  for (const auto *codec : {"zstd", "lz4", "none"}) {
+    auto profile = PerformanceTestProfile();
+    profile.compression = true;
+    profile.codec = codec;
+    auto execution = GetExecution(profile);
+    execution->Execute();
+  }
+}
+
+// compares the peak memory of sync with the seed offsets in 32 bits (as in
+// KySync) and in 64 bits, e.g. on a 1 GB profile with small blocks
+TEST_F(Performance, KySync_WideSeedOffsets) {  // NOLINT
+  auto profile = PerformanceTestProfile();
+  profile.wide_seed_offsets = true;
+  auto execution = GetExecution(profile);
+  execution->Execute();
+}
+
 TEST_F(Performance, KySync_Http) {  // NOLINT
   auto profile = PerformanceTestProfile();
   profile.http = true;